@@ -0,0 +1,10 @@
+(labels ((poly (code (x)
+           (+ (* (+ x 1) (- x 2))
+              (- (* (+ (* x x) (- x 3)) (+ x 4))
+                 (+ (* (- x 5) (+ x 6)) (* (+ x 7) (- x 8))))))))
+  (labelcall poly 3))
+(labels ((sum (code (n acc)
+           (if (< n 1)
+               acc
+               (labelcall sum (sub1 n) (+ acc (* n (- n 1))))))))
+  (labelcall sum 100000 0))
@@ -0,0 +1,9 @@
+(labels ((build (code (n acc)
+           (if (= n 0)
+               acc
+               (labelcall build (sub1 n) (cons n acc)))))
+         (length (code (list n)
+           (if (= n 10000)
+               n
+               (labelcall length (cdr list) (add1 n))))))
+  (labelcall length (labelcall build 10000 (cons 0 0)) 0))
@@ -0,0 +1,5 @@
+(labels ((fib (code (n)
+           (if (< n 2)
+               n
+               (+ (labelcall fib (- n 1)) (labelcall fib (- n 2)))))))
+  (labelcall fib 20))
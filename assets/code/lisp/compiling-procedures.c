@@ -7,12 +7,23 @@
 
 #define _GNU_SOURCE
 #include <assert.h>   // for assert
+#include <errno.h>    // for errno
+#include <fcntl.h>    // for open
 #include <stdbool.h>  // for bool
 #include <stddef.h>   // for NULL
 #include <stdint.h>   // for int32_t, etc
 #include <stdio.h>    // for getline, fprintf
+#include <stdlib.h>   // for abort
 #include <string.h>   // for memcpy
-#include <sys/mman.h> // for mmap
+#include <elf.h>      // for Elf64_Ehdr, etc
+#include <link.h>     // for dl_iterate_phdr
+#include <sys/mman.h> // for mmap, mremap, memfd_create
+#include <sys/stat.h> // for fstat
+#include <time.h>     // for clock_gettime
+#include <unistd.h>   // for read
+#ifdef __SSE2__
+#include <emmintrin.h> // for _mm_cmpeq_epi8, etc
+#endif
 #undef _GNU_SOURCE
 
 #include "greatest.h"
@@ -114,6 +125,53 @@ uword Object_pair_cdr(uword value) {
 
 // End Objects
 
+// Stats
+
+// Counters for finding out where time goes. Each phase is timed where it
+// happens rather than by its callers, so the numbers cover the REPL,
+// --eval-file, and the tests alike.
+
+typedef enum {
+  kPhaseRead,
+  kPhaseFold,
+  kPhaseCompile,
+  kPhaseMprotect,
+  kPhaseExecute,
+  kNumPhases,
+} Phase;
+
+const char *kPhaseNames[] = {
+    [kPhaseRead] = "read",
+    [kPhaseFold] = "fold",
+    [kPhaseCompile] = "compile",
+    [kPhaseMprotect] = "mprotect",
+    [kPhaseExecute] = "execute",
+};
+
+typedef struct {
+  word phase_ns[kNumPhases];
+  word phase_count[kNumPhases];
+  // AST pairs allocated, and their size in bytes
+  word ast_nodes;
+  word ast_bytes;
+} Stats;
+
+Stats stats;
+
+word Stats_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Charge the time since start, from Stats_now_ns, to phase.
+void Stats_record(Phase phase, word start) {
+  stats.phase_ns[phase] += Stats_now_ns() - start;
+  stats.phase_count[phase]++;
+}
+
+// End Stats
+
 // Buffer
 
 typedef unsigned char byte;
@@ -121,43 +179,133 @@ typedef unsigned char byte;
 typedef enum {
   kWritable,
   kExecutable,
+  // Writable through address and executable through exec_address at the
+  // same time; see Buffer_init_dual
+  kDualMapped,
 } BufferState;
 
 typedef struct {
   byte *address;
+  // Where the code runs from. The same as address unless kDualMapped.
+  byte *exec_address;
   BufferState state;
   word len;
   word capacity;
+  // The last position that a jump was made to land on. Peephole rewrites of
+  // the code at the end of the buffer never reach back past it.
+  word jump_target;
 } Buffer;
 
-byte *Buffer_alloc_writable(word capacity) {
+word max(word left, word right) { return left > right ? left : right; }
+
+word min(word left, word right) { return left < right ? left : right; }
+
+// mmap hands out whole pages anyway, so capacities are rounded up to them.
+word Buffer_round_to_pages(word capacity) {
+  word page_size = sysconf(_SC_PAGESIZE);
+  return (max(capacity, 1) + page_size - 1) / page_size * page_size;
+}
+
+byte *Buffer_alloc_writable(word capacity, int flags) {
   byte *result = mmap(/*addr=*/NULL, capacity, PROT_READ | PROT_WRITE,
-                      MAP_ANONYMOUS | MAP_PRIVATE,
+                      MAP_ANONYMOUS | MAP_PRIVATE | flags,
                       /*filedes=*/-1, /*off=*/0);
   assert(result != MAP_FAILED);
   return result;
 }
 
-void Buffer_init(Buffer *result, word capacity) {
-  result->address = Buffer_alloc_writable(capacity);
-  assert(result->address != MAP_FAILED);
+void Buffer_init_with_flags(Buffer *result, word capacity, int flags) {
+  result->address = Buffer_alloc_writable(capacity, flags);
+  result->exec_address = result->address;
   result->state = kWritable;
   result->len = 0;
   result->capacity = capacity;
+  result->jump_target = 0;
+}
+
+void Buffer_init(Buffer *result, word capacity) {
+  Buffer_init_with_flags(result, Buffer_round_to_pages(capacity),
+                         /*flags=*/0);
+}
+
+// For a buffer that may get very big: reserve address space for all of it
+// up front. The kernel only backs the pages that get written, and the buffer
+// never has to move.
+void Buffer_init_reserved(Buffer *result, word reservation) {
+  Buffer_init_with_flags(result, Buffer_round_to_pages(reservation),
+                         MAP_NORESERVE);
+}
+
+// Code space for a JIT that keeps going after some of its code has run: one
+// memfd mapped twice, read-write for the compiler and read-execute for the
+// generated code, so that neither view is ever writable and executable at
+// once. New code can be appended and earlier jumps and calls patched while
+// code compiled into the buffer already runs, without an mprotect (and the
+// TLB shootdown that comes with it) per compile. Running code must not move,
+// so the whole capacity is reserved up front and the buffer never grows; the
+// kernel only backs the pages that get written. Returns -1 if the system
+// cannot provide this, leaving result untouched.
+int Buffer_init_dual(Buffer *result, word capacity) {
+  capacity = Buffer_round_to_pages(capacity);
+  int fd = memfd_create("lisp-code", MFD_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  byte *address = MAP_FAILED;
+  byte *exec_address = MAP_FAILED;
+  if (ftruncate(fd, capacity) == 0) {
+    address = mmap(/*addr=*/NULL, capacity, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_NORESERVE, fd, /*off=*/0);
+    exec_address = mmap(/*addr=*/NULL, capacity, PROT_READ | PROT_EXEC,
+                        MAP_SHARED | MAP_NORESERVE, fd, /*off=*/0);
+  }
+  // The mappings keep the memory alive
+  close(fd);
+  if (address == MAP_FAILED || exec_address == MAP_FAILED) {
+    if (address != MAP_FAILED) {
+      munmap(address, capacity);
+    }
+    if (exec_address != MAP_FAILED) {
+      munmap(exec_address, capacity);
+    }
+    return -1;
+  }
+  *result = (Buffer){.address = address,
+                     .exec_address = exec_address,
+                     .state = kDualMapped,
+                     .len = 0,
+                     .capacity = capacity,
+                     .jump_target = 0};
+  return 0;
 }
 
 word Buffer_len(Buffer *buf) { return buf->len; }
 
+bool Buffer_is_executable(Buffer *buf) { return buf->state != kWritable; }
+
+// Record that some jump lands on the current position.
+void Buffer_mark_jump_target(Buffer *buf) { buf->jump_target = buf->len; }
+
 void Buffer_deinit(Buffer *buf) {
+  if (buf->exec_address != buf->address) {
+    munmap(buf->exec_address, buf->capacity);
+  }
   munmap(buf->address, buf->capacity);
   buf->address = NULL;
+  buf->exec_address = NULL;
   buf->len = 0;
   buf->capacity = 0;
 }
 
 int Buffer_make_executable(Buffer *buf) {
+  if (buf->state == kDualMapped) {
+    // Already is
+    return 0;
+  }
+  word start = Stats_now_ns();
   int result = mprotect(buf->address, buf->len, PROT_EXEC);
   buf->state = kExecutable;
+  Stats_record(kPhaseMprotect, start);
   return result;
 }
 
@@ -165,44 +313,71 @@ byte Buffer_at8(Buffer *buf, word pos) { return buf->address[pos]; }
 
 void Buffer_at_put8(Buffer *buf, word pos, byte b) { buf->address[pos] = b; }
 
-word max(word left, word right) { return left > right ? left : right; }
-
 void Buffer_ensure_capacity(Buffer *buf, word additional_capacity) {
   if (buf->len + additional_capacity <= buf->capacity) {
     return;
   }
-  word new_capacity =
-      max(buf->capacity * 2, buf->capacity + additional_capacity);
-  byte *address = Buffer_alloc_writable(new_capacity);
-  memcpy(address, buf->address, buf->len);
-  int result = munmap(buf->address, buf->capacity);
-  assert(result == 0 && "munmap failed");
+  if (buf->state == kDualMapped) {
+    // Code in it may be running, so it cannot move
+    fprintf(stderr, "Code space is full.\n");
+    abort();
+  }
+  word new_capacity = Buffer_round_to_pages(
+      max(buf->capacity * 2, buf->len + additional_capacity));
+  // The kernel moves the pages to a bigger range (if it cannot just extend
+  // them in place) instead of copying their contents
+  byte *address =
+      mremap(buf->address, buf->capacity, new_capacity, MREMAP_MAYMOVE);
+  assert(address != MAP_FAILED && "mremap failed");
   buf->address = address;
+  buf->exec_address = address;
   buf->capacity = new_capacity;
 }
 
+// The longest that an x86-64 instruction can be
+const word kMaxInstructionLength = 15;
+
+// Make room for size more bytes and return where they go. Code is encoded
+// straight into that memory, so each instruction checks the capacity once
+// instead of once per byte. Nothing is added until Buffer_commit.
+byte *Buffer_reserve(Buffer *buf, word size) {
+  Buffer_ensure_capacity(buf, size);
+  return buf->address + buf->len;
+}
+
+// Keep everything written after a Buffer_reserve, up to end.
+void Buffer_commit(Buffer *buf, byte *end) {
+  assert(end >= buf->address + buf->len);
+  assert(end <= buf->address + buf->capacity);
+  buf->len = end - buf->address;
+}
+
+// Store value little-endian at p, which need not be aligned, and return the
+// position just past it. x86-64 is little-endian, so this is one store.
+byte *Encode_imm32(byte *p, int32_t value) {
+  memcpy(p, &value, sizeof value);
+  return p + sizeof value;
+}
+
 void Buffer_write8(Buffer *buf, byte b) {
-  Buffer_ensure_capacity(buf, sizeof b);
-  Buffer_at_put8(buf, buf->len++, b);
+  byte *p = Buffer_reserve(buf, sizeof b);
+  *p++ = b;
+  Buffer_commit(buf, p);
 }
 
 void Buffer_write32(Buffer *buf, int32_t value) {
-  for (uword i = 0; i < sizeof(value); i++) {
-    Buffer_write8(buf, (value >> (i * kBitsPerByte)) & 0xff);
-  }
+  byte *p = Buffer_reserve(buf, sizeof value);
+  Buffer_commit(buf, Encode_imm32(p, value));
 }
 
 void Buffer_at_put32(Buffer *buf, word offset, int32_t value) {
-  for (uword i = 0; i < sizeof(value); i++) {
-    Buffer_at_put8(buf, offset + i, (value >> (i * kBitsPerByte)) & 0xff);
-  }
+  (void)Encode_imm32(buf->address + offset, value);
 }
 
 void Buffer_write_arr(Buffer *buf, const byte *arr, word arr_size) {
-  Buffer_ensure_capacity(buf, arr_size);
-  for (word i = 0; i < arr_size; i++) {
-    Buffer_write8(buf, arr[i]);
-  }
+  byte *p = Buffer_reserve(buf, arr_size);
+  memcpy(p, arr, arr_size);
+  Buffer_commit(buf, p + arr_size);
 }
 
 void Buffer_dump(Buffer *buf, FILE *fp) {
@@ -214,6 +389,193 @@ void Buffer_dump(Buffer *buf, FILE *fp) {
 
 // End Buffer
 
+// Heap
+
+// A generational copying collector for pairs. New pairs are bump-allocated
+// by generated code in the nursery. When the nursery fills up, generated code
+// calls Heap_collect, which promotes every live nursery pair into the old
+// generation (a minor collection). When the old generation does not have room
+// for the whole nursery, both generations are instead copied into a fresh old
+// generation (a major collection), which is mapped larger if it needs to be.
+//
+// Pairs are immutable once allocated, so an old pair can never point at a
+// young one and minor collections need no write barrier or remembered set.
+//
+// Roots are found by scanning the generated code's stack, which holds only
+// tagged objects and return addresses. Return addresses never point into the
+// heap, so any pair-tagged word that does is treated as a root and updated.
+
+typedef struct Heap Heap;
+
+typedef uword *(*HeapCollectFunction)(Heap *heap, uword *alloc_ptr,
+                                      uword *stack_bottom);
+
+struct Heap {
+  // Generated code reads the first two fields and writes the third. The limit
+  // is the highest address at which a new pair still fits in the nursery.
+  uword *limit;
+  HeapCollectFunction collect;
+  // One past the highest stack word the collector should scan: the stack
+  // pointer on entry to generated code, which points at the return address
+  // into C. Everything below it belongs to generated code.
+  uword *stack_top;
+  uword *nursery;
+  uword *nursery_end;
+  uword *old;
+  uword *old_top;
+  uword *old_end;
+  word num_minor_collections;
+  word num_major_collections;
+};
+
+const int kHeapLimitOffset = 0;
+const int kHeapCollectOffset = kWordSize;
+const int kHeapStackTopOffset = 2 * kWordSize;
+
+// Stored in the car of a pair that has been copied; the cdr holds the new
+// tagged pointer. This tag is not used by any object.
+const uword kForwardingMarker = 0x7;
+
+const word kNurserySize = 64 * 1024; // bytes
+const word kOldSize = 1024 * 1024;   // bytes
+
+uword *Heap_alloc_space(word size) {
+  void *result = mmap(/*addr=*/NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE,
+                      /*filedes=*/-1, /*off=*/0);
+  if (result == MAP_FAILED) {
+    fprintf(stderr, "Out of memory.\n");
+    abort();
+  }
+  return result;
+}
+
+uword *Heap_collect(Heap *heap, uword *alloc_ptr, uword *stack_bottom);
+
+void Heap_init(Heap *heap, word nursery_size, word old_size) {
+  heap->nursery = Heap_alloc_space(nursery_size);
+  heap->nursery_end = heap->nursery + nursery_size / kWordSize;
+  heap->limit = heap->nursery_end - kPairSize / kWordSize;
+  heap->collect = Heap_collect;
+  heap->old = heap->old_top = Heap_alloc_space(old_size);
+  heap->old_end = heap->old + old_size / kWordSize;
+  heap->stack_top = NULL;
+  heap->num_minor_collections = 0;
+  heap->num_major_collections = 0;
+}
+
+void Heap_deinit(Heap *heap) {
+  munmap(heap->nursery, (heap->nursery_end - heap->nursery) * kWordSize);
+  munmap(heap->old, (heap->old_end - heap->old) * kWordSize);
+  heap->nursery = heap->nursery_end = heap->limit = NULL;
+  heap->old = heap->old_top = heap->old_end = NULL;
+}
+
+typedef struct {
+  // Pairs in [from_start, from_end) and [nursery, nursery_top) get copied
+  uword *from_start;
+  uword *from_end;
+  uword *nursery;
+  uword *nursery_top;
+  uword *to_top;
+  uword *to_end;
+} Collection;
+
+bool Collection_in_from_space(Collection *c, uword *obj) {
+  return (obj >= c->nursery && obj < c->nursery_top) ||
+         (obj >= c->from_start && obj < c->from_end);
+}
+
+uword Collection_forward(Collection *c, uword value) {
+  if (!Object_is_pair(value)) {
+    return value;
+  }
+  uword *obj = (uword *)Object_address((void *)value);
+  if (!Collection_in_from_space(c, obj)) {
+    return value;
+  }
+  if (obj[kCarIndex] == kForwardingMarker) {
+    return obj[kCdrIndex];
+  }
+  assert(c->to_top + kPairSize / kWordSize <= c->to_end);
+  uword *copy = c->to_top;
+  c->to_top += kPairSize / kWordSize;
+  copy[kCarIndex] = obj[kCarIndex];
+  copy[kCdrIndex] = obj[kCdrIndex];
+  uword result = (uword)copy | kPairTag;
+  obj[kCarIndex] = kForwardingMarker;
+  obj[kCdrIndex] = result;
+  return result;
+}
+
+void Collection_scan_stack(Collection *c, uword *stack_bottom,
+                           uword *stack_top) {
+  for (uword *p = stack_bottom; p < stack_top; p++) {
+    *p = Collection_forward(c, *p);
+  }
+}
+
+// Copy everything reachable from the stack into to-space, breadth-first.
+void Collection_run(Collection *c, uword *stack_bottom, uword *stack_top) {
+  uword *scan = c->to_top;
+  Collection_scan_stack(c, stack_bottom, stack_top);
+  for (; scan < c->to_top; scan++) {
+    *scan = Collection_forward(c, *scan);
+  }
+}
+
+void Heap_collect_minor(Heap *heap, uword *alloc_ptr, uword *stack_bottom) {
+  Collection c = {.from_start = NULL,
+                  .from_end = NULL,
+                  .nursery = heap->nursery,
+                  .nursery_top = alloc_ptr,
+                  .to_top = heap->old_top,
+                  .to_end = heap->old_end};
+  Collection_run(&c, stack_bottom, heap->stack_top);
+  heap->old_top = c.to_top;
+  heap->num_minor_collections++;
+}
+
+void Heap_collect_major(Heap *heap, uword *alloc_ptr, uword *stack_bottom) {
+  word old_size = (heap->old_end - heap->old) * kWordSize;
+  // Grow until to-space could hold twice everything in from-space, so it
+  // cannot overflow and is at least half empty afterward
+  word from_used = ((heap->old_top - heap->old) + (alloc_ptr - heap->nursery)) *
+                   kWordSize;
+  word to_size = old_size;
+  while (to_size < 2 * from_used) {
+    to_size *= 2;
+  }
+  uword *to_space = Heap_alloc_space(to_size);
+  Collection c = {.from_start = heap->old,
+                  .from_end = heap->old_top,
+                  .nursery = heap->nursery,
+                  .nursery_top = alloc_ptr,
+                  .to_top = to_space,
+                  .to_end = to_space + to_size / kWordSize};
+  Collection_run(&c, stack_bottom, heap->stack_top);
+  munmap(heap->old, old_size);
+  heap->old = to_space;
+  heap->old_top = c.to_top;
+  heap->old_end = c.to_end;
+  heap->num_major_collections++;
+}
+
+// Called from generated code when the nursery is full. Returns the new
+// allocation pointer, which is always the start of the (now empty) nursery.
+uword *Heap_collect(Heap *heap, uword *alloc_ptr, uword *stack_bottom) {
+  assert(heap->stack_top != NULL);
+  word nursery_used = alloc_ptr - heap->nursery;
+  if (heap->old_end - heap->old_top >= nursery_used) {
+    Heap_collect_minor(heap, alloc_ptr, stack_bottom);
+  } else {
+    Heap_collect_major(heap, alloc_ptr, stack_bottom);
+  }
+  return heap->nursery;
+}
+
+// End Heap
+
 // Emit
 
 typedef enum {
@@ -225,6 +587,14 @@ typedef enum {
   kRbp,
   kRsi,
   kRdi,
+  kR8,
+  kR9,
+  kR10,
+  kR11,
+  kR12,
+  kR13,
+  kR14,
+  kR15,
 } Register;
 
 typedef enum {
@@ -249,11 +619,32 @@ typedef enum {
   kNotCarry = kAboveOrEqual,
   kEqual,
   kZero = kEqual,
-  kLess = 0xc,
+  kNotEqual,
+  kNotZero = kNotEqual,
+  kBelowOrEqual,
+  kNotAbove = kBelowOrEqual,
+  kAbove,
+  kNotBelowOrEqual = kAbove,
+  kSign,
+  kNotSign,
+  kParity,
+  kParityEven = kParity,
+  kNotParity,
+  kParityOdd = kNotParity,
+  kLess,
   kNotGreaterOrEqual = kLess,
-  // TODO(max): Add more
+  kGreaterOrEqual,
+  kNotLess = kGreaterOrEqual,
+  kLessOrEqual,
+  kNotGreater = kLessOrEqual,
+  kGreater,
+  kNotLessOrEqual = kGreater,
 } Condition;
 
+// Conditions come in pairs that differ only in the low bit, each the
+// negation of the other.
+Condition Condition_invert(Condition cond) { return cond ^ 1; }
+
 typedef struct Indirect {
   Register reg;
   int8_t disp;
@@ -275,6 +666,12 @@ Indirect Ind(Register reg, int8_t disp) {
 
 const byte kRexPrefix = 0x48;
 
+// REX.W plus the extension bits needed to address r8-r15 in the ModR/M reg
+// field (REX.R) or the ModR/M rm/SIB base field (REX.B).
+byte rex(byte reg, byte rm) {
+  return kRexPrefix | (((reg >> 3) & 1) << 2) | ((rm >> 3) & 1);
+}
+
 typedef enum {
   Scale1 = 0,
   Scale2,
@@ -307,185 +704,469 @@ byte sib(Register base, Index index, Scale scale) {
 }
 
 void Emit_mov_reg_imm32(Buffer *buf, Register dst, int32_t src) {
-  Buffer_write8(buf, kRexPrefix);
-  Buffer_write8(buf, 0xc7);
-  Buffer_write8(buf, modrm(/*direct*/ 3, dst, 0));
-  Buffer_write32(buf, src);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(0, dst);
+  *p++ = 0xc7;
+  *p++ = modrm(/*direct*/ 3, dst, 0);
+  p = Encode_imm32(p, src);
+  Buffer_commit(buf, p);
 }
 
 void Emit_ret(Buffer *buf) { Buffer_write8(buf, 0xc3); }
 
 void Emit_add_reg_imm32(Buffer *buf, Register dst, int32_t src) {
-  Buffer_write8(buf, kRexPrefix);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(0, dst);
   if (dst == kRax) {
     // Optimization: add eax, {imm32} can either be encoded as 05 {imm32} or 81
     // c0 {imm32}.
-    Buffer_write8(buf, 0x05);
+    *p++ = 0x05;
   } else {
-    Buffer_write8(buf, 0x81);
-    Buffer_write8(buf, modrm(/*direct*/ 3, dst, 0));
+    *p++ = 0x81;
+    *p++ = modrm(/*direct*/ 3, dst, 0);
   }
-  Buffer_write32(buf, src);
+  p = Encode_imm32(p, src);
+  Buffer_commit(buf, p);
 }
 
 void Emit_sub_reg_imm32(Buffer *buf, Register dst, int32_t src) {
-  Buffer_write8(buf, kRexPrefix);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(0, dst);
   if (dst == kRax) {
     // Optimization: sub eax, {imm32} can either be encoded as 2d {imm32} or 81
     // e8 {imm32}.
-    Buffer_write8(buf, 0x2d);
+    *p++ = 0x2d;
   } else {
-    Buffer_write8(buf, 0x81);
-    Buffer_write8(buf, modrm(/*direct*/ 3, dst, 5));
+    *p++ = 0x81;
+    *p++ = modrm(/*direct*/ 3, dst, 5);
   }
-  Buffer_write32(buf, src);
+  p = Encode_imm32(p, src);
+  Buffer_commit(buf, p);
 }
 
 void Emit_shl_reg_imm8(Buffer *buf, Register dst, int8_t bits) {
-  Buffer_write8(buf, kRexPrefix);
-  Buffer_write8(buf, 0xc1);
-  Buffer_write8(buf, modrm(/*direct*/ 3, dst, 4));
-  Buffer_write8(buf, bits);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(0, dst);
+  *p++ = 0xc1;
+  *p++ = modrm(/*direct*/ 3, dst, 4);
+  *p++ = bits;
+  Buffer_commit(buf, p);
 }
 
 void Emit_shr_reg_imm8(Buffer *buf, Register dst, int8_t bits) {
-  Buffer_write8(buf, kRexPrefix);
-  Buffer_write8(buf, 0xc1);
-  Buffer_write8(buf, modrm(/*direct*/ 3, dst, 5));
-  Buffer_write8(buf, bits);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(0, dst);
+  *p++ = 0xc1;
+  *p++ = modrm(/*direct*/ 3, dst, 5);
+  *p++ = bits;
+  Buffer_commit(buf, p);
 }
 
 void Emit_or_reg_imm8(Buffer *buf, Register dst, uint8_t tag) {
-  Buffer_write8(buf, kRexPrefix);
-  Buffer_write8(buf, 0x83);
-  Buffer_write8(buf, modrm(/*direct*/ 3, dst, 1));
-  Buffer_write8(buf, tag);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(0, dst);
+  *p++ = 0x83;
+  *p++ = modrm(/*direct*/ 3, dst, 1);
+  *p++ = tag;
+  Buffer_commit(buf, p);
 }
 
 void Emit_and_reg_imm8(Buffer *buf, Register dst, uint8_t tag) {
-  Buffer_write8(buf, kRexPrefix);
-  Buffer_write8(buf, 0x83);
-  Buffer_write8(buf, modrm(/*direct*/ 3, dst, 4));
-  Buffer_write8(buf, tag);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(0, dst);
+  *p++ = 0x83;
+  *p++ = modrm(/*direct*/ 3, dst, 4);
+  *p++ = tag;
+  Buffer_commit(buf, p);
 }
 
 void Emit_cmp_reg_imm32(Buffer *buf, Register left, int32_t right) {
-  Buffer_write8(buf, kRexPrefix);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(0, left);
   if (left == kRax) {
     // Optimization: cmp rax, {imm32} can either be encoded as 3d {imm32} or 81
     // f8 {imm32}.
-    Buffer_write8(buf, 0x3d);
+    *p++ = 0x3d;
   } else {
-    Buffer_write8(buf, 0x81);
-    Buffer_write8(buf, modrm(/*direct*/ 3, left, 7));
+    *p++ = 0x81;
+    *p++ = modrm(/*direct*/ 3, left, 7);
   }
-  Buffer_write32(buf, right);
+  p = Encode_imm32(p, right);
+  Buffer_commit(buf, p);
 }
 
 void Emit_setcc_imm8(Buffer *buf, Condition cond, PartialRegister dst) {
   // TODO(max): Emit a REX prefix if we need anything above RDI.
-  Buffer_write8(buf, 0x0f);
-  Buffer_write8(buf, 0x90 + cond);
-  Buffer_write8(buf, 0xc0 + (dst & 0x7));
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = 0x0f;
+  *p++ = 0x90 + cond;
+  *p++ = 0xc0 + (dst & 0x7);
+  Buffer_commit(buf, p);
 }
 
 uint8_t disp8(int8_t disp) { return disp >= 0 ? disp : 0x100 + disp; }
 
-void Emit_address_disp8(Buffer *buf, Register direct, Indirect indirect) {
-  if (indirect.reg == kRsp) {
-    Buffer_write8(buf, modrm(/*disp8*/ 1, kIndexNone, direct));
-    Buffer_write8(buf, sib(kRsp, kIndexNone, Scale1));
+byte *Encode_address_disp8(byte *p, Register direct, Indirect indirect) {
+  // rsp and r12 share an encoding that means "SIB byte follows"
+  if ((indirect.reg & 0x7) == kRsp) {
+    *p++ = modrm(/*disp8*/ 1, kIndexNone, direct);
+    *p++ = sib(kRsp, kIndexNone, Scale1);
   } else {
-    Buffer_write8(buf, modrm(/*disp8*/ 1, indirect.reg, direct));
+    *p++ = modrm(/*disp8*/ 1, indirect.reg, direct);
   }
-  Buffer_write8(buf, disp8(indirect.disp));
+  *p++ = disp8(indirect.disp);
+  return p;
 }
 
 // mov [dst+disp], src
 // or
 // mov %src, disp(%dst)
 void Emit_store_reg_indirect(Buffer *buf, Indirect dst, Register src) {
-  Buffer_write8(buf, kRexPrefix);
-  Buffer_write8(buf, 0x89);
-  Emit_address_disp8(buf, src, dst);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(src, dst.reg);
+  *p++ = 0x89;
+  p = Encode_address_disp8(p, src, dst);
+  Buffer_commit(buf, p);
 }
 
 // add dst, [src+disp]
 // or
 // add disp(%src), %dst
 void Emit_add_reg_indirect(Buffer *buf, Register dst, Indirect src) {
-  Buffer_write8(buf, kRexPrefix);
-  Buffer_write8(buf, 0x03);
-  Emit_address_disp8(buf, dst, src);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(dst, src.reg);
+  *p++ = 0x03;
+  p = Encode_address_disp8(p, dst, src);
+  Buffer_commit(buf, p);
 }
 
 // sub dst, [src+disp]
 // or
 // sub disp(%src), %dst
 void Emit_sub_reg_indirect(Buffer *buf, Register dst, Indirect src) {
-  Buffer_write8(buf, kRexPrefix);
-  Buffer_write8(buf, 0x2b);
-  Emit_address_disp8(buf, dst, src);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(dst, src.reg);
+  *p++ = 0x2b;
+  p = Encode_address_disp8(p, dst, src);
+  Buffer_commit(buf, p);
 }
 
 // mul rax, [src+disp]
 // or
 // mul disp(%src), %rax
 void Emit_mul_reg_indirect(Buffer *buf, Indirect src) {
-  Buffer_write8(buf, kRexPrefix);
-  Buffer_write8(buf, 0xf7);
-  Emit_address_disp8(buf, /*subop*/ 4, src);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(0, src.reg);
+  *p++ = 0xf7;
+  p = Encode_address_disp8(p, /*subop*/ 4, src);
+  Buffer_commit(buf, p);
 }
 
 // cmp left, [right+disp]
 // or
 // cmp disp(%right), %left
 void Emit_cmp_reg_indirect(Buffer *buf, Register left, Indirect right) {
-  Buffer_write8(buf, kRexPrefix);
-  Buffer_write8(buf, 0x3b);
-  Emit_address_disp8(buf, left, right);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(left, right.reg);
+  *p++ = 0x3b;
+  p = Encode_address_disp8(p, left, right);
+  Buffer_commit(buf, p);
 }
 
 // mov dst, [src+disp]
 // or
 // mov disp(%src), %dst
 void Emit_load_reg_indirect(Buffer *buf, Register dst, Indirect src) {
-  Buffer_write8(buf, kRexPrefix);
-  Buffer_write8(buf, 0x8b);
-  Emit_address_disp8(buf, dst, src);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(dst, src.reg);
+  *p++ = 0x8b;
+  p = Encode_address_disp8(p, dst, src);
+  Buffer_commit(buf, p);
+}
+
+// lea dst, [src+disp]
+// or
+// lea disp(%src), %dst
+void Emit_lea_reg_indirect(Buffer *buf, Register dst, Indirect src) {
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(dst, src.reg);
+  *p++ = 0x8d;
+  p = Encode_address_disp8(p, dst, src);
+  Buffer_commit(buf, p);
+}
+
+// call [target+disp]
+void Emit_call_indirect(Buffer *buf, Indirect target) {
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  // The operand size is always 64 bits, so only emit REX to reach r8-r15
+  if (target.reg >= kR8) {
+    *p++ = 0x41;
+  }
+  *p++ = 0xff;
+  p = Encode_address_disp8(p, /*subop*/ 2, target);
+  Buffer_commit(buf, p);
+}
+
+void Emit_push_reg(Buffer *buf, Register src) {
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  if (src >= kR8) {
+    *p++ = 0x41;
+  }
+  *p++ = 0x50 + (src & 0x7);
+  Buffer_commit(buf, p);
 }
 
 uint32_t disp32(int32_t disp) { return disp >= 0 ? disp : 0x100000000 + disp; }
 
 word Emit_jcc(Buffer *buf, Condition cond, int32_t offset) {
-  Buffer_write8(buf, 0x0f);
-  Buffer_write8(buf, 0x80 + cond);
-  word pos = Buffer_len(buf);
-  Buffer_write32(buf, disp32(offset));
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = 0x0f;
+  *p++ = 0x80 + cond;
+  word pos = p - buf->address;
+  p = Encode_imm32(p, disp32(offset));
+  Buffer_commit(buf, p);
   return pos;
 }
 
 word Emit_jmp(Buffer *buf, int32_t offset) {
-  Buffer_write8(buf, 0xe9);
-  word pos = Buffer_len(buf);
-  Buffer_write32(buf, disp32(offset));
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = 0xe9;
+  word pos = p - buf->address;
+  p = Encode_imm32(p, disp32(offset));
+  Buffer_commit(buf, p);
   return pos;
 }
 
 void Emit_backpatch_imm32(Buffer *buf, int32_t target_pos) {
+  Buffer_mark_jump_target(buf);
   word current_pos = Buffer_len(buf);
   word relative_pos = current_pos - target_pos - sizeof(int32_t);
   Buffer_at_put32(buf, target_pos, disp32(relative_pos));
 }
 
 void Emit_mov_reg_reg(Buffer *buf, Register dst, Register src) {
-  Buffer_write8(buf, kRexPrefix);
-  Buffer_write8(buf, 0x89);
-  Buffer_write8(buf, modrm(/*direct*/ 3, dst, src));
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(src, dst);
+  *p++ = 0x89;
+  *p++ = modrm(/*direct*/ 3, dst, src);
+  Buffer_commit(buf, p);
+}
+
+void Emit_add_reg_reg(Buffer *buf, Register dst, Register src) {
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(src, dst);
+  *p++ = 0x01;
+  *p++ = modrm(/*direct*/ 3, dst, src);
+  Buffer_commit(buf, p);
+}
+
+void Emit_sub_reg_reg(Buffer *buf, Register dst, Register src) {
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(src, dst);
+  *p++ = 0x29;
+  *p++ = modrm(/*direct*/ 3, dst, src);
+  Buffer_commit(buf, p);
+}
+
+// imul dst, src
+// Unlike mul, this does not clobber rdx, so rdx can hold a temporary.
+void Emit_imul_reg_reg(Buffer *buf, Register dst, Register src) {
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(dst, src);
+  *p++ = 0x0f;
+  *p++ = 0xaf;
+  *p++ = modrm(/*direct*/ 3, src, dst);
+  Buffer_commit(buf, p);
+}
+
+void Emit_cmp_reg_reg(Buffer *buf, Register left, Register right) {
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  *p++ = rex(right, left);
+  *p++ = 0x39;
+  *p++ = modrm(/*direct*/ 3, left, right);
+  Buffer_commit(buf, p);
+}
+
+// The low byte of rsp, rbp, rsi, and rdi needs a REX prefix of its own, and
+// nothing tests them, so those are not supported.
+void Emit_test_reg8_imm8(Buffer *buf, Register left, uint8_t right) {
+  assert(left < kRsp || left >= kR8);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  if (left == kRax) {
+    // Optimization: test al, {imm8} can either be encoded as a8 {imm8} or f6
+    // c0 {imm8}.
+    *p++ = 0xa8;
+  } else {
+    if (left >= kR8) {
+      *p++ = 0x41;
+    }
+    *p++ = 0xf6;
+    *p++ = modrm(/*direct*/ 3, left, 0);
+  }
+  *p++ = right;
+  Buffer_commit(buf, p);
+}
+
+void Emit_cmp_reg8_imm8(Buffer *buf, Register left, uint8_t right) {
+  assert(left < kRsp || left >= kR8);
+  byte *p = Buffer_reserve(buf, kMaxInstructionLength);
+  if (left == kRax) {
+    // Optimization: cmp al, {imm8} can either be encoded as 3c {imm8} or 80
+    // f8 {imm8}.
+    *p++ = 0x3c;
+  } else {
+    if (left >= kR8) {
+      *p++ = 0x41;
+    }
+    *p++ = 0x80;
+    *p++ = modrm(/*direct*/ 3, left, 7);
+  }
+  *p++ = right;
+  Buffer_commit(buf, p);
 }
 
 // End Emit
 
+// Peephole
+
+// Rewrites of the code at the end of the buffer, made right before emitting
+// the instruction that would make it redundant. Each one matches the bytes
+// that the Emit functions above produce, and only if no jump lands inside
+// them, since that code would still expect the bytes to be there.
+
+// The position that the last len bytes of buf start at, or -1 if they are
+// not there to rewrite.
+word Peephole_tail(Buffer *buf, word len) {
+  word start = Buffer_len(buf) - len;
+  if (start < 0 || start < buf->jump_target) {
+    return -1;
+  }
+  return start;
+}
+
+// If buf ends with code that materializes a condition as a boolean (see
+// Compile_bool_from_flags), remove it and return the condition in *cond.
+// The flags it read are still set.
+bool Peephole_take_bool_from_flags(Buffer *buf, Condition *cond) {
+  const byte pattern[] = {
+      // mov rax, 0
+      0x48, 0xc7, 0xc0, 0x00, 0x00, 0x00, 0x00,
+      // setcc al
+      0x0f, 0x90, 0xc0,
+      // shl rax, kBoolShift
+      0x48, 0xc1, 0xe0, kBoolShift,
+      // or rax, kBoolTag
+      0x48, 0x83, 0xc8, kBoolTag};
+  const word setcc_pos = 8;
+  word start = Peephole_tail(buf, sizeof pattern);
+  if (start < 0) {
+    return false;
+  }
+  byte *code = buf->address + start;
+  for (word i = 0; i < (word)sizeof pattern; i++) {
+    if (i != setcc_pos && code[i] != pattern[i]) {
+      return false;
+    }
+  }
+  if ((code[setcc_pos] & 0xf0) != 0x90) {
+    return false;
+  }
+  *cond = code[setcc_pos] & 0x0f;
+  buf->len = start;
+  return true;
+}
+
+// mov dst, [rsp+disp], unless buf ends with a store of some register to that
+// same slot. Then the value is still in that register and the load becomes
+// a register move, or nothing at all.
+void Peephole_load_reg_stack(Buffer *buf, Register dst, int8_t disp) {
+  word start = Peephole_tail(buf, 5);
+  if (start >= 0) {
+    // See Emit_store_reg_indirect and Emit_address_disp8. The register is
+    // split between REX.R and the ModR/M reg field.
+    byte *code = buf->address + start;
+    Register src = (((code[0] >> 2) & 1) << 3) | ((code[2] >> 3) & 0x7);
+    if (code[0] == rex(src, kRsp) && code[1] == 0x89 &&
+        code[2] == modrm(/*disp8*/ 1, kIndexNone, src) &&
+        code[3] == sib(kRsp, kIndexNone, Scale1) && code[4] == disp8(disp)) {
+      if (src != dst) {
+        Emit_mov_reg_reg(buf, dst, src);
+      }
+      return;
+    }
+  }
+  Emit_load_reg_indirect(buf, dst, Ind(kRsp, disp));
+}
+
+// mov dst, src, unless buf ends with mov src, dst.
+void Peephole_mov_reg_reg(Buffer *buf, Register dst, Register src) {
+  word start = Peephole_tail(buf, 3);
+  if (start >= 0) {
+    byte *code = buf->address + start;
+    if (code[0] == rex(dst, src) && code[1] == 0x89 &&
+        code[2] == modrm(/*direct*/ 3, src, dst)) {
+      return;
+    }
+  }
+  Emit_mov_reg_reg(buf, dst, src);
+}
+
+// End Peephole
+
+// Arena
+
+// A bump allocator. It hands out zeroed, word-aligned memory from big chunks
+// and frees all of it at once.
+
+typedef struct ArenaChunk {
+  struct ArenaChunk *prev;
+  word size;
+  byte data[];
+} ArenaChunk;
+
+typedef struct {
+  ArenaChunk *chunk;
+  byte *ptr;
+  byte *end;
+} Arena;
+
+const word kArenaChunkSize = 64 * 1024; // bytes
+
+void Arena_init(Arena *arena) {
+  arena->chunk = NULL;
+  arena->ptr = NULL;
+  arena->end = NULL;
+}
+
+void *Arena_alloc(Arena *arena, word size) {
+  size = (size + kWordSize - 1) & ~(kWordSize - 1);
+  if (arena->end - arena->ptr < size) {
+    word chunk_size = max(kArenaChunkSize, size);
+    ArenaChunk *chunk = malloc(sizeof *chunk + chunk_size);
+    assert(chunk != NULL);
+    chunk->prev = arena->chunk;
+    chunk->size = chunk_size;
+    arena->chunk = chunk;
+    arena->ptr = chunk->data;
+    arena->end = chunk->data + chunk_size;
+  }
+  void *result = arena->ptr;
+  arena->ptr += size;
+  memset(result, 0, size);
+  return result;
+}
+
+void Arena_release(Arena *arena) {
+  while (arena->chunk != NULL) {
+    ArenaChunk *prev = arena->chunk->prev;
+    free(arena->chunk);
+    arena->chunk = prev;
+  }
+  Arena_init(arena);
+}
+
+// End Arena
+
 // AST
 
 typedef struct ASTNode ASTNode;
@@ -495,8 +1176,66 @@ typedef struct Pair {
   ASTNode *cdr;
 } Pair;
 
+// Symbols that the compiler treats specially get an ID when they are
+// interned, so that dispatching on them is a switch instead of a chain of
+// string compares.
+typedef enum {
+  kNotPrimitive = 0,
+  kPrimitiveAdd1,
+  kPrimitiveSub1,
+  kPrimitiveIntegerToChar,
+  kPrimitiveCharToInteger,
+  kPrimitiveIsNil,
+  kPrimitiveIsZero,
+  kPrimitiveNot,
+  kPrimitiveIsInteger,
+  kPrimitiveIsBoolean,
+  kPrimitiveAdd,
+  kPrimitiveSub,
+  kPrimitiveMul,
+  kPrimitiveEqual,
+  kPrimitiveLess,
+  kPrimitiveCons,
+  kPrimitiveCar,
+  kPrimitiveCdr,
+  kPrimitiveLet,
+  kPrimitiveIf,
+  kPrimitiveLabels,
+  kPrimitiveCode,
+  kPrimitiveLabelcall,
+  kNumPrimitives,
+} Primitive;
+
+const char *kPrimitiveNames[] = {
+    [kPrimitiveAdd1] = "add1",
+    [kPrimitiveSub1] = "sub1",
+    [kPrimitiveIntegerToChar] = "integer->char",
+    [kPrimitiveCharToInteger] = "char->integer",
+    [kPrimitiveIsNil] = "nil?",
+    [kPrimitiveIsZero] = "zero?",
+    [kPrimitiveNot] = "not",
+    [kPrimitiveIsInteger] = "integer?",
+    [kPrimitiveIsBoolean] = "boolean?",
+    [kPrimitiveAdd] = "+",
+    [kPrimitiveSub] = "-",
+    [kPrimitiveMul] = "*",
+    [kPrimitiveEqual] = "=",
+    [kPrimitiveLess] = "<",
+    [kPrimitiveCons] = "cons",
+    [kPrimitiveCar] = "car",
+    [kPrimitiveCdr] = "cdr",
+    [kPrimitiveLet] = "let",
+    [kPrimitiveIf] = "if",
+    [kPrimitiveLabels] = "labels",
+    [kPrimitiveCode] = "code",
+    [kPrimitiveLabelcall] = "labelcall",
+};
+
 typedef struct Symbol {
   word length;
+  Primitive primitive;
+  // Dense index in interning order, for tables keyed by symbol
+  word id;
   char cstr[];
 } Symbol;
 
@@ -540,7 +1279,16 @@ bool AST_is_error(ASTNode *node) { return (uword)node == Object_error(); }
 
 ASTNode *AST_error() { return (ASTNode *)Object_error(); }
 
+// When set, nodes are allocated in this arena instead of with calloc. They
+// all go away with Arena_release, so AST_heap_free leaves them alone.
+Arena *ast_arena = NULL;
+
 ASTNode *AST_heap_alloc(unsigned char tag, uword size) {
+  stats.ast_nodes++;
+  stats.ast_bytes += size;
+  if (ast_arena != NULL) {
+    return (ASTNode *)((uword)Arena_alloc(ast_arena, size) | tag);
+  }
   // Initialize to 0
   uword address = (uword)calloc(size, 1);
   return (ASTNode *)(address | tag);
@@ -586,26 +1334,94 @@ void AST_pair_set_cdr(ASTNode *node, ASTNode *cdr) {
   AST_as_pair(node)->cdr = cdr;
 }
 
+// Symbols are interned and live forever, so only pairs get freed
 void AST_heap_free(ASTNode *node) {
-  if (!AST_is_heap_object(node)) {
+  if (!AST_is_pair(node) || ast_arena != NULL) {
     return;
   }
-  if (AST_is_pair(node)) {
-    AST_heap_free(AST_pair_car(node));
-    AST_heap_free(AST_pair_cdr(node));
-  }
+  AST_heap_free(AST_pair_car(node));
+  AST_heap_free(AST_pair_cdr(node));
   free((void *)Object_address(node));
 }
 
 Symbol *AST_as_symbol(ASTNode *node);
 
+// FNV-1a
+uword hash_cstr(const char *str) {
+  uword hash = 0xcbf29ce484222325;
+  for (; *str != '\0'; str++) {
+    hash ^= (byte)*str;
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+// Every symbol with a given name is the same node, so symbols (and their
+// cstrs) can be compared by pointer. Open addressing with linear probing; the
+// capacity is a power of two and at most half of it is used.
+typedef struct {
+  ASTNode **slots;
+  word capacity;
+  word num_symbols;
+} SymbolTable;
+
+SymbolTable symbol_table = {.slots = NULL, .capacity = 0, .num_symbols = 0};
+
+ASTNode **SymbolTable_find_slot(ASTNode **slots, word capacity,
+                                const char *str) {
+  for (uword i = hash_cstr(str) & (capacity - 1);;
+       i = (i + 1) & (capacity - 1)) {
+    if (slots[i] == NULL ||
+        strcmp(AST_as_symbol(slots[i])->cstr, str) == 0) {
+      return &slots[i];
+    }
+  }
+}
+
+void SymbolTable_grow(SymbolTable *table) {
+  word capacity = table->capacity ? table->capacity * 2 : 256;
+  ASTNode **slots = calloc(capacity, sizeof *slots);
+  assert(slots != NULL);
+  for (word i = 0; i < table->capacity; i++) {
+    if (table->slots[i] != NULL) {
+      const char *cstr = AST_as_symbol(table->slots[i])->cstr;
+      *SymbolTable_find_slot(slots, capacity, cstr) = table->slots[i];
+    }
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->capacity = capacity;
+}
+
+Primitive Primitive_lookup(const char *str) {
+  for (word i = kNotPrimitive + 1; i < kNumPrimitives; i++) {
+    if (strcmp(kPrimitiveNames[i], str) == 0) {
+      return i;
+    }
+  }
+  return kNotPrimitive;
+}
+
 ASTNode *AST_new_symbol(const char *str) {
+  if (2 * (symbol_table.num_symbols + 1) > symbol_table.capacity) {
+    SymbolTable_grow(&symbol_table);
+  }
+  ASTNode **slot =
+      SymbolTable_find_slot(symbol_table.slots, symbol_table.capacity, str);
+  if (*slot != NULL) {
+    return *slot;
+  }
   word data_length = strlen(str) + 1; // for NUL
-  ASTNode *node = AST_heap_alloc(kSymbolTag, sizeof(Symbol) + data_length);
-  Symbol *s = AST_as_symbol(node);
+  // Not in ast_arena, since the table outlives it
+  Symbol *s = calloc(sizeof(Symbol) + data_length, 1);
+  assert(s != NULL);
   s->length = data_length;
+  s->primitive = Primitive_lookup(str);
+  s->id = symbol_table.num_symbols;
   memcpy(s->cstr, str, data_length);
-  return node;
+  *slot = (ASTNode *)((uword)s | kSymbolTag);
+  symbol_table.num_symbols++;
+  return *slot;
 }
 
 bool AST_is_symbol(ASTNode *node) {
@@ -625,6 +1441,20 @@ bool AST_symbol_matches(ASTNode *node, const char *cstr) {
   return strcmp(AST_symbol_cstr(node), cstr) == 0;
 }
 
+Primitive AST_symbol_primitive(ASTNode *node) {
+  return AST_as_symbol(node)->primitive;
+}
+
+ASTNode *list1(ASTNode *item0) { return AST_new_pair(item0, AST_nil()); }
+
+ASTNode *list2(ASTNode *item0, ASTNode *item1) {
+  return AST_new_pair(item0, list1(item1));
+}
+
+ASTNode *list3(ASTNode *item0, ASTNode *item1, ASTNode *item2) {
+  return AST_new_pair(item0, list2(item1, item2));
+}
+
 int node_to_str(ASTNode *node, char *buf, word size);
 
 int list_to_str(ASTNode *node, char *buf, word size) {
@@ -684,20 +1514,149 @@ char *AST_to_cstr(ASTNode *node) {
 
 // Reader
 
-void advance(word *pos) { ++*pos; }
+// The reader pulls characters from one of three sources: a NUL-terminated
+// string, a whole file mapped into memory, or a file descriptor read in
+// fixed-size chunks. When a chunk runs out in the middle of a datum, the
+// reader reads the next chunk and carries on, so a source can hold any number
+// of top-level forms and none of them has to fit in one chunk.
+typedef struct {
+  const char *data;
+  word pos;
+  word len;
+  // The descriptor to read more chunks from, or -1 once it is exhausted (or
+  // if all of the input is already in data)
+  int fd;
+  char *chunk;
+  word chunk_size;
+  // The mapping backing data, if the input is a mapped file
+  void *map;
+  word map_len;
+} Reader;
+
+// The longest lookahead the reader needs, for things like "#t" and "-1"
+const word kReaderLookahead = 2;
+
+const word kReaderChunkSize = 64 * 1024; // bytes
+
+void Reader_init_cstr(Reader *reader, const char *input) {
+  *reader = (Reader){.data = input,
+                     .pos = 0,
+                     .len = strlen(input),
+                     .fd = -1,
+                     .chunk = NULL,
+                     .chunk_size = 0,
+                     .map = NULL,
+                     .map_len = 0};
+}
+
+void Reader_init_fd(Reader *reader, int fd, word chunk_size) {
+  assert(chunk_size >= kReaderLookahead);
+  char *chunk = malloc(chunk_size);
+  assert(chunk != NULL);
+  *reader = (Reader){.data = chunk,
+                     .pos = 0,
+                     .len = 0,
+                     .fd = fd,
+                     .chunk = chunk,
+                     .chunk_size = chunk_size,
+                     .map = NULL,
+                     .map_len = 0};
+}
+
+// Map the file at path and read from it without copying. Returns 0 on
+// success.
+int Reader_init_file(Reader *reader, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+  Reader_init_cstr(reader, "");
+  if (st.st_size > 0) {
+    void *map = mmap(/*addr=*/NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                     /*offset=*/0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    // Forms are read front to back, once
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    reader->data = map;
+    reader->len = st.st_size;
+    reader->map = map;
+    reader->map_len = st.st_size;
+  }
+  // The mapping outlives the descriptor
+  close(fd);
+  return 0;
+}
 
-char next(char *input, word *pos) {
-  advance(pos);
-  return input[*pos];
+void Reader_deinit(Reader *reader) {
+  free(reader->chunk);
+  if (reader->map != NULL) {
+    munmap(reader->map, reader->map_len);
+  }
+  Reader_init_cstr(reader, "");
 }
 
-ASTNode *read_integer(char *input, word *pos, int sign) {
-  word result = 0;
-  for (char c = input[*pos]; isdigit(c); c = next(input, pos)) {
-    result *= 10;
-    result += c - '0';
+// Make sure that at least `want` characters are available after pos, reading
+// more chunks if necessary. Returns false at the end of the input.
+bool Reader_fill(Reader *reader, word want) {
+  while (reader->len - reader->pos < want) {
+    if (reader->fd < 0) {
+      return false;
+    }
+    // Keep the unread tail and top up the rest of the chunk
+    word unread = reader->len - reader->pos;
+    memmove(reader->chunk, reader->data + reader->pos, unread);
+    reader->pos = 0;
+    reader->len = unread;
+    ssize_t nread = read(reader->fd, reader->chunk + unread,
+                         reader->chunk_size - unread);
+    if (nread < 0 && errno == EINTR) {
+      continue;
+    }
+    if (nread <= 0) {
+      reader->fd = -1;
+      return false;
+    }
+    reader->len += nread;
   }
-  return AST_new_integer(sign * result);
+  return true;
+}
+
+// Returns '\0' past the end of the input, just like reading off the end of a
+// C string.
+char peek_at(Reader *reader, word offset) {
+  assert(offset < kReaderLookahead);
+  if (!Reader_fill(reader, offset + 1)) {
+    return '\0';
+  }
+  return reader->data[reader->pos + offset];
+}
+
+char peek(Reader *reader) { return peek_at(reader, 0); }
+
+void advance(Reader *reader) {
+  assert(reader->pos < reader->len);
+  reader->pos++;
+}
+
+// Character classes. These only accept ASCII and do not consult the locale,
+// unlike their <ctype.h> counterparts.
+
+bool is_whitespace(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+bool is_alpha(char c) {
+  // Setting 0x20 folds upper case into lower case
+  char lower = c | 0x20;
+  return lower >= 'a' && lower <= 'z';
 }
 
 bool starts_symbol(char c) {
@@ -711,125 +1670,432 @@ bool starts_symbol(char c) {
   case '?':
     return true;
   default:
-    return isalpha(c);
+    return is_alpha(c);
+  }
+}
+
+bool is_symbol_char(char c) { return starts_symbol(c) || is_digit(c); }
+
+typedef enum {
+  kSpanWhitespace,
+  kSpanDigits,
+  kSpanSymbol,
+} SpanClass;
+
+bool span_contains(char c, SpanClass cls) {
+  switch (cls) {
+  case kSpanWhitespace:
+    return is_whitespace(c);
+  case kSpanDigits:
+    return is_digit(c);
+  case kSpanSymbol:
+    return is_symbol_char(c);
+  }
+  assert(0 && "unexpected span class");
+}
+
+#ifdef __SSE2__
+// All bytes in [lo, hi]. Bytes with the high bit set compare as negative, so
+// they are never in an ASCII range.
+__m128i span_range16(__m128i chars, char lo, char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(chars, _mm_set1_epi8(hi + 1)));
+}
+
+__m128i span_equal16(__m128i chars, char c) {
+  return _mm_cmpeq_epi8(chars, _mm_set1_epi8(c));
+}
+
+// Bit i of the result is set if byte i of the 16 at p is in cls.
+unsigned span_mask16(const char *p, SpanClass cls) {
+  __m128i chars = _mm_loadu_si128((const __m128i *)p);
+  __m128i digits = span_range16(chars, '0', '9');
+  __m128i result;
+  switch (cls) {
+  case kSpanWhitespace:
+    result = _mm_or_si128(span_equal16(chars, ' '),
+                          span_range16(chars, '\t', '\r'));
+    break;
+  case kSpanDigits:
+    result = digits;
+    break;
+  case kSpanSymbol: {
+    __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+    result = _mm_or_si128(digits, span_range16(lower, 'a', 'z'));
+    const char punctuation[] = "+-*<>=?";
+    for (word i = 0; punctuation[i] != '\0'; i++) {
+      result = _mm_or_si128(result, span_equal16(chars, punctuation[i]));
+    }
+    break;
+  }
+  default:
+    assert(0 && "unexpected span class");
+  }
+  return _mm_movemask_epi8(result);
+}
+#endif
+
+// Length of the run of characters in cls at the start of p[0..len). With
+// SSE2 (always there on x86-64), 16 characters are classified per step and
+// the end of the run is found with a bit scan; the tail that does not fill a
+// whole vector is done one character at a time.
+word span(const char *p, word len, SpanClass cls) {
+  word n = 0;
+#ifdef __SSE2__
+  for (; n + 16 <= len; n += 16) {
+    unsigned mask = span_mask16(p + n, cls);
+    if (mask != 0xffff) {
+      return n + __builtin_ctz(~mask);
+    }
+  }
+#endif
+  while (n < len && span_contains(p[n], cls)) {
+    n++;
+  }
+  return n;
+}
+
+// Consume the run of characters in cls at the reader's position, reading
+// more chunks as needed, but not more than max of them. Each piece of the run
+// is passed to visit (if it is not NULL) before the chunk holding it can be
+// replaced. Returns the length of the run.
+word Reader_span(Reader *reader, SpanClass cls, word max,
+                 void (*visit)(const char *piece, word length, void *ctx),
+                 void *ctx) {
+  word total = 0;
+  while (total < max && Reader_fill(reader, 1)) {
+    const char *start = reader->data + reader->pos;
+    word available = reader->len - reader->pos;
+    if (available > max - total) {
+      available = max - total;
+    }
+    word n = span(start, available, cls);
+    if (visit != NULL) {
+      visit(start, n, ctx);
+    }
+    reader->pos += n;
+    total += n;
+    if (n < available) {
+      break;
+    }
   }
+  return total;
 }
 
-bool is_symbol_char(char c) { return starts_symbol(c) || isdigit(c); }
+void accumulate_digits(const char *piece, word length, void *ctx) {
+  word *result = ctx;
+  for (word i = 0; i < length; i++) {
+    *result = *result * 10 + (piece[i] - '0');
+  }
+}
+
+ASTNode *read_integer(Reader *reader, int sign) {
+  word result = 0;
+  Reader_span(reader, kSpanDigits, /*max=*/INT64_MAX, accumulate_digits,
+              &result);
+  return AST_new_integer(sign * result);
+}
 
 const word ATOM_MAX = 32;
 
-ASTNode *read_symbol(char *input, word *pos) {
+typedef struct {
+  char *buf;
+  word length;
+} SymbolText;
+
+void append_symbol_text(const char *piece, word length, void *ctx) {
+  SymbolText *text = ctx;
+  memcpy(text->buf + text->length, piece, length);
+  text->length += length;
+}
+
+ASTNode *read_symbol(Reader *reader) {
   char buf[ATOM_MAX + 1]; // +1 for NUL
-  word length = 0;
-  for (length = 0; length < ATOM_MAX && is_symbol_char(input[*pos]); length++) {
-    buf[length] = input[*pos];
-    advance(pos);
-  }
-  buf[length] = '\0';
+  SymbolText text = {.buf = buf, .length = 0};
+  Reader_span(reader, kSpanSymbol, /*max=*/ATOM_MAX, append_symbol_text,
+              &text);
+  buf[text.length] = '\0';
   return AST_new_symbol(buf);
 }
 
-ASTNode *read_char(char *input, word *pos) {
-  char c = input[*pos];
-  if (c == '\'') {
+ASTNode *read_char(Reader *reader) {
+  char c = peek(reader);
+  if (c == '\'' || c == '\0') {
     return AST_error();
   }
-  advance(pos);
-  if (input[*pos] != '\'') {
+  advance(reader);
+  if (peek(reader) != '\'') {
     return AST_error();
   }
-  advance(pos);
+  advance(reader);
   return AST_new_char(c);
 }
 
-char skip_whitespace(char *input, word *pos) {
-  char c = '\0';
-  for (c = input[*pos]; isspace(c); c = next(input, pos)) {
-    ;
-  }
-  return c;
+char skip_whitespace(Reader *reader) {
+  Reader_span(reader, kSpanWhitespace, /*max=*/INT64_MAX, /*visit=*/NULL,
+              /*ctx=*/NULL);
+  return peek(reader);
 }
 
-ASTNode *read_rec(char *input, word *pos);
+ASTNode *read_rec(Reader *reader);
 
-ASTNode *read_list(char *input, word *pos) {
-  char c = skip_whitespace(input, pos);
+ASTNode *read_list(Reader *reader) {
+  char c = skip_whitespace(reader);
   if (c == ')') {
-    advance(pos);
+    advance(reader);
     return AST_nil();
   }
-  ASTNode *car = read_rec(input, pos);
-  assert(car != AST_error());
-  ASTNode *cdr = read_list(input, pos);
-  assert(cdr != AST_error());
+  ASTNode *car = read_rec(reader);
+  if (AST_is_error(car)) {
+    // Including running out of input before the closing paren
+    return car;
+  }
+  ASTNode *cdr = read_list(reader);
+  if (AST_is_error(cdr)) {
+    AST_heap_free(car);
+    return cdr;
+  }
   return AST_new_pair(car, cdr);
 }
 
-ASTNode *read_rec(char *input, word *pos) {
-  char c = skip_whitespace(input, pos);
-  if (isdigit(c)) {
-    return read_integer(input, pos, /*sign=*/1);
+ASTNode *read_rec(Reader *reader) {
+  char c = skip_whitespace(reader);
+  if (is_digit(c)) {
+    return read_integer(reader, /*sign=*/1);
   }
-  if (c == '-' && isdigit(input[*pos + 1])) {
-    advance(pos);
-    return read_integer(input, pos, /*sign=*/-1);
+  if (c == '-' && is_digit(peek_at(reader, 1))) {
+    advance(reader);
+    return read_integer(reader, /*sign=*/-1);
   }
-  if (c == '+' && isdigit(input[*pos + 1])) {
-    advance(pos);
-    return read_integer(input, pos, /*sign=*/1);
+  if (c == '+' && is_digit(peek_at(reader, 1))) {
+    advance(reader);
+    return read_integer(reader, /*sign=*/1);
   }
   if (starts_symbol(c)) {
-    return read_symbol(input, pos);
+    return read_symbol(reader);
   }
   if (c == '\'') {
-    advance(pos); // skip '\''
-    return read_char(input, pos);
+    advance(reader); // skip '\''
+    return read_char(reader);
   }
-  if (c == '#' && input[*pos + 1] == 't') {
-    advance(pos); // skip '#'
-    advance(pos); // skip 't'
+  if (c == '#' && peek_at(reader, 1) == 't') {
+    advance(reader); // skip '#'
+    advance(reader); // skip 't'
     return AST_new_bool(true);
   }
-  if (c == '#' && input[*pos + 1] == 'f') {
-    advance(pos); // skip '#'
-    advance(pos); // skip 'f'
+  if (c == '#' && peek_at(reader, 1) == 'f') {
+    advance(reader); // skip '#'
+    advance(reader); // skip 'f'
     return AST_new_bool(false);
   }
   if (c == '(') {
-    advance(pos); // skip '('
-    return read_list(input, pos);
+    advance(reader); // skip '('
+    return read_list(reader);
   }
   return AST_error();
 }
 
+// True once only whitespace is left.
+bool Reader_at_end(Reader *reader) { return skip_whitespace(reader) == '\0'; }
+
+// Read the next top-level form. Call this repeatedly, checking Reader_at_end,
+// to read every form in the input.
+ASTNode *Reader_read_next(Reader *reader) {
+  word start = Stats_now_ns();
+  ASTNode *result = read_rec(reader);
+  Stats_record(kPhaseRead, start);
+  return result;
+}
+
 ASTNode *Reader_read(char *input) {
-  word pos = 0;
-  return read_rec(input, &pos);
+  Reader reader;
+  Reader_init_cstr(&reader, input);
+  return Reader_read_next(&reader);
 }
 
 // End Reader
 
 // Env
 
-typedef struct Env {
-  const char *name;
+typedef enum {
+  kOnStack,
+  kInRegister,
+} Storage;
+
+// What the compiler can prove about the tag of a value. See Compile_type.
+typedef enum {
+  kTypeUnknown,
+  kTypeFixnum,
+  kTypeChar,
+} Type;
+
+// One name's binding. Bindings in the same scope are added hidden and then
+// shown all at once, which is what gives let (not let*) its semantics.
+typedef struct {
+  ASTNode *name;
   word value;
-  struct Env *prev;
+  Storage storage;
+  Type type;
+  bool visible;
+  // Index of the binding of the same name that this one shadows, or -1
+  word shadowed;
+} Binding;
+
+// Where the innermost visible binding of one symbol is, or -1 if none is
+typedef struct {
+  word id;
+  word index;
+} InnermostSlot;
+
+// A scoped symbol table. Since symbols are interned and numbered, the
+// innermost visible binding of each name is found by hashing its symbol ID
+// into `innermost`, so lookup is O(1) regardless of nesting depth. The table
+// is sized by the names this Env has bound, not by the number of symbols
+// ever interned, so a fresh Env stays cheap in a long-running process.
+// Bindings are kept in a stack; a scope is a mark in that stack and leaving
+// it undoes every binding made since.
+typedef struct Env {
+  Binding *bindings;
+  word num_bindings;
+  word bindings_capacity;
+  InnermostSlot *innermost;
+  word innermost_capacity;
+  word num_innermost;
 } Env;
 
-Env Env_bind(const char *name, word value, Env *prev) {
-  return (Env){.name = name, .value = value, .prev = prev};
+void Env_init(Env *env) {
+  *env = (Env){.bindings = NULL,
+               .num_bindings = 0,
+               .bindings_capacity = 0,
+               .innermost = NULL,
+               .innermost_capacity = 0,
+               .num_innermost = 0};
 }
 
-bool Env_find(Env *env, const char *key, word *result) {
-  if (env == NULL)
-    return false;
-  if (strcmp(env->name, key) == 0) {
-    *result = env->value;
-    return true;
+void Env_deinit(Env *env) {
+  free(env->bindings);
+  free(env->innermost);
+  Env_init(env);
+}
+
+word Env_mark(Env *env) { return env->num_bindings; }
+
+void Env_bind_storage(Env *env, ASTNode *name, word value, Storage storage,
+                      Type type) {
+  if (env->num_bindings == env->bindings_capacity) {
+    env->bindings_capacity =
+        env->bindings_capacity ? env->bindings_capacity * 2 : 16;
+    env->bindings = realloc(env->bindings,
+                            env->bindings_capacity * sizeof *env->bindings);
+    assert(env->bindings != NULL);
+  }
+  env->bindings[env->num_bindings++] = (Binding){.name = name,
+                                                 .value = value,
+                                                 .storage = storage,
+                                                 .type = type,
+                                                 .shadowed = -1};
+}
+
+// Add a hidden binding. It becomes visible at the next Env_show.
+void Env_bind(Env *env, ASTNode *name, word value) {
+  Env_bind_storage(env, name, value, kOnStack, kTypeUnknown);
+}
+
+void Env_bind_register(Env *env, ASTNode *name, Register reg) {
+  Env_bind_storage(env, name, reg, kInRegister, kTypeUnknown);
+}
+
+// The slot for id, or the empty slot where it would go. The capacity is
+// always a power of two and the table is never full.
+InnermostSlot *Env_innermost_slot(Env *env, word id) {
+  uword mask = env->innermost_capacity - 1;
+  for (uword i = (uword)id * 0x9e3779b97f4a7c15 >> 32;; i++) {
+    InnermostSlot *slot = &env->innermost[i & mask];
+    if (slot->id == id || slot->id < 0) {
+      return slot;
+    }
+  }
+}
+
+void Env_grow_innermost(Env *env) {
+  InnermostSlot *old = env->innermost;
+  word old_capacity = env->innermost_capacity;
+  env->innermost_capacity = old_capacity ? old_capacity * 2 : 32;
+  env->innermost =
+      malloc(env->innermost_capacity * sizeof *env->innermost);
+  assert(env->innermost != NULL);
+  for (word i = 0; i < env->innermost_capacity; i++) {
+    env->innermost[i] = (InnermostSlot){.id = -1, .index = -1};
+  }
+  for (word i = 0; i < old_capacity; i++) {
+    if (old[i].id >= 0) {
+      *Env_innermost_slot(env, old[i].id) = old[i];
+    }
   }
-  return Env_find(env->prev, key, result);
+  free(old);
+}
+
+// The innermost binding index for id, adding a slot (holding -1) if there is
+// not one yet. Slots are never removed; popping a scope just restores the
+// index it held before.
+word *Env_innermost_index(Env *env, word id) {
+  if ((env->num_innermost + 1) * 2 > env->innermost_capacity) {
+    Env_grow_innermost(env);
+  }
+  InnermostSlot *slot = Env_innermost_slot(env, id);
+  if (slot->id < 0) {
+    slot->id = id;
+    env->num_innermost++;
+  }
+  return &slot->index;
+}
+
+// Make every binding added since `mark` visible, shadowing outer bindings of
+// the same name. Later bindings shadow earlier ones.
+void Env_show(Env *env, word mark) {
+  for (word i = mark; i < env->num_bindings; i++) {
+    Binding *binding = &env->bindings[i];
+    word *innermost =
+        Env_innermost_index(env, AST_as_symbol(binding->name)->id);
+    binding->shadowed = *innermost;
+    binding->visible = true;
+    *innermost = i;
+  }
+}
+
+// Leave a scope: drop every binding added since `mark`.
+void Env_pop(Env *env, word mark) {
+  for (word i = env->num_bindings - 1; i >= mark; i--) {
+    Binding *binding = &env->bindings[i];
+    if (binding->visible) {
+      *Env_innermost_index(env, AST_as_symbol(binding->name)->id) =
+          binding->shadowed;
+    }
+  }
+  env->num_bindings = mark;
+}
+
+// The returned binding is only valid until the next Env_bind*.
+Binding *Env_lookup(Env *env, ASTNode *name) {
+  if (env == NULL) {
+    return NULL;
+  }
+  if (env->innermost_capacity == 0) {
+    return NULL;
+  }
+  word index = Env_innermost_slot(env, AST_as_symbol(name)->id)->index;
+  if (index < 0) {
+    return NULL;
+  }
+  return &env->bindings[index];
+}
+
+bool Env_find(Env *env, ASTNode *name, word *result) {
+  Binding *binding = Env_lookup(env, name);
+  if (binding == NULL)
+    return false;
+  *result = binding->value;
+  return true;
 }
 
 // End Env
@@ -837,7 +2103,14 @@ bool Env_find(Env *env, const char *key, word *result) {
 // Compile
 
 WARN_UNUSED int Compile_expr(Buffer *buf, ASTNode *node, word stack_index,
-                             Env *varenv, Env *labels);
+                             word reg_index, Env *varenv, Env *labels);
+
+WARN_UNUSED int Compile_tail(Buffer *buf, ASTNode *node, word stack_index,
+                             word reg_index, Env *varenv, Env *labels);
+
+WARN_UNUSED int Compile_condition(Buffer *buf, ASTNode *node,
+                                  word stack_index, word reg_index,
+                                  Env *varenv, Env *labels, Condition *cond);
 
 ASTNode *operand1(ASTNode *args) { return AST_pair_car(args); }
 
@@ -854,24 +2127,178 @@ ASTNode *operand3(ASTNode *args) {
       return result;                                                           \
   } while (0)
 
-void Compile_compare_imm32(Buffer *buf, int32_t value) {
-  Emit_cmp_reg_imm32(buf, kRax, value);
+// Temporaries and let-bound values live in these registers. They are handed
+// out in stack order, just like stack slots: reg_index is the index of the
+// next free one. All of them are caller-saved in the System V ABI, so the
+// entry point does not need to preserve them for its C caller.
+const Register kTemporaries[] = {kRcx, kRdx, kR8, kR9, kR10};
+const word kNumTemporaries = sizeof kTemporaries / sizeof kTemporaries[0];
+
+// Never allocated. Used to reload a value that had to be spilled because all
+// of the temporaries were in use.
+const Register kScratch = kR11;
+
+// Materialize the flags condition `cond` as a boolean object in rax.
+void Compile_bool_from_flags(Buffer *buf, Condition cond) {
   Emit_mov_reg_imm32(buf, kRax, 0);
-  Emit_setcc_imm8(buf, kEqual, kAl);
+  Emit_setcc_imm8(buf, cond, kAl);
   Emit_shl_reg_imm8(buf, kRax, kBoolShift);
   Emit_or_reg_imm8(buf, kRax, kBoolTag);
 }
 
-// This is let, not let*. Therefore we keep track of two environments -- the
-// parent environment, for evaluating the bindings, and the body environment,
-// which will have all of the bindings in addition to the parent. This makes
-// programs like (let ((a 1) (b a)) b) fail.
-WARN_UNUSED int Compile_let(Buffer *buf, ASTNode *bindings, ASTNode *body,
-                            word stack_index, Env *binding_env, Env *body_env,
-                            Env *labels) {
+void Compile_compare_imm32(Buffer *buf, int32_t value) {
+  Emit_cmp_reg_imm32(buf, kRax, value);
+  Compile_bool_from_flags(buf, kEqual);
+}
+
+// What is known about the tag of node's value before it runs. Arithmetic
+// always makes a fixnum, since its operands are checked (see
+// Compile_guard_fixnum) and fixnums are closed under it; anything this does
+// not work out is kTypeUnknown. varenv is NULL where the bindings of the
+// variables in node are not known yet.
+Type Compile_type(ASTNode *node, Env *varenv) {
+  if (AST_is_integer(node)) {
+    return kTypeFixnum;
+  }
+  if (AST_is_char(node)) {
+    return kTypeChar;
+  }
+  if (AST_is_symbol(node)) {
+    Binding *binding = varenv == NULL ? NULL : Env_lookup(varenv, node);
+    return binding == NULL ? kTypeUnknown : binding->type;
+  }
+  if (!AST_is_pair(node) || !AST_is_symbol(AST_pair_car(node))) {
+    return kTypeUnknown;
+  }
+  ASTNode *args = AST_pair_cdr(node);
+  switch (AST_symbol_primitive(AST_pair_car(node))) {
+  case kPrimitiveAdd1:
+  case kPrimitiveSub1:
+  case kPrimitiveCharToInteger:
+  case kPrimitiveAdd:
+  case kPrimitiveSub:
+  case kPrimitiveMul:
+    return kTypeFixnum;
+  case kPrimitiveIntegerToChar:
+    return kTypeChar;
+  case kPrimitiveIf: {
+    Type consequent = Compile_type(operand2(args), varenv);
+    return consequent == Compile_type(operand3(args), varenv) ? consequent
+                                                              : kTypeUnknown;
+  }
+  case kPrimitiveLet:
+    // The body sees the let's own bindings, which are not in varenv
+    return Compile_type(operand2(args), /*varenv=*/NULL);
+  default:
+    return kTypeUnknown;
+  }
+}
+
+// Checking the tag of a variable's value proves it for all of the code that
+// runs after the check, which is everything compiled after it up to the end
+// of the enclosing if arm. Each refinement is logged so that Compile_if can
+// forget the ones made in an arm once the arm is done.
+typedef struct {
+  Env *env;
+  word index;
+} Refinement;
+
+Refinement *refinements = NULL;
+word num_refinements = 0;
+word refinements_capacity = 0;
+
+// Record that node, if it is a variable, is now known to be of type.
+void Compile_refine(Env *varenv, ASTNode *node, Type type) {
+  if (!AST_is_symbol(node)) {
+    return;
+  }
+  Binding *binding = Env_lookup(varenv, node);
+  if (binding == NULL) {
+    return;
+  }
+  if (num_refinements == refinements_capacity) {
+    refinements_capacity = refinements_capacity ? refinements_capacity * 2 : 8;
+    refinements =
+        realloc(refinements, refinements_capacity * sizeof *refinements);
+    assert(refinements != NULL);
+  }
+  refinements[num_refinements++] =
+      (Refinement){.env = varenv, .index = binding - varenv->bindings};
+  binding->type = type;
+}
+
+// Undo the refinements made since mark. Only variables of unknown type are
+// ever refined. Bindings made since mark have been popped by now, so entries
+// past the end of the environment are stale.
+void Compile_forget_refinements(word mark) {
+  while (num_refinements > mark) {
+    Refinement *refinement = &refinements[--num_refinements];
+    if (refinement->index < refinement->env->num_bindings) {
+      refinement->env->bindings[refinement->index].type = kTypeUnknown;
+    }
+  }
+}
+
+// Compile both operands of a binary primitive. operand1 ends up in rax and
+// operand2 ends up in *right. While operand1 is being computed, operand2 sits
+// in the next free temporary register or, if there is none, in a stack slot.
+WARN_UNUSED int Compile_binary_operands(Buffer *buf, ASTNode *args,
+                                        word stack_index, word reg_index,
+                                        Env *varenv, Env *labels,
+                                        Register *right) {
+  _(Compile_expr(buf, operand2(args), stack_index, reg_index, varenv, labels));
+  if (reg_index < kNumTemporaries) {
+    *right = kTemporaries[reg_index];
+    Emit_mov_reg_reg(buf, /*dst=*/*right, /*src=*/kRax);
+    _(Compile_expr(buf, operand1(args), stack_index, reg_index + 1, varenv,
+                   labels));
+    return 0;
+  }
+  // Out of registers; spill
+  Emit_store_reg_indirect(buf, /*dst=*/Ind(kRsp, stack_index), /*src=*/kRax);
+  _(Compile_expr(buf, operand1(args), stack_index - kWordSize, reg_index,
+                 varenv, labels));
+  *right = kScratch;
+  Emit_load_reg_indirect(buf, /*dst=*/kScratch, /*src=*/Ind(kRsp, stack_index));
+  return 0;
+}
+
+// Store the live temporaries to the stack, starting at stack_index. Returns
+// the next free stack index.
+word Compile_save_temporaries(Buffer *buf, word stack_index, word reg_index) {
+  for (word i = 0; i < reg_index; i++) {
+    Emit_store_reg_indirect(buf, /*dst=*/Ind(kRsp, stack_index),
+                            /*src=*/kTemporaries[i]);
+    stack_index -= kWordSize;
+  }
+  return stack_index;
+}
+
+void Compile_restore_temporaries(Buffer *buf, word stack_index,
+                                 word reg_index) {
+  for (word i = 0; i < reg_index; i++) {
+    Emit_load_reg_indirect(buf, /*dst=*/kTemporaries[i],
+                           /*src=*/Ind(kRsp, stack_index));
+    stack_index -= kWordSize;
+  }
+}
+
+// This is let, not let*. Each binding is added to the environment hidden, so
+// that the binding expressions see only the parent scope, and all of them are
+// shown at once before compiling the body. This makes programs like
+// (let ((a 1) (b a)) b) fail. If the let is in tail position, so is its body.
+WARN_UNUSED int Compile_let_bindings(Buffer *buf, ASTNode *bindings,
+                                     ASTNode *body, word stack_index,
+                                     word reg_index, Env *varenv, word mark,
+                                     Env *labels, bool tail) {
   if (AST_is_nil(bindings)) {
     // Base case: no bindings. Compile the body
-    _(Compile_expr(buf, body, stack_index, body_env, labels));
+    Env_show(varenv, mark);
+    if (tail) {
+      _(Compile_tail(buf, body, stack_index, reg_index, varenv, labels));
+      return 0;
+    }
+    _(Compile_expr(buf, body, stack_index, reg_index, varenv, labels));
     return 0;
   }
   assert(AST_is_pair(bindings));
@@ -881,52 +2308,248 @@ WARN_UNUSED int Compile_let(Buffer *buf, ASTNode *bindings, ASTNode *body,
   assert(AST_is_symbol(name));
   ASTNode *binding_expr = AST_pair_car(AST_pair_cdr(binding));
   // Compile the binding expression
-  _(Compile_expr(buf, binding_expr, stack_index, binding_env, labels));
+  _(Compile_expr(buf, binding_expr, stack_index, reg_index, varenv, labels));
+  Type type = Compile_type(binding_expr, varenv);
+  if (reg_index < kNumTemporaries) {
+    // Keep the value in a register
+    Register reg = kTemporaries[reg_index];
+    Emit_mov_reg_reg(buf, /*dst=*/reg, /*src=*/kRax);
+    Env_bind_storage(varenv, name, reg, kInRegister, type);
+    _(Compile_let_bindings(buf, AST_pair_cdr(bindings), body, stack_index,
+                           reg_index + 1, varenv, mark, labels, tail));
+    return 0;
+  }
   Emit_store_reg_indirect(buf, /*dst=*/Ind(kRsp, stack_index),
                           /*src=*/kRax);
   // Bind the name
-  Env entry = Env_bind(AST_symbol_cstr(name), stack_index, body_env);
-  _(Compile_let(buf, AST_pair_cdr(bindings), body, stack_index - kWordSize,
-                /*binding_env=*/binding_env, /*body_env=*/&entry, labels));
+  Env_bind_storage(varenv, name, stack_index, kOnStack, type);
+  _(Compile_let_bindings(buf, AST_pair_cdr(bindings), body,
+                         stack_index - kWordSize, reg_index, varenv, mark,
+                         labels, tail));
   return 0;
 }
 
-const word kLabelPlaceholder = 0xdeadbeef;
+WARN_UNUSED int Compile_let(Buffer *buf, ASTNode *bindings, ASTNode *body,
+                            word stack_index, word reg_index, Env *varenv,
+                            Env *labels, bool tail) {
+  word mark = Env_mark(varenv);
+  int result = Compile_let_bindings(buf, bindings, body, stack_index,
+                                    reg_index, varenv, mark, labels, tail);
+  Env_pop(varenv, mark);
+  return result;
+}
+
+// Fills a jump or call displacement until it gets patched. It fits in the
+// int32_t that the emitters take.
+const int32_t kLabelPlaceholder = 0x0badbeef;
+
+// Compile one arm of an if, in tail position if the if itself is.
+WARN_UNUSED int Compile_arm(Buffer *buf, ASTNode *node, word stack_index,
+                            word reg_index, Env *varenv, Env *labels,
+                            bool tail) {
+  if (tail) {
+    return Compile_tail(buf, node, stack_index, reg_index, varenv, labels);
+  }
+  return Compile_expr(buf, node, stack_index, reg_index, varenv, labels);
+}
 
 WARN_UNUSED int Compile_if(Buffer *buf, ASTNode *cond, ASTNode *consequent,
-                           ASTNode *alternate, word stack_index, Env *varenv,
-                           Env *labels) {
-  _(Compile_expr(buf, cond, stack_index, varenv, labels));
-  Emit_cmp_reg_imm32(buf, kRax, Object_false());
-  word alternate_pos = Emit_jcc(buf, kEqual, kLabelPlaceholder); // je alternate
-  _(Compile_expr(buf, consequent, stack_index, varenv, labels));
+                           ASTNode *alternate, word stack_index,
+                           word reg_index, Env *varenv, Env *labels,
+                           bool tail) {
+  Condition cond_true;
+  _(Compile_condition(buf, cond, stack_index, reg_index, varenv, labels,
+                      &cond_true));
+  word alternate_pos = Emit_jcc(buf, Condition_invert(cond_true),
+                                kLabelPlaceholder); // jncc alternate
+  // Checks made in one arm do not hold in the other or after the if
+  word refinements_mark = num_refinements;
+  _(Compile_arm(buf, consequent, stack_index, reg_index, varenv, labels, tail));
+  Compile_forget_refinements(refinements_mark);
   word end_pos = Emit_jmp(buf, kLabelPlaceholder); // jmp end
   Emit_backpatch_imm32(buf, alternate_pos);        // alternate:
-  _(Compile_expr(buf, alternate, stack_index, varenv, labels));
+  _(Compile_arm(buf, alternate, stack_index, reg_index, varenv, labels, tail));
+  Compile_forget_refinements(refinements_mark);
   Emit_backpatch_imm32(buf, end_pos); // end:
   return 0;
 }
 
+void Emit_rsp_adjust(Buffer *buf, word adjust) {
+  if (adjust < 0) {
+    Emit_sub_reg_imm32(buf, kRsp, -adjust);
+  } else if (adjust > 0) {
+    Emit_add_reg_imm32(buf, kRsp, adjust);
+  }
+}
+
 const Register kHeapPointer = kRsi;
 
-WARN_UNUSED int Compile_cons(Buffer *buf, ASTNode *car, ASTNode *cdr,
-                             word stack_index, Env *varenv, Env *labels) {
-  // Compile and store car
-  _(Compile_expr(buf, car, stack_index, varenv, labels));
+// The Heap, for the limit check and the collector. The entry prologue moves it
+// here from rsi, which is where C passes the second argument.
+const Register kHeap = kRdi;
+
+// Call the collector from generated code. rax, r11, the live temporaries, and
+// the heap are spilled to the stack below stack_index so that the collector
+// finds and updates any pointers they hold, then reloaded afterward. The
+// allocation pointer comes back in rax.
+void Compile_collect(Buffer *buf, word stack_index, word reg_index) {
+  word rax_index = stack_index;
+  word scratch_index = rax_index - kWordSize;
+  Emit_store_reg_indirect(buf, /*dst=*/Ind(kRsp, rax_index), /*src=*/kRax);
+  Emit_store_reg_indirect(buf, /*dst=*/Ind(kRsp, scratch_index),
+                          /*src=*/kScratch);
+  word heap_index = Compile_save_temporaries(buf, scratch_index - kWordSize,
+                                             reg_index);
+  Emit_store_reg_indirect(buf, /*dst=*/Ind(kRsp, heap_index), /*src=*/kHeap);
+  // Third argument: the lowest stack slot that the collector should scan.
+  // The first two, the heap and the allocation pointer, are already in rdi
+  // and rsi.
+  Emit_lea_reg_indirect(buf, /*dst=*/kRdx, /*src=*/Ind(kRsp, heap_index));
+  // Move rsp below the spilled values and align it to 16 bytes for the C
+  // calling convention. Push the old rsp twice to keep the alignment.
+  Emit_mov_reg_reg(buf, /*dst=*/kRax, /*src=*/kRsp);
+  Emit_rsp_adjust(buf, heap_index);
+  Emit_and_reg_imm8(buf, kRsp, 0xf0);
+  Emit_push_reg(buf, kRax);
+  Emit_push_reg(buf, kRax);
+  Emit_call_indirect(buf, Ind(kHeap, kHeapCollectOffset));
+  Emit_load_reg_indirect(buf, /*dst=*/kRsp, /*src=*/Ind(kRsp, 0));
+  Emit_mov_reg_reg(buf, /*dst=*/kHeapPointer, /*src=*/kRax);
+  Emit_load_reg_indirect(buf, /*dst=*/kHeap, /*src=*/Ind(kRsp, heap_index));
+  Compile_restore_temporaries(buf, scratch_index - kWordSize, reg_index);
+  Emit_load_reg_indirect(buf, /*dst=*/kScratch,
+                         /*src=*/Ind(kRsp, scratch_index));
+  Emit_load_reg_indirect(buf, /*dst=*/kRax, /*src=*/Ind(kRsp, rax_index));
+}
+
+// Calls to the collector are emitted out of line, after the end of the
+// function that needs them, so that the allocation fast path is just a cmp and
+// a ja that is not taken.
+typedef struct {
+  // The ja into the slow path
+  word jump_pos;
+  // Where the slow path returns to
+  word resume_pos;
+  word stack_index;
+  word reg_index;
+} SlowPath;
+
+SlowPath *slow_paths = NULL;
+word num_slow_paths = 0;
+word slow_paths_capacity = 0;
+
+// Failed tag checks jump out of line too, to one stub per function that
+// returns Object_error() from it. These are the positions of their jccs.
+word *error_jumps = NULL;
+word num_error_jumps = 0;
+word error_jumps_capacity = 0;
+
+void Compile_slow_paths(Buffer *buf) {
+  for (word i = 0; i < num_slow_paths; i++) {
+    SlowPath *path = &slow_paths[i];
+    Emit_backpatch_imm32(buf, path->jump_pos);
+    Compile_collect(buf, path->stack_index, path->reg_index);
+    // 5 is length of jmp instruction
+    Emit_jmp(buf, path->resume_pos - (Buffer_len(buf) + 5));
+  }
+  num_slow_paths = 0;
+  if (num_error_jumps > 0) {
+    for (word i = 0; i < num_error_jumps; i++) {
+      Emit_backpatch_imm32(buf, error_jumps[i]);
+    }
+    Emit_mov_reg_imm32(buf, kRax, Object_error());
+    Emit_ret(buf);
+  }
+  num_error_jumps = 0;
+}
+
+void Compile_error_jump(Buffer *buf, Condition cond) {
+  if (num_error_jumps == error_jumps_capacity) {
+    error_jumps_capacity = error_jumps_capacity ? error_jumps_capacity * 2 : 8;
+    error_jumps =
+        realloc(error_jumps, error_jumps_capacity * sizeof *error_jumps);
+    assert(error_jumps != NULL);
+  }
+  error_jumps[num_error_jumps++] = Emit_jcc(buf, cond, kLabelPlaceholder);
+}
+
+// Make the function return Object_error() unless reg, which holds the value
+// of node, is a fixnum. Values already known to be one are not checked at
+// all.
+void Compile_guard_fixnum(Buffer *buf, Register reg, ASTNode *node,
+                          Env *varenv) {
+  if (Compile_type(node, varenv) == kTypeFixnum) {
+    return;
+  }
+  Emit_test_reg8_imm8(buf, reg, kIntegerTagMask);
+  Compile_error_jump(buf, kNotZero);
+  Compile_refine(varenv, node, kTypeFixnum);
+}
+
+// The same for a char in rax.
+void Compile_guard_char(Buffer *buf, ASTNode *node, Env *varenv) {
+  if (Compile_type(node, varenv) == kTypeChar) {
+    return;
+  }
+  Emit_cmp_reg8_imm8(buf, kRax, kCharTag);
+  Compile_error_jump(buf, kNotEqual);
+  Compile_refine(varenv, node, kTypeChar);
+}
+
+// Compile_binary_operands for a primitive that works on fixnums.
+WARN_UNUSED int Compile_fixnum_operands(Buffer *buf, ASTNode *args,
+                                        word stack_index, word reg_index,
+                                        Env *varenv, Env *labels,
+                                        Register *right) {
+  _(Compile_binary_operands(buf, args, stack_index, reg_index, varenv, labels,
+                            right));
+  Compile_guard_fixnum(buf, kRax, operand1(args), varenv);
+  Compile_guard_fixnum(buf, *right, operand2(args), varenv);
+  return 0;
+}
+
+// Allocate a pair holding rax and cdr, leaving the tagged pointer in rax. Both
+// operands are computed before anything touches the heap pointer, because
+// either of them may allocate (and collect) too. stack_index and reg_index
+// must cover everything that is live, including cdr.
+void Compile_allocate_pair(Buffer *buf, Register cdr, word stack_index,
+                           word reg_index) {
+  // Is there room in the nursery for another pair?
+  Emit_cmp_reg_indirect(buf, kHeapPointer, Ind(kHeap, kHeapLimitOffset));
+  word jump_pos = Emit_jcc(buf, kAbove, kLabelPlaceholder);
+  if (num_slow_paths == slow_paths_capacity) {
+    slow_paths_capacity = slow_paths_capacity ? slow_paths_capacity * 2 : 8;
+    slow_paths =
+        realloc(slow_paths, slow_paths_capacity * sizeof *slow_paths);
+    assert(slow_paths != NULL);
+  }
+  Buffer_mark_jump_target(buf);
+  slow_paths[num_slow_paths++] = (SlowPath){.jump_pos = jump_pos,
+                                            .resume_pos = Buffer_len(buf),
+                                            .stack_index = stack_index,
+                                            .reg_index = reg_index};
   Emit_store_reg_indirect(buf,
                           /*dst=*/Ind(kHeapPointer, kCarOffset),
                           /*src=*/kRax);
-  // Compile and store cdr
-  _(Compile_expr(buf, cdr, stack_index, varenv, labels));
   Emit_store_reg_indirect(buf,
                           /*dst=*/Ind(kHeapPointer, kCdrOffset),
-                          /*src=*/kRax);
+                          /*src=*/cdr);
   // Store tagged pointer in rax
-  // TODO(max): Rewrite as lea rax, [rsi+kPairTag]
-  Emit_mov_reg_reg(buf, /*dst=*/kRax, /*src=*/kHeapPointer);
-  Emit_or_reg_imm8(buf, /*dst=*/kRax, kPairTag);
+  Emit_lea_reg_indirect(buf, /*dst=*/kRax,
+                        /*src=*/Ind(kHeapPointer, kPairTag));
   // Bump the heap pointer
   Emit_add_reg_imm32(buf, /*dst=*/kHeapPointer, kPairSize);
+}
+
+WARN_UNUSED int Compile_cons(Buffer *buf, ASTNode *args, word stack_index,
+                             word reg_index, Env *varenv, Env *labels) {
+  Register cdr;
+  _(Compile_binary_operands(buf, args, stack_index, reg_index, varenv, labels,
+                            &cdr));
+  // cdr is either in the next temporary or spilled at stack_index. Either way,
+  // keeping both live is conservative but harmless.
+  word live_regs = reg_index < kNumTemporaries ? reg_index + 1 : reg_index;
+  Compile_allocate_pair(buf, cdr, stack_index - kWordSize, live_regs);
   return 0;
 }
 
@@ -938,200 +2561,271 @@ word list_length(ASTNode *node) {
   return 1 + list_length(AST_pair_cdr(node));
 }
 
-void Emit_rsp_adjust(Buffer *buf, word adjust) {
-  if (adjust < 0) {
-    Emit_sub_reg_imm32(buf, kRsp, -adjust);
-  } else if (adjust > 0) {
-    Emit_add_reg_imm32(buf, kRsp, adjust);
-  }
-}
-
-void Emit_call_imm32(Buffer *buf, word absolute_address) {
+// Returns the position of the call's imm32, like Emit_jmp.
+word Emit_call_imm32(Buffer *buf, word absolute_address) {
   // 5 is length of call instruction
   word relative_address = absolute_address - (Buffer_len(buf) + 5);
   Buffer_write8(buf, 0xe8);
+  word pos = Buffer_len(buf);
   Buffer_write32(buf, relative_address);
+  return pos;
+}
+
+word Emit_jmp_imm32(Buffer *buf, word absolute_address) {
+  // 5 is length of jmp instruction
+  return Emit_jmp(buf, absolute_address - (Buffer_len(buf) + 5));
+}
+
+// The address bound to a label whose code has not been compiled yet.
+const word kLabelUnbound = -1;
+
+// A call or jump to a label that comes later in the buffer, to be patched
+// once every label in the labels form has an address.
+typedef struct {
+  // The imm32 of the call or jmp
+  word pos;
+  ASTNode *label;
+} LabelFixup;
+
+LabelFixup *label_fixups = NULL;
+word num_label_fixups = 0;
+word label_fixups_capacity = 0;
+
+// Record pos for patching if the label it targets has no address yet.
+void Compile_label_fixup(word pos, ASTNode *label, word code_address) {
+  if (code_address != kLabelUnbound) {
+    return;
+  }
+  if (num_label_fixups == label_fixups_capacity) {
+    label_fixups_capacity =
+        label_fixups_capacity ? label_fixups_capacity * 2 : 8;
+    label_fixups = realloc(label_fixups,
+                           label_fixups_capacity * sizeof *label_fixups);
+    assert(label_fixups != NULL);
+  }
+  label_fixups[num_label_fixups++] = (LabelFixup){.pos = pos, .label = label};
+}
+
+void Compile_label_fixups(Buffer *buf, Env *labels) {
+  for (word i = 0; i < num_label_fixups; i++) {
+    word code_address;
+    bool found = Env_find(labels, label_fixups[i].label, &code_address);
+    assert(found && code_address != kLabelUnbound);
+    (void)found;
+    word relative_pos = code_address - label_fixups[i].pos - sizeof(int32_t);
+    Buffer_at_put32(buf, label_fixups[i].pos, disp32(relative_pos));
+  }
+  num_label_fixups = 0;
 }
 
 WARN_UNUSED int Compile_labelcall(Buffer *buf, ASTNode *callable, ASTNode *args,
-                                  word stack_index, Env *varenv, Env *labels,
-                                  word nargs, word rsp_adjust) {
+                                  word stack_index, word reg_index,
+                                  Env *varenv, Env *labels, word nargs,
+                                  word rsp_adjust) {
   if (AST_is_nil(args)) {
-    const char *symbol = AST_symbol_cstr(callable);
     word code_address;
-    if (!Env_find(labels, symbol, &code_address)) {
+    if (!Env_find(labels, callable, &code_address)) {
       return -1;
     }
     // TODO(max): Determine if we need to align the stack to 16 bytes
     // Save the locals
     Emit_rsp_adjust(buf, rsp_adjust);
-    Emit_call_imm32(buf, code_address);
+    Compile_label_fixup(Emit_call_imm32(buf, code_address), callable,
+                        code_address);
     // Unsave the locals
     Emit_rsp_adjust(buf, -rsp_adjust);
     return 0;
   }
   assert(AST_is_pair(args));
   ASTNode *arg = AST_pair_car(args);
-  _(Compile_expr(buf, arg, stack_index, varenv, labels));
+  _(Compile_expr(buf, arg, stack_index, reg_index, varenv, labels));
   Emit_store_reg_indirect(buf, Ind(kRsp, stack_index), kRax);
   return Compile_labelcall(buf, callable, AST_pair_cdr(args),
-                           stack_index - kWordSize, varenv, labels, nargs,
-                           rsp_adjust);
+                           stack_index - kWordSize, reg_index, varenv, labels,
+                           nargs, rsp_adjust);
+}
+
+// A labelcall in tail position reuses the current frame instead of pushing a
+// new one. The arguments are evaluated into free slots, moved down over our
+// own arguments just below the return address, and then we jump to the
+// callee, which returns straight to our caller.
+WARN_UNUSED int Compile_tail_labelcall(Buffer *buf, ASTNode *callable,
+                                       ASTNode *args, word stack_index,
+                                       word reg_index, Env *varenv,
+                                       Env *labels) {
+  word code_address;
+  if (!Env_find(labels, callable, &code_address)) {
+    return -1;
+  }
+  word arg_index = stack_index;
+  for (; AST_is_pair(args); args = AST_pair_cdr(args)) {
+    _(Compile_expr(buf, AST_pair_car(args), arg_index, reg_index, varenv,
+                   labels));
+    Emit_store_reg_indirect(buf, /*dst=*/Ind(kRsp, arg_index), /*src=*/kRax);
+    arg_index -= kWordSize;
+  }
+  // Each source slot is at or below its destination, so copying in order
+  // never clobbers an argument that has not been moved yet
+  for (word src = stack_index, dst = -kWordSize; src > arg_index;
+       src -= kWordSize, dst -= kWordSize) {
+    if (src != dst) {
+      Emit_load_reg_indirect(buf, /*dst=*/kRax, /*src=*/Ind(kRsp, src));
+      Emit_store_reg_indirect(buf, /*dst=*/Ind(kRsp, dst), /*src=*/kRax);
+    }
+  }
+  Compile_label_fixup(Emit_jmp_imm32(buf, code_address), callable,
+                      code_address);
+  return 0;
 }
 
 WARN_UNUSED int Compile_call(Buffer *buf, ASTNode *callable, ASTNode *args,
-                             word stack_index, Env *varenv, Env *labels) {
+                             word stack_index, word reg_index, Env *varenv,
+                             Env *labels) {
   if (AST_is_symbol(callable)) {
-    if (AST_symbol_matches(callable, "add1")) {
-      _(Compile_expr(buf, operand1(args), stack_index, varenv, labels));
+    switch (AST_symbol_primitive(callable)) {
+    case kPrimitiveAdd1:
+      _(Compile_expr(buf, operand1(args), stack_index, reg_index, varenv,
+                     labels));
+      Compile_guard_fixnum(buf, kRax, operand1(args), varenv);
       Emit_add_reg_imm32(buf, kRax, Object_encode_integer(1));
       return 0;
-    }
-    if (AST_symbol_matches(callable, "sub1")) {
-      _(Compile_expr(buf, operand1(args), stack_index, varenv, labels));
+    case kPrimitiveSub1:
+      _(Compile_expr(buf, operand1(args), stack_index, reg_index, varenv,
+                     labels));
+      Compile_guard_fixnum(buf, kRax, operand1(args), varenv);
       Emit_sub_reg_imm32(buf, kRax, Object_encode_integer(1));
       return 0;
-    }
-    if (AST_symbol_matches(callable, "integer->char")) {
-      _(Compile_expr(buf, operand1(args), stack_index, varenv, labels));
+    case kPrimitiveIntegerToChar:
+      _(Compile_expr(buf, operand1(args), stack_index, reg_index, varenv,
+                     labels));
+      Compile_guard_fixnum(buf, kRax, operand1(args), varenv);
       Emit_shl_reg_imm8(buf, kRax, kCharShift - kIntegerShift);
       Emit_or_reg_imm8(buf, kRax, kCharTag);
       return 0;
-    }
-    if (AST_symbol_matches(callable, "char->integer")) {
-      _(Compile_expr(buf, operand1(args), stack_index, varenv, labels));
+    case kPrimitiveCharToInteger:
+      _(Compile_expr(buf, operand1(args), stack_index, reg_index, varenv,
+                     labels));
+      Compile_guard_char(buf, operand1(args), varenv);
       Emit_shr_reg_imm8(buf, kRax, kCharShift - kIntegerShift);
       return 0;
-    }
-    if (AST_symbol_matches(callable, "nil?")) {
-      _(Compile_expr(buf, operand1(args), stack_index, varenv, labels));
+    case kPrimitiveIsNil:
+      _(Compile_expr(buf, operand1(args), stack_index, reg_index, varenv,
+                     labels));
       Compile_compare_imm32(buf, Object_nil());
       return 0;
-    }
-    if (AST_symbol_matches(callable, "zero?")) {
-      _(Compile_expr(buf, operand1(args), stack_index, varenv, labels));
+    case kPrimitiveIsZero:
+      _(Compile_expr(buf, operand1(args), stack_index, reg_index, varenv,
+                     labels));
       Compile_compare_imm32(buf, Object_encode_integer(0));
       return 0;
-    }
-    if (AST_symbol_matches(callable, "not")) {
-      _(Compile_expr(buf, operand1(args), stack_index, varenv, labels));
+    case kPrimitiveNot:
+      _(Compile_expr(buf, operand1(args), stack_index, reg_index, varenv,
+                     labels));
       // All non #f values are truthy
       // ...this might be a problem if we want to make nil falsey
       Compile_compare_imm32(buf, Object_false());
       return 0;
-    }
-    if (AST_symbol_matches(callable, "integer?")) {
-      _(Compile_expr(buf, operand1(args), stack_index, varenv, labels));
+    case kPrimitiveIsInteger:
+      _(Compile_expr(buf, operand1(args), stack_index, reg_index, varenv,
+                     labels));
       Emit_and_reg_imm8(buf, kRax, kIntegerTagMask);
       Compile_compare_imm32(buf, kIntegerTag);
       return 0;
-    }
-    if (AST_symbol_matches(callable, "boolean?")) {
-      _(Compile_expr(buf, operand1(args), stack_index, varenv, labels));
+    case kPrimitiveIsBoolean:
+      _(Compile_expr(buf, operand1(args), stack_index, reg_index, varenv,
+                     labels));
       Emit_and_reg_imm8(buf, kRax, kImmediateTagMask);
       Compile_compare_imm32(buf, kBoolTag);
       return 0;
-    }
-    if (AST_symbol_matches(callable, "+")) {
-      _(Compile_expr(buf, operand2(args), stack_index, varenv, labels));
-      Emit_store_reg_indirect(buf, /*dst=*/Ind(kRsp, stack_index),
-                              /*src=*/kRax);
-      _(Compile_expr(buf, operand1(args), stack_index - kWordSize, varenv,
-                     labels));
-      Emit_add_reg_indirect(buf, /*dst=*/kRax, /*src=*/Ind(kRsp, stack_index));
+    case kPrimitiveAdd: {
+      Register right;
+      _(Compile_fixnum_operands(buf, args, stack_index, reg_index, varenv,
+                                labels, &right));
+      Emit_add_reg_reg(buf, /*dst=*/kRax, /*src=*/right);
       return 0;
     }
-    if (AST_symbol_matches(callable, "-")) {
-      _(Compile_expr(buf, operand2(args), stack_index, varenv, labels));
-      Emit_store_reg_indirect(buf, /*dst=*/Ind(kRsp, stack_index),
-                              /*src=*/kRax);
-      _(Compile_expr(buf, operand1(args), stack_index - kWordSize, varenv,
-                     labels));
-      Emit_sub_reg_indirect(buf, /*dst=*/kRax, /*src=*/Ind(kRsp, stack_index));
+    case kPrimitiveSub: {
+      Register right;
+      _(Compile_fixnum_operands(buf, args, stack_index, reg_index, varenv,
+                                labels, &right));
+      Emit_sub_reg_reg(buf, /*dst=*/kRax, /*src=*/right);
       return 0;
     }
-    if (AST_symbol_matches(callable, "*")) {
-      _(Compile_expr(buf, operand2(args), stack_index, varenv, labels));
+    case kPrimitiveMul: {
+      Register right;
+      _(Compile_fixnum_operands(buf, args, stack_index, reg_index, varenv,
+                                labels, &right));
       // Remove the tag so that the result is still only tagged with 0b00
       // instead of 0b0000
-      Emit_shr_reg_imm8(buf, kRax, kIntegerShift);
-      Emit_store_reg_indirect(buf, /*dst=*/Ind(kRsp, stack_index),
-                              /*src=*/kRax);
-      _(Compile_expr(buf, operand1(args), stack_index - kWordSize, varenv,
-                     labels));
-      Emit_mul_reg_indirect(buf, /*src=*/Ind(kRsp, stack_index));
+      Emit_shr_reg_imm8(buf, right, kIntegerShift);
+      Emit_imul_reg_reg(buf, /*dst=*/kRax, /*src=*/right);
       return 0;
     }
-    if (AST_symbol_matches(callable, "=")) {
-      _(Compile_expr(buf, operand2(args), stack_index, varenv, labels));
-      Emit_store_reg_indirect(buf, /*dst=*/Ind(kRsp, stack_index),
-                              /*src=*/kRax);
-      _(Compile_expr(buf, operand1(args), stack_index - kWordSize, varenv,
-                     labels));
-      Emit_cmp_reg_indirect(buf, kRax, Ind(kRsp, stack_index));
-      Emit_mov_reg_imm32(buf, kRax, 0);
-      Emit_setcc_imm8(buf, kEqual, kAl);
-      Emit_shl_reg_imm8(buf, kRax, kBoolShift);
-      Emit_or_reg_imm8(buf, kRax, kBoolTag);
+    case kPrimitiveEqual: {
+      Register right;
+      _(Compile_fixnum_operands(buf, args, stack_index, reg_index, varenv,
+                                labels, &right));
+      Emit_cmp_reg_reg(buf, kRax, right);
+      Compile_bool_from_flags(buf, kEqual);
       return 0;
     }
-    if (AST_symbol_matches(callable, "<")) {
-      _(Compile_expr(buf, operand2(args), stack_index, varenv, labels));
-      Emit_store_reg_indirect(buf, /*dst=*/Ind(kRsp, stack_index),
-                              /*src=*/kRax);
-      _(Compile_expr(buf, operand1(args), stack_index - kWordSize, varenv,
-                     labels));
-      Emit_cmp_reg_indirect(buf, kRax, Ind(kRsp, stack_index));
-      Emit_mov_reg_imm32(buf, kRax, 0);
-      Emit_setcc_imm8(buf, kLess, kAl);
-      Emit_shl_reg_imm8(buf, kRax, kBoolShift);
-      Emit_or_reg_imm8(buf, kRax, kBoolTag);
+    case kPrimitiveLess: {
+      Register right;
+      _(Compile_fixnum_operands(buf, args, stack_index, reg_index, varenv,
+                                labels, &right));
+      Emit_cmp_reg_reg(buf, kRax, right);
+      Compile_bool_from_flags(buf, kLess);
       return 0;
     }
-    if (AST_symbol_matches(callable, "let")) {
+    case kPrimitiveLet:
       return Compile_let(buf, /*bindings=*/operand1(args),
-                         /*body=*/operand2(args), stack_index,
-                         /*binding_env=*/varenv,
-                         /*body_env=*/varenv, labels);
-    }
-    if (AST_symbol_matches(callable, "if")) {
+                         /*body=*/operand2(args), stack_index, reg_index,
+                         varenv, labels, /*tail=*/false);
+    case kPrimitiveIf:
       return Compile_if(buf, /*condition=*/operand1(args),
                         /*consequent=*/operand2(args),
-                        /*alternate=*/operand3(args), stack_index, varenv,
-                        labels);
-    }
-    if (AST_symbol_matches(callable, "cons")) {
-      return Compile_cons(buf, /*car=*/operand1(args), /*cdr=*/operand2(args),
-                          stack_index, varenv, labels);
-    }
-    if (AST_symbol_matches(callable, "car")) {
-      _(Compile_expr(buf, operand1(args), stack_index, varenv, labels));
+                        /*alternate=*/operand3(args), stack_index, reg_index,
+                        varenv, labels, /*tail=*/false);
+    case kPrimitiveCons:
+      return Compile_cons(buf, args, stack_index, reg_index, varenv, labels);
+    case kPrimitiveCar:
+      _(Compile_expr(buf, operand1(args), stack_index, reg_index, varenv,
+                     labels));
       Emit_load_reg_indirect(buf, /*dst=*/kRax,
-                             /*src=*/Ind(kRax, kCarOffset - kPairTag));
+                             /*src=*/Ind(kRax, kCarOffset - (int)kPairTag));
       return 0;
-    }
-    if (AST_symbol_matches(callable, "cdr")) {
-      _(Compile_expr(buf, operand1(args), stack_index, varenv, labels));
+    case kPrimitiveCdr:
+      _(Compile_expr(buf, operand1(args), stack_index, reg_index, varenv,
+                     labels));
       Emit_load_reg_indirect(buf, /*dst=*/kRax,
-                             /*src=*/Ind(kRax, kCdrOffset - kPairTag));
+                             /*src=*/Ind(kRax, kCdrOffset - (int)kPairTag));
       return 0;
-    }
-    if (AST_symbol_matches(callable, "labelcall")) {
+    case kPrimitiveLabelcall: {
       ASTNode *label = operand1(args);
       assert(AST_is_symbol(label));
       ASTNode *call_args = AST_pair_cdr(args);
       word nargs = list_length(call_args);
+      // The callee is free to use all of the temporaries, so save the live
+      // ones below the locals
+      word call_index = Compile_save_temporaries(buf, stack_index, reg_index);
       // Skip a space on the stack to put the return address
-      return Compile_labelcall(buf, label, call_args, stack_index - kWordSize,
-                               // TODO(max): Figure out the +kWordSize
-                               varenv, labels, nargs, stack_index + kWordSize);
+      _(Compile_labelcall(buf, label, call_args, call_index - kWordSize,
+                          reg_index, varenv, labels, nargs,
+                          // TODO(max): Figure out the +kWordSize
+                          call_index + kWordSize));
+      Compile_restore_temporaries(buf, stack_index, reg_index);
+      return 0;
+    }
+    default:
+      break;
     }
   }
   assert(0 && "unexpected call type");
 }
 
-WARN_UNUSED int Compile_expr(Buffer *buf, ASTNode *node, word stack_index,
-                             Env *varenv, Env *labels) {
+WARN_UNUSED int Compile_expr_node(Buffer *buf, ASTNode *node,
+                                  word stack_index, word reg_index,
+                                  Env *varenv, Env *labels) {
   if (AST_is_integer(node)) {
     word value = AST_get_integer(node);
     Emit_mov_reg_imm32(buf, kRax, Object_encode_integer(value));
@@ -1153,26 +2847,201 @@ WARN_UNUSED int Compile_expr(Buffer *buf, ASTNode *node, word stack_index,
   }
   if (AST_is_pair(node)) {
     return Compile_call(buf, AST_pair_car(node), AST_pair_cdr(node),
-                        stack_index, varenv, labels);
+                        stack_index, reg_index, varenv, labels);
   }
   if (AST_is_symbol(node)) {
-    const char *symbol = AST_symbol_cstr(node);
-    word value;
-    if (Env_find(varenv, symbol, &value)) {
-      Emit_load_reg_indirect(buf, /*dst=*/kRax, /*src=*/Ind(kRsp, value));
+    Binding *binding = Env_lookup(varenv, node);
+    if (binding == NULL) {
+      return -1;
+    }
+    if (binding->storage == kInRegister) {
+      Peephole_mov_reg_reg(buf, /*dst=*/kRax, /*src=*/binding->value);
       return 0;
     }
-    return -1;
+    Peephole_load_reg_stack(buf, /*dst=*/kRax, /*disp=*/binding->value);
+    return 0;
   }
   assert(0 && "unexpected node type");
 }
 
+// Bytes of code emitted for each kind of expression, not counting the code
+// for its subexpressions. Calls are counted under their primitive, with
+// kNotPrimitive standing in for anything else.
+enum {
+  kCompileKindLiteral = kNumPrimitives,
+  kCompileKindVariable,
+  kNumCompileKinds,
+};
+
+word compile_bytes[kNumCompileKinds];
+
+// Bytes emitted so far by the subexpressions of the expression being compiled
+word compile_child_bytes = 0;
+
+word Compile_kind(ASTNode *node) {
+  if (AST_is_pair(node)) {
+    ASTNode *callable = AST_pair_car(node);
+    return AST_is_symbol(callable) ? AST_symbol_primitive(callable)
+                                   : kNotPrimitive;
+  }
+  return AST_is_symbol(node) ? kCompileKindVariable : kCompileKindLiteral;
+}
+
+typedef struct {
+  word start;
+  word outer_child_bytes;
+} CompileSpan;
+
+CompileSpan Compile_span_begin(Buffer *buf) {
+  CompileSpan span = {.start = Buffer_len(buf),
+                      .outer_child_bytes = compile_child_bytes};
+  compile_child_bytes = 0;
+  return span;
+}
+
+void Compile_span_end(Buffer *buf, CompileSpan span, ASTNode *node) {
+  word total = Buffer_len(buf) - span.start;
+  compile_bytes[Compile_kind(node)] += total - compile_child_bytes;
+  compile_child_bytes = span.outer_child_bytes + total;
+}
+
+WARN_UNUSED int Compile_expr(Buffer *buf, ASTNode *node, word stack_index,
+                             word reg_index, Env *varenv, Env *labels) {
+  CompileSpan span = Compile_span_begin(buf);
+  int result =
+      Compile_expr_node(buf, node, stack_index, reg_index, varenv, labels);
+  Compile_span_end(buf, span, node);
+  return result;
+}
+
+WARN_UNUSED int Compile_condition_node(Buffer *buf, ASTNode *node,
+                                       word stack_index, word reg_index,
+                                       Env *varenv, Env *labels,
+                                       Condition *cond) {
+  if (AST_is_pair(node) && AST_is_symbol(AST_pair_car(node))) {
+    ASTNode *args = AST_pair_cdr(node);
+    Register right;
+    switch (AST_symbol_primitive(AST_pair_car(node))) {
+    case kPrimitiveEqual:
+      _(Compile_fixnum_operands(buf, args, stack_index, reg_index, varenv,
+                                labels, &right));
+      Emit_cmp_reg_reg(buf, kRax, right);
+      *cond = kEqual;
+      return 0;
+    case kPrimitiveLess:
+      _(Compile_fixnum_operands(buf, args, stack_index, reg_index, varenv,
+                                labels, &right));
+      Emit_cmp_reg_reg(buf, kRax, right);
+      *cond = kLess;
+      return 0;
+    case kPrimitiveIsZero:
+      _(Compile_expr(buf, operand1(args), stack_index, reg_index, varenv,
+                     labels));
+      Emit_cmp_reg_imm32(buf, kRax, Object_encode_integer(0));
+      *cond = kEqual;
+      return 0;
+    case kPrimitiveIsNil:
+      _(Compile_expr(buf, operand1(args), stack_index, reg_index, varenv,
+                     labels));
+      Emit_cmp_reg_imm32(buf, kRax, Object_nil());
+      *cond = kEqual;
+      return 0;
+    case kPrimitiveNot:
+      _(Compile_condition(buf, operand1(args), stack_index, reg_index, varenv,
+                          labels, cond));
+      *cond = Condition_invert(*cond);
+      return 0;
+    default:
+      break;
+    }
+  }
+  _(Compile_expr_node(buf, node, stack_index, reg_index, varenv, labels));
+  word len = Buffer_len(buf);
+  if (Peephole_take_bool_from_flags(buf, cond)) {
+    // The boolean was made by a subexpression, such as the body of a let,
+    // that was counted as emitting it
+    compile_child_bytes -= len - Buffer_len(buf);
+    return 0;
+  }
+  // All non #f values are truthy
+  Emit_cmp_reg_imm32(buf, kRax, Object_false());
+  *cond = kNotEqual;
+  return 0;
+}
+
+// Compile node for the flags it sets rather than for its value: afterward,
+// *cond holds exactly when node is truthy. Comparisons leave their result in
+// the flags, so branching on them needs no boolean object and no second
+// compare against #f.
+WARN_UNUSED int Compile_condition(Buffer *buf, ASTNode *node,
+                                  word stack_index, word reg_index,
+                                  Env *varenv, Env *labels, Condition *cond) {
+  CompileSpan span = Compile_span_begin(buf);
+  int result = Compile_condition_node(buf, node, stack_index, reg_index,
+                                      varenv, labels, cond);
+  Compile_span_end(buf, span, node);
+  return result;
+}
+
+WARN_UNUSED int Compile_tail_node(Buffer *buf, ASTNode *node,
+                                  word stack_index, word reg_index,
+                                  Env *varenv, Env *labels) {
+  if (AST_is_pair(node) && AST_is_symbol(AST_pair_car(node))) {
+    ASTNode *args = AST_pair_cdr(node);
+    switch (AST_symbol_primitive(AST_pair_car(node))) {
+    case kPrimitiveLet:
+      return Compile_let(buf, /*bindings=*/operand1(args),
+                         /*body=*/operand2(args), stack_index, reg_index,
+                         varenv, labels, /*tail=*/true);
+    case kPrimitiveIf:
+      return Compile_if(buf, /*condition=*/operand1(args),
+                        /*consequent=*/operand2(args),
+                        /*alternate=*/operand3(args), stack_index, reg_index,
+                        varenv, labels, /*tail=*/true);
+    case kPrimitiveLabelcall:
+      return Compile_tail_labelcall(buf, /*callable=*/operand1(args),
+                                    /*args=*/AST_pair_cdr(args), stack_index,
+                                    reg_index, varenv, labels);
+    default:
+      break;
+    }
+  }
+  return Compile_expr(buf, node, stack_index, reg_index, varenv, labels);
+}
+
+// Compile an expression whose value is returned from the enclosing code body.
+// Tail position flows through if arms and let bodies; labelcalls there become
+// jumps, so loops written as recursion run in constant stack space.
+WARN_UNUSED int Compile_tail(Buffer *buf, ASTNode *node, word stack_index,
+                             word reg_index, Env *varenv, Env *labels) {
+  CompileSpan span = Compile_span_begin(buf);
+  int result =
+      Compile_tail_node(buf, node, stack_index, reg_index, varenv, labels);
+  Compile_span_end(buf, span, node);
+  return result;
+}
+
 const byte kEntryPrologue[] = {
-    // Save the heap in rsi, our global heap pointer
-    // mov rsi, rdi
+    // Swap the arguments so that the allocation pointer lands in rsi, our
+    // global heap pointer, and the Heap in rdi
+    // xchg rsi, rdi
     kRexPrefix,
-    0x89,
+    0x87,
     0xfe,
+    // Record where generated code's frames end so the collector scans only
+    // those. Code that does not allocate may be entered without a heap.
+    // test rdi, rdi
+    kRexPrefix,
+    0x85,
+    0xff,
+    // je past the store
+    0x74,
+    0x04,
+    // mov [rdi+kHeapStackTopOffset], rsp
+    kRexPrefix,
+    0x89,
+    0x67,
+    0x10,
 };
 
 const byte kFunctionEpilogue[] = {
@@ -1180,96 +3049,1787 @@ const byte kFunctionEpilogue[] = {
     0xc3,
 };
 
+void Compile_function_end(Buffer *buf) {
+  Buffer_write_arr(buf, kFunctionEpilogue, sizeof kFunctionEpilogue);
+  Compile_slow_paths(buf);
+}
+
 WARN_UNUSED int Compile_code_impl(Buffer *buf, ASTNode *formals, ASTNode *body,
-                                  word stack_index, Env *varenv) {
+                                  word stack_index, Env *varenv, Env *labels) {
   if (AST_is_nil(formals)) {
-    _(Compile_expr(buf, body, stack_index, /*varenv=*/varenv,
-                   /*labels=*/NULL));
-    Buffer_write_arr(buf, kFunctionEpilogue, sizeof kFunctionEpilogue);
+    Env_show(varenv, /*mark=*/0);
+    _(Compile_tail(buf, body, stack_index, /*reg_index=*/0, varenv, labels));
+    Compile_function_end(buf);
     return 0;
   }
   assert(AST_is_pair(formals));
   ASTNode *name = AST_pair_car(formals);
   assert(AST_is_symbol(name));
-  Env entry = Env_bind(AST_symbol_cstr(name), stack_index, varenv);
+  Env_bind(varenv, name, stack_index);
   return Compile_code_impl(buf, AST_pair_cdr(formals), body,
-                           stack_index - kWordSize, &entry);
+                           stack_index - kWordSize, varenv, labels);
 }
 
-WARN_UNUSED int Compile_code(Buffer *buf, ASTNode *code) {
+WARN_UNUSED int Compile_code(Buffer *buf, ASTNode *code, Env *labels) {
   assert(AST_is_pair(code));
   ASTNode *code_sym = AST_pair_car(code);
   assert(AST_is_symbol(code_sym));
-  assert(AST_symbol_matches(code_sym, "code"));
+  assert(AST_symbol_primitive(code_sym) == kPrimitiveCode);
   ASTNode *formals = AST_pair_car(AST_pair_cdr(code));
   ASTNode *code_body = AST_pair_car(AST_pair_cdr(AST_pair_cdr(code)));
   // Formals are laid out *before* the function frame, so their offsets from
   // rsp are positive
-  return Compile_code_impl(buf, formals, code_body, /*stack_index=*/-kWordSize,
-                           /*varenv=*/NULL);
+  Env varenv;
+  Env_init(&varenv);
+  int result = Compile_code_impl(buf, formals, code_body,
+                                 /*stack_index=*/-kWordSize, &varenv, labels);
+  Env_deinit(&varenv);
+  return result;
 }
 
 WARN_UNUSED int Compile_labels(Buffer *buf, ASTNode *bindings, ASTNode *body,
-                               Env *labels, word body_pos) {
-  if (AST_is_nil(bindings)) {
-    Emit_backpatch_imm32(buf, body_pos);
-    // Base case: no bindings. Compile the body
-    _(Compile_expr(buf, body, /*stack_index=*/-kWordSize, /*varenv=*/NULL,
-                   labels));
-    Buffer_write_arr(buf, kFunctionEpilogue, sizeof kFunctionEpilogue);
-    return 0;
+                               Env *varenv, Env *labels, word body_pos) {
+  // Bind every name before compiling any function, so that each one can call
+  // itself, the ones before it, and the ones after it. Calls to a function
+  // that is not compiled yet get patched at the end.
+  word mark = Env_mark(labels);
+  for (ASTNode *it = bindings; !AST_is_nil(it); it = AST_pair_cdr(it)) {
+    assert(AST_is_pair(it));
+    ASTNode *name = AST_pair_car(AST_pair_car(it));
+    assert(AST_is_symbol(name));
+    Env_bind(labels, name, kLabelUnbound);
   }
-  assert(AST_is_pair(bindings));
-  // Get the next binding
-  ASTNode *binding = AST_pair_car(bindings);
-  ASTNode *name = AST_pair_car(binding);
-  assert(AST_is_symbol(name));
-  ASTNode *binding_code = AST_pair_car(AST_pair_cdr(binding));
-  word function_location = Buffer_len(buf);
-  // Compile the binding function
-  _(Compile_code(buf, binding_code));
-  // Bind the name to the location in the instruction stream
-  Env entry = Env_bind(AST_symbol_cstr(name), function_location, labels);
-  _(Compile_labels(buf, AST_pair_cdr(bindings), body, &entry, body_pos));
+  Env_show(labels, mark);
+  word index = mark;
+  for (ASTNode *it = bindings; !AST_is_nil(it); it = AST_pair_cdr(it)) {
+    ASTNode *binding_code = AST_pair_car(AST_pair_cdr(AST_pair_car(it)));
+    // Bind the name to the location in the instruction stream
+    Buffer_mark_jump_target(buf);
+    labels->bindings[index++].value = Buffer_len(buf);
+    _(Compile_code(buf, binding_code, labels));
+  }
+  Compile_label_fixups(buf, labels);
+  Emit_backpatch_imm32(buf, body_pos);
+  _(Compile_expr(buf, body, /*stack_index=*/-kWordSize, /*reg_index=*/0,
+                 varenv, labels));
+  Compile_function_end(buf);
   return 0;
 }
 
-WARN_UNUSED int Compile_entry(Buffer *buf, ASTNode *node) {
-  Buffer_write_arr(buf, kEntryPrologue, sizeof kEntryPrologue);
+WARN_UNUSED int Compile_entry_body(Buffer *buf, ASTNode *node, Env *varenv,
+                                   Env *labels) {
   if (AST_is_pair(node)) {
     // Assume it's (labels ...)
     ASTNode *labels_sym = AST_pair_car(node);
-    if (AST_is_symbol(labels_sym) && AST_symbol_matches(labels_sym, "labels")) {
+    if (AST_is_symbol(labels_sym) &&
+        AST_symbol_primitive(labels_sym) == kPrimitiveLabels) {
       // Jump to body
       word body_pos = Emit_jmp(buf, kLabelPlaceholder);
       ASTNode *bindings = AST_pair_car(AST_pair_cdr(node));
       assert(AST_is_pair(bindings) || AST_is_nil(bindings));
       ASTNode *body = AST_pair_car(AST_pair_cdr(AST_pair_cdr(node)));
-      _(Compile_labels(buf, bindings, body, /*labels=*/NULL, body_pos));
+      _(Compile_labels(buf, bindings, body, varenv, labels, body_pos));
       return 0;
     }
   }
-  _(Compile_expr(buf, node, /*stack_index=*/-kWordSize, /*varenv=*/NULL,
-                 /*labels=*/NULL));
-  Buffer_write_arr(buf, kFunctionEpilogue, sizeof kFunctionEpilogue);
+  _(Compile_expr(buf, node, /*stack_index=*/-kWordSize, /*reg_index=*/0,
+                 varenv, labels));
+  Compile_function_end(buf);
   return 0;
 }
 
+// Like Compile_entry, but each labels function stays bound in labels to its
+// offset in buf, for callers that need to find them afterward.
+WARN_UNUSED int Compile_entry_with_labels(Buffer *buf, ASTNode *node,
+                                          Env *labels) {
+  word start = Stats_now_ns();
+  // Drop anything left over from a compile that failed partway through
+  num_slow_paths = 0;
+  num_label_fixups = 0;
+  num_error_jumps = 0;
+  num_refinements = 0;
+  compile_child_bytes = 0;
+  Buffer_write_arr(buf, kEntryPrologue, sizeof kEntryPrologue);
+  Env varenv;
+  Env_init(&varenv);
+  int result = Compile_entry_body(buf, node, &varenv, labels);
+  Env_deinit(&varenv);
+  Stats_record(kPhaseCompile, start);
+  return result;
+}
+
+WARN_UNUSED int Compile_entry(Buffer *buf, ASTNode *node) {
+  Env labels;
+  Env_init(&labels);
+  int result = Compile_entry_with_labels(buf, node, &labels);
+  Env_deinit(&labels);
+  return result;
+}
+
+void Stats_reset(void) {
+  memset(&stats, 0, sizeof stats);
+  memset(compile_bytes, 0, sizeof compile_bytes);
+}
+
+void Stats_dump(FILE *fp) {
+  fprintf(fp, "%-10s %10s %14s %10s\n", "phase", "count", "total ns",
+          "ns/op");
+  for (word i = 0; i < kNumPhases; i++) {
+    word count = stats.phase_count[i];
+    fprintf(fp, "%-10s %10ld %14ld %10ld\n", kPhaseNames[i], count,
+            stats.phase_ns[i], count ? stats.phase_ns[i] / count : 0);
+  }
+  fprintf(fp, "ast nodes: %ld (%ld bytes), symbols: %ld\n", stats.ast_nodes,
+          stats.ast_bytes, symbol_table.num_symbols);
+  fprintf(fp, "bytes emitted by expression kind:\n");
+  for (word i = 0; i < kNumCompileKinds; i++) {
+    if (compile_bytes[i] == 0) {
+      continue;
+    }
+    const char *name = i == kCompileKindLiteral    ? "literal"
+                       : i == kCompileKindVariable ? "variable"
+                       : i == kNotPrimitive        ? "other call"
+                                                   : kPrimitiveNames[i];
+    fprintf(fp, "  %-14s %10ld\n", name, compile_bytes[i]);
+  }
+}
+
 // End Compile
 
-typedef uword (*JitFunction)(uword *heap);
+// Fold
+
+// A compile-time partial evaluator. It runs over the AST before compilation,
+// evaluating primitive calls whose operands are all literals, pruning if arms
+// that can never run, and propagating let bindings whose values are literals
+// into their bodies. It returns a new tree; the caller still owns (and must
+// free) the input.
+//
+// Folded results must mean exactly what the generated code would have
+// computed, so predicates compare the encoded words just like the emitted cmp
+// instructions do.
+
+ASTNode *Fold_expr(ASTNode *node, Env *constants);
+
+bool Fold_is_literal(ASTNode *node) {
+  return AST_is_integer(node) || AST_is_char(node) || AST_is_bool(node) ||
+         AST_is_nil(node);
+}
+
+// Only fold to integers that Object_encode_integer accepts and whose encoding
+// still fits in the imm32 that Compile_expr emits for a literal. Anything
+// bigger is left for the generated code to compute.
+bool Fold_integer_fits(word value) {
+  if (value >= kIntegerMax || value <= kIntegerMin) {
+    return false;
+  }
+  word encoded = value << kIntegerShift;
+  return encoded >= INT32_MIN && encoded <= INT32_MAX;
+}
+
+ASTNode *Fold_list(ASTNode *list, Env *constants) {
+  if (!AST_is_pair(list)) {
+    return Fold_expr(list, constants);
+  }
+  ASTNode *car = Fold_expr(AST_pair_car(list), constants);
+  return AST_new_pair(car, Fold_list(AST_pair_cdr(list), constants));
+}
+
+// Returns the literal result of applying the primitive to literal operands,
+// or NULL if it cannot be folded.
+ASTNode *Fold_primitive(ASTNode *callable, ASTNode *args) {
+  word nargs = list_length(args);
+  if (nargs == 0) {
+    return NULL;
+  }
+  ASTNode *arg = operand1(args);
+  if (!Fold_is_literal(arg)) {
+    return NULL;
+  }
+  uword raw = (uword)arg;
+  Primitive primitive = AST_symbol_primitive(callable);
+  if (nargs == 1) {
+    if (primitive == kPrimitiveAdd1 && AST_is_integer(arg) &&
+        Fold_integer_fits(AST_get_integer(arg) + 1)) {
+      return AST_new_integer(AST_get_integer(arg) + 1);
+    }
+    if (primitive == kPrimitiveSub1 && AST_is_integer(arg) &&
+        Fold_integer_fits(AST_get_integer(arg) - 1)) {
+      return AST_new_integer(AST_get_integer(arg) - 1);
+    }
+    if (primitive == kPrimitiveIntegerToChar && AST_is_integer(arg) &&
+        AST_get_integer(arg) >= 0 && AST_get_integer(arg) <= 127) {
+      return AST_new_char(AST_get_integer(arg));
+    }
+    if (primitive == kPrimitiveCharToInteger && AST_is_char(arg) &&
+        AST_get_char(arg) >= 0) {
+      return AST_new_integer(AST_get_char(arg));
+    }
+    if (primitive == kPrimitiveIsNil) {
+      return AST_new_bool(raw == Object_nil());
+    }
+    if (primitive == kPrimitiveIsZero) {
+      return AST_new_bool(raw == Object_encode_integer(0));
+    }
+    if (primitive == kPrimitiveNot) {
+      return AST_new_bool(raw == Object_false());
+    }
+    if (primitive == kPrimitiveIsInteger) {
+      return AST_new_bool((raw & kIntegerTagMask) == kIntegerTag);
+    }
+    if (primitive == kPrimitiveIsBoolean) {
+      return AST_new_bool((raw & kImmediateTagMask) == kBoolTag);
+    }
+    return NULL;
+  }
+  if (nargs != 2) {
+    return NULL;
+  }
+  ASTNode *arg2 = operand2(args);
+  if (!Fold_is_literal(arg2)) {
+    return NULL;
+  }
+  // The compiled binary primitives only take fixnums and produce the error
+  // value for anything else, so leave those calls for the generated code
+  if (!AST_is_integer(arg) || !AST_is_integer(arg2)) {
+    return NULL;
+  }
+  uword raw2 = (uword)arg2;
+  if (primitive == kPrimitiveEqual) {
+    return AST_new_bool(raw == raw2);
+  }
+  if (primitive == kPrimitiveLess) {
+    return AST_new_bool((word)raw < (word)raw2);
+  }
+  word left = AST_get_integer(arg);
+  word right = AST_get_integer(arg2);
+  word value;
+  if (primitive == kPrimitiveAdd) {
+    value = left + right;
+  } else if (primitive == kPrimitiveSub) {
+    value = left - right;
+  } else if (primitive == kPrimitiveMul) {
+    if (__builtin_mul_overflow(left, right, &value)) {
+      return NULL;
+    }
+  } else {
+    return NULL;
+  }
+  return Fold_integer_fits(value) ? AST_new_integer(value) : NULL;
+}
+
+// Like Compile_let, binding expressions see only the parent environment.
+// Bindings whose values fold to literals are substituted into the body and
+// dropped. The rest are appended to *kept and shadow any outer constant of the
+// same name. Returns the folded body.
+ASTNode *Fold_let(ASTNode *bindings, ASTNode *body, Env *constants,
+                  word mark, ASTNode ***kept) {
+  if (AST_is_nil(bindings)) {
+    Env_show(constants, mark);
+    return Fold_expr(body, constants);
+  }
+  ASTNode *binding = AST_pair_car(bindings);
+  ASTNode *name = AST_pair_car(binding);
+  ASTNode *value = Fold_expr(operand2(binding), constants);
+  if (Fold_is_literal(value)) {
+    Env_bind(constants, name, (word)value);
+    return Fold_let(AST_pair_cdr(bindings), body, constants, mark, kept);
+  }
+  **kept = list1(list2(name, value));
+  *kept = &AST_as_pair(**kept)->cdr;
+  Env_bind(constants, name, (word)AST_error());
+  return Fold_let(AST_pair_cdr(bindings), body, constants, mark, kept);
+}
+
+ASTNode *Fold_code(ASTNode *code) {
+  Env constants;
+  Env_init(&constants);
+  ASTNode *result = list3(AST_pair_car(code),
+                          Fold_list(operand2(code), &constants),
+                          Fold_expr(operand3(code), &constants));
+  Env_deinit(&constants);
+  return result;
+}
+
+ASTNode *Fold_call(ASTNode *callable, ASTNode *args, Env *constants) {
+  Primitive primitive = AST_symbol_primitive(callable);
+  if (primitive == kPrimitiveLet) {
+    ASTNode *bindings = AST_nil();
+    ASTNode **kept = &bindings;
+    word mark = Env_mark(constants);
+    ASTNode *body = Fold_let(/*bindings=*/operand1(args),
+                             /*body=*/operand2(args), constants, mark, &kept);
+    Env_pop(constants, mark);
+    if (AST_is_nil(bindings)) {
+      return body;
+    }
+    return list3(callable, bindings, body);
+  }
+  if (primitive == kPrimitiveIf) {
+    ASTNode *cond = Fold_expr(operand1(args), constants);
+    if (Fold_is_literal(cond)) {
+      // Compile_if only treats #f as false
+      bool truthy = (uword)cond != Object_false();
+      return Fold_expr(truthy ? operand2(args) : operand3(args), constants);
+    }
+    return AST_new_pair(callable,
+                        list3(cond, Fold_expr(operand2(args), constants),
+                              Fold_expr(operand3(args), constants)));
+  }
+  if (primitive == kPrimitiveLabels) {
+    // Each (name (code (formals...) body)) is compiled with an empty
+    // environment, so fold it with one too
+    ASTNode *result = AST_nil();
+    ASTNode **tail = &result;
+    for (ASTNode *bindings = operand1(args); AST_is_pair(bindings);
+         bindings = AST_pair_cdr(bindings)) {
+      ASTNode *binding = AST_pair_car(bindings);
+      ASTNode *folded_code = Fold_code(operand2(binding));
+      ASTNode *name = AST_pair_car(binding);
+      *tail = list1(list2(name, folded_code));
+      tail = &AST_as_pair(*tail)->cdr;
+    }
+    return list3(callable, result,
+                 Fold_expr(operand2(args), constants));
+  }
+  if (primitive == kPrimitiveLabelcall) {
+    return AST_new_pair(callable,
+                        AST_new_pair(operand1(args),
+                                     Fold_list(AST_pair_cdr(args), constants)));
+  }
+  ASTNode *folded_args = Fold_list(args, constants);
+  ASTNode *result = Fold_primitive(callable, folded_args);
+  if (result != NULL) {
+    AST_heap_free(folded_args);
+    return result;
+  }
+  return AST_new_pair(callable, folded_args);
+}
+
+ASTNode *Fold_expr(ASTNode *node, Env *constants) {
+  if (AST_is_symbol(node)) {
+    Binding *binding = Env_lookup(constants, node);
+    // Non-literal bindings are marked with an error so that they shadow
+    if (binding != NULL && binding->value != (word)AST_error()) {
+      return (ASTNode *)binding->value;
+    }
+    return node;
+  }
+  if (AST_is_pair(node)) {
+    ASTNode *callable = AST_pair_car(node);
+    if (AST_is_symbol(callable)) {
+      return Fold_call(callable, AST_pair_cdr(node), constants);
+    }
+    return Fold_list(node, constants);
+  }
+  return node;
+}
+
+ASTNode *Fold(ASTNode *node) {
+  word start = Stats_now_ns();
+  Env constants;
+  Env_init(&constants);
+  ASTNode *result = Fold_expr(node, &constants);
+  Env_deinit(&constants);
+  Stats_record(kPhaseFold, start);
+  return result;
+}
+
+// End Fold
+
+// IR
+
+// A linear, SSA-style intermediate representation of the AST. Every
+// instruction defines at most one value, named by its index in the function.
+// Instructions are grouped into basic blocks, each of which ends in a
+// terminator (jump, branch, or return). Instead of phi instructions, a block
+// may take a single parameter that every jump into the block supplies. Code is
+// still generated straight from the AST; the IR is only lowered and printed
+// (see --repl-ir).
+
+typedef word IRValue;
+
+const IRValue kIRNoValue = -1;
+
+typedef enum {
+  kIRConst,
+  kIRParam,
+  // Unary
+  kIRAdd1,
+  kIRSub1,
+  kIRIntegerToChar,
+  kIRCharToInteger,
+  kIRIsNil,
+  kIRIsZero,
+  kIRNot,
+  kIRIsInteger,
+  kIRIsBoolean,
+  kIRCar,
+  kIRCdr,
+  // Binary
+  kIRAdd,
+  kIRSub,
+  kIRMul,
+  kIREqual,
+  kIRLess,
+  kIRCons,
+  // Terminators
+  kIRJump,
+  kIRBranch,
+  kIRReturn,
+} IROpcode;
+
+const char *kIROpcodeNames[] = {
+    "const", "param", "add1", "sub1",   "integer->char", "char->integer",
+    "nil?",  "zero?", "not",  "integer?", "boolean?",    "car",
+    "cdr",   "+",     "-",    "*",      "=",             "<",
+    "cons",  "jump",  "branch", "return",
+};
+
+typedef struct {
+  IROpcode op;
+  IRValue operands[2];
+  // The encoded object, for kIRConst
+  uword imm;
+  // The successor for kIRJump, or the true and false successors for
+  // kIRBranch
+  word targets[2];
+} IRInstr;
+
+typedef struct {
+  IRValue *instrs;
+  word len;
+  word capacity;
+  // kIRNoValue if the block takes no parameter
+  IRValue param;
+} IRBlock;
+
+typedef struct {
+  IRInstr *instrs;
+  word num_instrs;
+  word instrs_capacity;
+  IRBlock *blocks;
+  word num_blocks;
+  word blocks_capacity;
+  // The block that new instructions are appended to
+  word current;
+} IRFunction;
+
+void *IR_grow(void *array, word *capacity, word len, word elem_size) {
+  if (len < *capacity) {
+    return array;
+  }
+  *capacity = max(*capacity * 2, 8);
+  array = realloc(array, *capacity * elem_size);
+  assert(array != NULL);
+  return array;
+}
+
+word IR_new_block(IRFunction *fn) {
+  fn->blocks = IR_grow(fn->blocks, &fn->blocks_capacity, fn->num_blocks,
+                       sizeof *fn->blocks);
+  fn->blocks[fn->num_blocks] =
+      (IRBlock){.instrs = NULL, .len = 0, .capacity = 0, .param = kIRNoValue};
+  return fn->num_blocks++;
+}
+
+void IRFunction_init(IRFunction *fn) {
+  *fn = (IRFunction){0};
+  fn->current = IR_new_block(fn);
+}
+
+void IRFunction_deinit(IRFunction *fn) {
+  for (word i = 0; i < fn->num_blocks; i++) {
+    free(fn->blocks[i].instrs);
+  }
+  free(fn->blocks);
+  free(fn->instrs);
+  *fn = (IRFunction){0};
+}
+
+IRValue IR_new_instr(IRFunction *fn, IRInstr instr) {
+  fn->instrs = IR_grow(fn->instrs, &fn->instrs_capacity, fn->num_instrs,
+                       sizeof *fn->instrs);
+  IRValue result = fn->num_instrs++;
+  fn->instrs[result] = instr;
+  return result;
+}
+
+IRValue IR_emit(IRFunction *fn, IROpcode op, IRValue left, IRValue right) {
+  IRValue result = IR_new_instr(
+      fn, (IRInstr){.op = op, .operands = {left, right}, .targets = {-1, -1}});
+  IRBlock *block = &fn->blocks[fn->current];
+  block->instrs =
+      IR_grow(block->instrs, &block->capacity, block->len, sizeof(IRValue));
+  block->instrs[block->len++] = result;
+  return result;
+}
+
+IRValue IR_const(IRFunction *fn, uword imm) {
+  IRValue result = IR_emit(fn, kIRConst, kIRNoValue, kIRNoValue);
+  fn->instrs[result].imm = imm;
+  return result;
+}
+
+IRValue IR_block_param(IRFunction *fn, word block) {
+  if (fn->blocks[block].param == kIRNoValue) {
+    // Parameters are not part of the instruction stream; they are defined on
+    // entry to the block
+    fn->blocks[block].param = IR_new_instr(
+        fn, (IRInstr){.op = kIRParam,
+                      .operands = {kIRNoValue, kIRNoValue},
+                      .targets = {-1, -1}});
+  }
+  return fn->blocks[block].param;
+}
+
+void IR_jump(IRFunction *fn, word target, IRValue arg) {
+  IRValue jump = IR_emit(fn, kIRJump, arg, kIRNoValue);
+  fn->instrs[jump].targets[0] = target;
+}
+
+void IR_branch(IRFunction *fn, IRValue cond, word consequent,
+               word alternate) {
+  IRValue branch = IR_emit(fn, kIRBranch, cond, kIRNoValue);
+  fn->instrs[branch].targets[0] = consequent;
+  fn->instrs[branch].targets[1] = alternate;
+}
+
+bool IR_is_terminator(IROpcode op) { return op >= kIRJump; }
+
+word IR_num_operands(IROpcode op) {
+  if (op <= kIRParam) {
+    return 0;
+  }
+  if (op <= kIRCdr) {
+    return 1;
+  }
+  if (op <= kIRCons) {
+    return 2;
+  }
+  // Jumps may pass an argument; branches and returns take one operand
+  return 1;
+}
+
+// The instruction each primitive lowers to. kIRConst marks symbols that do not
+// lower to a single instruction.
+const IROpcode kIRPrimitives[kNumPrimitives] = {
+    [kPrimitiveAdd1] = kIRAdd1,
+    [kPrimitiveSub1] = kIRSub1,
+    [kPrimitiveIntegerToChar] = kIRIntegerToChar,
+    [kPrimitiveCharToInteger] = kIRCharToInteger,
+    [kPrimitiveIsNil] = kIRIsNil,
+    [kPrimitiveIsZero] = kIRIsZero,
+    [kPrimitiveNot] = kIRNot,
+    [kPrimitiveIsInteger] = kIRIsInteger,
+    [kPrimitiveIsBoolean] = kIRIsBoolean,
+    [kPrimitiveCar] = kIRCar,
+    [kPrimitiveCdr] = kIRCdr,
+    [kPrimitiveAdd] = kIRAdd,
+    [kPrimitiveSub] = kIRSub,
+    [kPrimitiveMul] = kIRMul,
+    [kPrimitiveEqual] = kIREqual,
+    [kPrimitiveLess] = kIRLess,
+    [kPrimitiveCons] = kIRCons,
+};
+
+WARN_UNUSED int IR_lower_expr(IRFunction *fn, ASTNode *node, Env *varenv,
+                              IRValue *result);
+
+WARN_UNUSED int IR_lower_let(IRFunction *fn, ASTNode *bindings, ASTNode *body,
+                             Env *varenv, word mark, IRValue *result) {
+  if (AST_is_nil(bindings)) {
+    Env_show(varenv, mark);
+    return IR_lower_expr(fn, body, varenv, result);
+  }
+  assert(AST_is_pair(bindings));
+  ASTNode *binding = AST_pair_car(bindings);
+  ASTNode *name = AST_pair_car(binding);
+  assert(AST_is_symbol(name));
+  IRValue value;
+  _(IR_lower_expr(fn, AST_pair_car(AST_pair_cdr(binding)), varenv, &value));
+  // Let-bound names are just aliases for SSA values
+  Env_bind(varenv, name, value);
+  return IR_lower_let(fn, AST_pair_cdr(bindings), body, varenv, mark, result);
+}
+
+WARN_UNUSED int IR_lower_if(IRFunction *fn, ASTNode *cond,
+                            ASTNode *consequent, ASTNode *alternate,
+                            Env *varenv, IRValue *result) {
+  IRValue cond_value;
+  _(IR_lower_expr(fn, cond, varenv, &cond_value));
+  word consequent_block = IR_new_block(fn);
+  word alternate_block = IR_new_block(fn);
+  word join_block = IR_new_block(fn);
+  IR_branch(fn, cond_value, consequent_block, alternate_block);
+  IRValue value;
+  fn->current = consequent_block;
+  _(IR_lower_expr(fn, consequent, varenv, &value));
+  IR_jump(fn, join_block, value);
+  fn->current = alternate_block;
+  _(IR_lower_expr(fn, alternate, varenv, &value));
+  IR_jump(fn, join_block, value);
+  fn->current = join_block;
+  *result = IR_block_param(fn, join_block);
+  return 0;
+}
+
+WARN_UNUSED int IR_lower_call(IRFunction *fn, ASTNode *callable, ASTNode *args,
+                              Env *varenv, IRValue *result) {
+  if (!AST_is_symbol(callable)) {
+    return -1;
+  }
+  Primitive primitive = AST_symbol_primitive(callable);
+  if (primitive == kPrimitiveLet) {
+    word mark = Env_mark(varenv);
+    int lower_result = IR_lower_let(fn, /*bindings=*/operand1(args),
+                                    /*body=*/operand2(args), varenv, mark,
+                                    result);
+    Env_pop(varenv, mark);
+    return lower_result;
+  }
+  if (primitive == kPrimitiveIf) {
+    return IR_lower_if(fn, /*cond=*/operand1(args),
+                       /*consequent=*/operand2(args),
+                       /*alternate=*/operand3(args), varenv, result);
+  }
+  IROpcode op = kIRPrimitives[primitive];
+  if (op == kIRConst) {
+    // labels, code, and labelcall have no IR form; only Compile_entry
+    // compiles them
+    return -1;
+  }
+  IRValue left;
+  _(IR_lower_expr(fn, operand1(args), varenv, &left));
+  if (IR_num_operands(op) == 1) {
+    *result = IR_emit(fn, op, left, kIRNoValue);
+    return 0;
+  }
+  IRValue right;
+  _(IR_lower_expr(fn, operand2(args), varenv, &right));
+  *result = IR_emit(fn, op, left, right);
+  return 0;
+}
+
+WARN_UNUSED int IR_lower_expr(IRFunction *fn, ASTNode *node, Env *varenv,
+                              IRValue *result) {
+  if (AST_is_integer(node)) {
+    *result = IR_const(fn, Object_encode_integer(AST_get_integer(node)));
+    return 0;
+  }
+  if (AST_is_char(node)) {
+    *result = IR_const(fn, Object_encode_char(AST_get_char(node)));
+    return 0;
+  }
+  if (AST_is_bool(node)) {
+    *result = IR_const(fn, Object_encode_bool(AST_get_bool(node)));
+    return 0;
+  }
+  if (AST_is_nil(node)) {
+    *result = IR_const(fn, Object_nil());
+    return 0;
+  }
+  if (AST_is_pair(node)) {
+    return IR_lower_call(fn, AST_pair_car(node), AST_pair_cdr(node), varenv,
+                         result);
+  }
+  if (AST_is_symbol(node)) {
+    word value;
+    if (Env_find(varenv, node, &value)) {
+      *result = value;
+      return 0;
+    }
+    return -1;
+  }
+  assert(0 && "unexpected node type");
+}
+
+WARN_UNUSED int IR_lower(IRFunction *fn, ASTNode *node) {
+  IRValue value;
+  Env varenv;
+  Env_init(&varenv);
+  int lower_result = IR_lower_expr(fn, node, &varenv, &value);
+  Env_deinit(&varenv);
+  _(lower_result);
+  IR_emit(fn, kIRReturn, value, kIRNoValue);
+  return 0;
+}
+
+void IR_dump(IRFunction *fn, FILE *fp) {
+  for (word b = 0; b < fn->num_blocks; b++) {
+    IRBlock *block = &fn->blocks[b];
+    fprintf(fp, "bb%ld", b);
+    if (block->param != kIRNoValue) {
+      fprintf(fp, "(v%ld)", block->param);
+    }
+    fprintf(fp, ":\n");
+    for (word i = 0; i < block->len; i++) {
+      IRValue v = block->instrs[i];
+      IRInstr *instr = &fn->instrs[v];
+      fprintf(fp, "  ");
+      if (!IR_is_terminator(instr->op)) {
+        fprintf(fp, "v%ld = ", v);
+      }
+      fprintf(fp, "%s", kIROpcodeNames[instr->op]);
+      if (instr->op == kIRConst) {
+        fprintf(fp, " 0x%lx", instr->imm);
+      }
+      for (word j = 0; j < IR_num_operands(instr->op); j++) {
+        if (instr->operands[j] != kIRNoValue) {
+          fprintf(fp, " v%ld", instr->operands[j]);
+        }
+      }
+      if (instr->op == kIRJump) {
+        fprintf(fp, " -> bb%ld", instr->targets[0]);
+      } else if (instr->op == kIRBranch) {
+        fprintf(fp, " -> bb%ld, bb%ld", instr->targets[0], instr->targets[1]);
+      }
+      fprintf(fp, "\n");
+    }
+  }
+}
+
+// End IR
+
+typedef uword (*JitFunction)(uword *alloc_ptr, Heap *heap);
+
+// Code heap
+
+// Long-lived executable memory shared by many small compiled functions. Giving
+// every function its own mapping costs at least a page (and an iTLB entry)
+// for what is often a few dozen bytes of code, so instead blocks are carved
+// out of big slabs. Freed blocks go on a free list for their size class and
+// are handed out again to code of the same class; CodeHeap_compact squeezes
+// the holes out of the slabs and gives the pages behind them back. Compiled
+// code only refers to itself relative to rip and to the runtime through the
+// Heap argument, so a block can be moved with a plain copy.
+
+const word kCodeHeapGranule = 16; // bytes
+// Blocks of up to kCodeHeapNumSmallClasses granules get one class per size.
+// Bigger ones get one per power of two, up to a whole slab.
+const word kCodeHeapNumSmallClasses = 16;
+const word kCodeHeapNumClasses = 28;
+const word kCodeHeapSlabSize = 1024 * 1024; // bytes
+
+typedef struct CodeBlock {
+  struct CodeSlab *slab;
+  word offset;
+  // Bytes reserved for the block; at least the length of its code
+  word size;
+  // Position in the slab's list of live blocks
+  word index;
+  // Next free block of the same size class
+  struct CodeBlock *next;
+} CodeBlock;
+
+typedef struct CodeSlab {
+  // Blocks are bumped off the end at len
+  Buffer buf;
+  CodeBlock **blocks;
+  word num_blocks;
+  word blocks_capacity;
+} CodeSlab;
+
+typedef struct {
+  CodeSlab **slabs;
+  word num_slabs;
+  word slabs_capacity;
+  // The slab that new blocks are bumped from, if any
+  CodeSlab *current;
+  // One list per size class
+  CodeBlock **free_lists;
+  // Sums of the sizes of the blocks in use and on the free lists, in bytes
+  word live_bytes;
+  word free_bytes;
+} CodeHeap;
+
+// The size class of a block of size bytes, or -1 if it needs a slab to
+// itself.
+word CodeHeap_size_class(word size) {
+  word granules = (max(size, 1) + kCodeHeapGranule - 1) / kCodeHeapGranule;
+  if (granules <= kCodeHeapNumSmallClasses) {
+    return granules - 1;
+  }
+  word result = kCodeHeapNumSmallClasses;
+  for (word class_size = kCodeHeapGranule * kCodeHeapNumSmallClasses * 2;
+       class_size < size; class_size *= 2) {
+    result++;
+  }
+  return result < kCodeHeapNumClasses ? result : -1;
+}
+
+word CodeHeap_class_size(word size_class) {
+  if (size_class < kCodeHeapNumSmallClasses) {
+    return (size_class + 1) * kCodeHeapGranule;
+  }
+  return kCodeHeapGranule * kCodeHeapNumSmallClasses
+         << (size_class - kCodeHeapNumSmallClasses + 1);
+}
+
+// How many bytes a block holding size bytes of code takes up.
+word CodeHeap_block_size(word size) {
+  word size_class = CodeHeap_size_class(size);
+  if (size_class < 0) {
+    return (size + kCodeHeapGranule - 1) / kCodeHeapGranule *
+           kCodeHeapGranule;
+  }
+  return CodeHeap_class_size(size_class);
+}
+
+void CodeHeap_init(CodeHeap *heap) {
+  heap->slabs = NULL;
+  heap->num_slabs = 0;
+  heap->slabs_capacity = 0;
+  heap->current = NULL;
+  heap->free_lists = calloc(kCodeHeapNumClasses, sizeof *heap->free_lists);
+  assert(heap->free_lists != NULL);
+  heap->live_bytes = 0;
+  heap->free_bytes = 0;
+}
+
+// Slabs are dual-mapped where possible, so that filling them in never
+// touches page permissions. Otherwise they are executable and only made
+// writable around each write, which is safe because nothing runs code while
+// the compiler writes more.
+CodeSlab *CodeHeap_new_slab(CodeHeap *heap, word capacity) {
+  CodeSlab *slab = malloc(sizeof *slab);
+  assert(slab != NULL);
+  if (Buffer_init_dual(&slab->buf, capacity) < 0) {
+    Buffer_init_reserved(&slab->buf, capacity);
+    int result = mprotect(slab->buf.address, slab->buf.capacity,
+                          PROT_READ | PROT_EXEC);
+    assert(result == 0);
+    (void)result;
+    slab->buf.state = kExecutable;
+  }
+  slab->blocks = NULL;
+  slab->num_blocks = 0;
+  slab->blocks_capacity = 0;
+  if (heap->num_slabs == heap->slabs_capacity) {
+    heap->slabs_capacity = max(heap->slabs_capacity * 2, 4);
+    heap->slabs =
+        realloc(heap->slabs, heap->slabs_capacity * sizeof *heap->slabs);
+    assert(heap->slabs != NULL);
+  }
+  heap->slabs[heap->num_slabs++] = slab;
+  return slab;
+}
+
+void CodeHeap_release_slab(CodeHeap *heap, word index) {
+  CodeSlab *slab = heap->slabs[index];
+  if (slab == heap->current) {
+    heap->current = NULL;
+  }
+  heap->slabs[index] = heap->slabs[--heap->num_slabs];
+  Buffer_deinit(&slab->buf);
+  free(slab->blocks);
+  free(slab);
+}
+
+void CodeSlab_add_block(CodeSlab *slab, CodeBlock *block) {
+  if (slab->num_blocks == slab->blocks_capacity) {
+    slab->blocks_capacity = max(slab->blocks_capacity * 2, 16);
+    slab->blocks =
+        realloc(slab->blocks, slab->blocks_capacity * sizeof *slab->blocks);
+    assert(slab->blocks != NULL);
+  }
+  block->slab = slab;
+  block->index = slab->num_blocks;
+  slab->blocks[slab->num_blocks++] = block;
+}
+
+void CodeSlab_remove_block(CodeSlab *slab, CodeBlock *block) {
+  CodeBlock *last = slab->blocks[--slab->num_blocks];
+  slab->blocks[block->index] = last;
+  last->index = block->index;
+}
+
+// Open up the first len bytes of the slab for writing, if they are not
+// already.
+void CodeSlab_begin_write(CodeSlab *slab, word len) {
+  if (slab->buf.state == kDualMapped) {
+    return;
+  }
+  word start = Stats_now_ns();
+  int result = mprotect(slab->buf.address, len, PROT_READ | PROT_WRITE);
+  assert(result == 0);
+  (void)result;
+  Stats_record(kPhaseMprotect, start);
+}
+
+void CodeSlab_end_write(CodeSlab *slab, word len) {
+  if (slab->buf.state == kDualMapped) {
+    return;
+  }
+  word start = Stats_now_ns();
+  int result = mprotect(slab->buf.address, len, PROT_READ | PROT_EXEC);
+  assert(result == 0);
+  (void)result;
+  Stats_record(kPhaseMprotect, start);
+}
+
+// Reserve a block for size bytes of code.
+CodeBlock *CodeHeap_alloc(CodeHeap *heap, word size) {
+  word size_class = CodeHeap_size_class(size);
+  word block_size = CodeHeap_block_size(size);
+  CodeBlock *block;
+  if (size_class >= 0 && heap->free_lists[size_class] != NULL) {
+    block = heap->free_lists[size_class];
+    heap->free_lists[size_class] = block->next;
+    heap->free_bytes -= block_size;
+    CodeSlab_add_block(block->slab, block);
+  } else {
+    CodeSlab *slab = heap->current;
+    if (size_class < 0) {
+      // Big enough to get a slab to itself
+      slab = CodeHeap_new_slab(heap, block_size);
+    } else if (slab == NULL ||
+               slab->buf.len + block_size > slab->buf.capacity) {
+      slab = heap->current = CodeHeap_new_slab(heap, kCodeHeapSlabSize);
+    }
+    block = malloc(sizeof *block);
+    assert(block != NULL);
+    block->offset = slab->buf.len;
+    block->size = block_size;
+    slab->buf.len += block_size;
+    CodeSlab_add_block(slab, block);
+  }
+  block->next = NULL;
+  heap->live_bytes += block_size;
+  return block;
+}
+
+// Copy the code in buf, which must still be readable, into a new block.
+CodeBlock *CodeHeap_add(CodeHeap *heap, Buffer *buf) {
+  word len = Buffer_len(buf);
+  CodeBlock *block = CodeHeap_alloc(heap, len);
+  CodeSlab *slab = block->slab;
+  word end = block->offset + len;
+  CodeSlab_begin_write(slab, end);
+  memcpy(slab->buf.address + block->offset, buf->address, len);
+  CodeSlab_end_write(slab, end);
+  return block;
+}
+
+void CodeHeap_free(CodeHeap *heap, CodeBlock *block) {
+  CodeSlab *slab = block->slab;
+  CodeSlab_remove_block(slab, block);
+  heap->live_bytes -= block->size;
+  word size_class = CodeHeap_size_class(block->size);
+  if (size_class < 0) {
+    // The slab was only ever for this block
+    for (word i = 0; i < heap->num_slabs; i++) {
+      if (heap->slabs[i] == slab) {
+        CodeHeap_release_slab(heap, i);
+        break;
+      }
+    }
+    free(block);
+    return;
+  }
+  block->next = heap->free_lists[size_class];
+  heap->free_lists[size_class] = block;
+  heap->free_bytes += block->size;
+}
+
+JitFunction CodeBlock_function(CodeBlock *block) {
+  // See Testing_execute_entry about the cast
+  byte *address = block->slab->buf.exec_address + block->offset;
+  return *(JitFunction *)(&address);
+}
+
+int CodeBlock_compare_offsets(const void *left, const void *right) {
+  word left_offset = (*(CodeBlock *const *)left)->offset;
+  word right_offset = (*(CodeBlock *const *)right)->offset;
+  return (left_offset > right_offset) - (left_offset < right_offset);
+}
+
+// Worth compacting once most of what the free lists hold is dead code and
+// there is at least a page of it.
+bool CodeHeap_should_compact(CodeHeap *heap) {
+  return heap->free_bytes > heap->live_bytes &&
+         heap->free_bytes >= sysconf(_SC_PAGESIZE);
+}
+
+// Forget the free blocks. The space they took up stays in the slabs.
+void CodeHeap_drop_free_lists(CodeHeap *heap) {
+  for (word i = 0; i < kCodeHeapNumClasses; i++) {
+    while (heap->free_lists[i] != NULL) {
+      CodeBlock *block = heap->free_lists[i];
+      heap->free_lists[i] = block->next;
+      free(block);
+    }
+  }
+  heap->free_bytes = 0;
+}
+
+// Slide the live blocks of every slab down over the holes left by freed ones,
+// drop the free lists, and give the pages past the last live block of each
+// slab back to the kernel. Slabs with nothing left in them are unmapped. This
+// moves code, so none of it may be running, and entry points have to be
+// fetched from their blocks again afterwards. Returns the number of bytes
+// taken out of the slabs.
+word CodeHeap_compact(CodeHeap *heap) {
+  CodeHeap_drop_free_lists(heap);
+  word page_size = sysconf(_SC_PAGESIZE);
+  word result = 0;
+  for (word i = 0; i < heap->num_slabs;) {
+    CodeSlab *slab = heap->slabs[i];
+    word len = slab->buf.len;
+    if (slab->num_blocks == 0) {
+      result += len;
+      CodeHeap_release_slab(heap, i);
+      continue;
+    }
+    qsort(slab->blocks, slab->num_blocks, sizeof *slab->blocks,
+          CodeBlock_compare_offsets);
+    CodeSlab_begin_write(slab, len);
+    word top = 0;
+    for (word j = 0; j < slab->num_blocks; j++) {
+      CodeBlock *block = slab->blocks[j];
+      block->index = j;
+      if (block->offset != top) {
+        memmove(slab->buf.address + top, slab->buf.address + block->offset,
+                block->size);
+        block->offset = top;
+      }
+      top += block->size;
+    }
+    CodeSlab_end_write(slab, len);
+    word first_unused_page = (top + page_size - 1) & -page_size;
+    word last_used_page = (len + page_size - 1) & -page_size;
+    if (first_unused_page < last_used_page) {
+      // The slab is still mapped, so its pages have to be dropped from the
+      // memfd (or the anonymous mapping) explicitly
+      madvise(slab->buf.address + first_unused_page,
+              last_used_page - first_unused_page,
+              slab->buf.state == kDualMapped ? MADV_REMOVE : MADV_DONTNEED);
+    }
+    result += len - top;
+    slab->buf.len = top;
+    i++;
+  }
+  return result;
+}
+
+void CodeHeap_deinit(CodeHeap *heap) {
+  CodeHeap_drop_free_lists(heap);
+  while (heap->num_slabs > 0) {
+    CodeSlab *slab = heap->slabs[heap->num_slabs - 1];
+    for (word i = 0; i < slab->num_blocks; i++) {
+      free(slab->blocks[i]);
+    }
+    CodeHeap_release_slab(heap, heap->num_slabs - 1);
+  }
+  free(heap->slabs);
+  heap->slabs = NULL;
+  heap->slabs_capacity = 0;
+  free(heap->free_lists);
+  heap->free_lists = NULL;
+  heap->live_bytes = 0;
+}
+
+// End Code heap
+
+// Code cache
+
+// Compiled code keyed on the exact source text that produced it, so that
+// evaluating the same input again skips the reader and the compiler. The code
+// lives in a CodeHeap owned by the cache. Entries are kept in
+// least-recently-used order and evicted from the back once the size of the
+// cached code goes over the byte budget.
+
+typedef struct CodeCacheEntry {
+  uword hash;
+  char *source;
+  CodeBlock *code;
+  // Next entry in the same hash bucket
+  struct CodeCacheEntry *chain;
+  // Neighbors in recency order; the head is the most recently used
+  struct CodeCacheEntry *prev;
+  struct CodeCacheEntry *next;
+} CodeCacheEntry;
+
+typedef struct {
+  CodeCacheEntry **buckets;
+  word num_buckets;
+  word num_entries;
+  CodeCacheEntry *head;
+  CodeCacheEntry *tail;
+  CodeHeap code_heap;
+  // Sum of the sizes of the cached blocks, in bytes
+  word size;
+  word budget;
+  word hits;
+  word misses;
+} CodeCache;
+
+const word kCodeCacheBudget = 16 * 1024 * 1024; // bytes
+
+void CodeCache_init(CodeCache *cache, word budget) {
+  cache->num_buckets = 64;
+  cache->buckets = calloc(cache->num_buckets, sizeof *cache->buckets);
+  assert(cache->buckets != NULL);
+  cache->num_entries = 0;
+  cache->head = cache->tail = NULL;
+  CodeHeap_init(&cache->code_heap);
+  cache->size = 0;
+  cache->budget = budget;
+  cache->hits = 0;
+  cache->misses = 0;
+}
+
+void CodeCache_unlink(CodeCache *cache, CodeCacheEntry *entry) {
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    cache->head = entry->next;
+  }
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->tail = entry->prev;
+  }
+  entry->prev = entry->next = NULL;
+}
+
+void CodeCache_push_front(CodeCache *cache, CodeCacheEntry *entry) {
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head != NULL) {
+    cache->head->prev = entry;
+  } else {
+    cache->tail = entry;
+  }
+  cache->head = entry;
+}
+
+void CodeCache_remove(CodeCache *cache, CodeCacheEntry *entry) {
+  CodeCacheEntry **link = &cache->buckets[entry->hash % cache->num_buckets];
+  while (*link != entry) {
+    link = &(*link)->chain;
+  }
+  *link = entry->chain;
+  CodeCache_unlink(cache, entry);
+  cache->size -= entry->code->size;
+  cache->num_entries--;
+  CodeHeap_free(&cache->code_heap, entry->code);
+  free(entry->source);
+  free(entry);
+}
+
+void CodeCache_deinit(CodeCache *cache) {
+  while (cache->head != NULL) {
+    CodeCache_remove(cache, cache->head);
+  }
+  free(cache->buckets);
+  cache->buckets = NULL;
+  cache->num_buckets = 0;
+  CodeHeap_deinit(&cache->code_heap);
+}
+
+// Returns the cached code for source, or NULL. The block stays owned by the
+// cache and is valid until the next insert.
+CodeBlock *CodeCache_lookup(CodeCache *cache, const char *source) {
+  uword hash = hash_cstr(source);
+  for (CodeCacheEntry *entry = cache->buckets[hash % cache->num_buckets];
+       entry != NULL; entry = entry->chain) {
+    if (entry->hash == hash && strcmp(entry->source, source) == 0) {
+      CodeCache_unlink(cache, entry);
+      CodeCache_push_front(cache, entry);
+      cache->hits++;
+      return entry->code;
+    }
+  }
+  cache->misses++;
+  return NULL;
+}
+
+void CodeCache_grow(CodeCache *cache) {
+  word num_buckets = cache->num_buckets * 2;
+  CodeCacheEntry **buckets = calloc(num_buckets, sizeof *buckets);
+  assert(buckets != NULL);
+  for (CodeCacheEntry *entry = cache->head; entry != NULL;
+       entry = entry->next) {
+    CodeCacheEntry **bucket = &buckets[entry->hash % num_buckets];
+    entry->chain = *bucket;
+    *bucket = entry;
+  }
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->num_buckets = num_buckets;
+}
+
+// Copies the code in buf, which must still be readable and must not already
+// be cached under source, into the cache and returns the cached copy. buf
+// stays with the caller. Returns NULL if the code is bigger than the whole
+// budget.
+CodeBlock *CodeCache_insert(CodeCache *cache, const char *source,
+                            Buffer *buf) {
+  word size = CodeHeap_block_size(Buffer_len(buf));
+  if (size > cache->budget) {
+    return NULL;
+  }
+  while (cache->size + size > cache->budget) {
+    CodeCache_remove(cache, cache->tail);
+  }
+  if (CodeHeap_should_compact(&cache->code_heap)) {
+    CodeHeap_compact(&cache->code_heap);
+  }
+  if (cache->num_entries >= cache->num_buckets) {
+    CodeCache_grow(cache);
+  }
+  CodeCacheEntry *entry = malloc(sizeof *entry);
+  assert(entry != NULL);
+  word source_size = strlen(source) + 1;
+  entry->source = malloc(source_size);
+  assert(entry->source != NULL);
+  memcpy(entry->source, source, source_size);
+  entry->hash = hash_cstr(source);
+  entry->code = CodeHeap_add(&cache->code_heap, buf);
+  CodeCacheEntry **bucket = &cache->buckets[entry->hash % cache->num_buckets];
+  entry->chain = *bucket;
+  *bucket = entry;
+  CodeCache_push_front(cache, entry);
+  cache->size += size;
+  cache->num_entries++;
+  return entry->code;
+}
+
+// End Code cache
+
+// Disk cache
+
+// Compiled code saved across runs, one file per source text, named after the
+// source's hash. A file holds a header, the source (to rule out hash
+// collisions), and the code, which starts on a page boundary so that loading
+// it is a single mmap with PROT_EXEC. The code is position-independent, so it
+// runs wherever it gets mapped.
+
+// Bump this whenever the file layout changes, so that old files are ignored.
+// Files are also tied to the build that wrote them, since nearly any change
+// to the compiler changes the code it generates.
+const uint32_t kDiskCacheVersion = 1;
+
+const char kDiskCacheMagic[4] = {'L', 'S', 'P', 'C'};
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  // DiskCache_build_id of the program that wrote the file
+  uword build_id;
+  uword source_hash;
+  word source_length;
+  word code_offset;
+  word code_length;
+} DiskCacheHeader;
+
+// dl_iterate_phdr callback: hash the GNU build ID note of the executable,
+// which is always the first object, into *data.
+int DiskCache_find_build_id(struct dl_phdr_info *info, size_t size,
+                            void *data) {
+  (void)size;
+  for (word i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *segment = &info->dlpi_phdr[i];
+    if (segment->p_type != PT_NOTE) {
+      continue;
+    }
+    byte *note = (byte *)(info->dlpi_addr + segment->p_vaddr);
+    byte *end = note + segment->p_memsz;
+    while (note + sizeof(ElfW(Nhdr)) <= end) {
+      ElfW(Nhdr) *header = (ElfW(Nhdr) *)note;
+      byte *name = note + sizeof *header;
+      // The name and the descriptor are each padded to 4 bytes
+      byte *desc = name + ((header->n_namesz + 3) & ~3);
+      if (header->n_type == NT_GNU_BUILD_ID &&
+          header->n_namesz == sizeof "GNU" &&
+          memcmp(name, "GNU", sizeof "GNU") == 0) {
+        uword hash = 0xcbf29ce484222325;
+        for (uword j = 0; j < header->n_descsz; j++) {
+          hash ^= desc[j];
+          hash *= 0x100000001b3;
+        }
+        *(uword *)data = hash;
+        return 1;
+      }
+      note = desc + ((header->n_descsz + 3) & ~3);
+    }
+  }
+  // Stop after the executable
+  return 1;
+}
+
+// 0 until DiskCache_build_id looks it up
+uword disk_cache_build_id = 0;
+bool disk_cache_build_id_known = false;
+
+// A hash of the linker's build ID for this program, which changes with any
+// change to its code, or 0 if it was linked without one. Files are only
+// written and read when there is a build ID to tie them to.
+uword DiskCache_build_id(void) {
+  if (!disk_cache_build_id_known) {
+    dl_iterate_phdr(DiskCache_find_build_id, &disk_cache_build_id);
+    disk_cache_build_id_known = true;
+  }
+  return disk_cache_build_id;
+}
+
+char *DiskCache_path(const char *dir, const char *source) {
+  word size = strlen(dir) + sizeof "/0123456789abcdef.code";
+  char *path = malloc(size);
+  assert(path != NULL);
+  snprintf(path, size, "%s/%016lx.code", dir, hash_cstr(source));
+  return path;
+}
+
+bool DiskCache_read_at(int fd, void *dst, word size, word offset) {
+  return pread(fd, dst, size, offset) == size;
+}
+
+bool DiskCache_valid_header(DiskCacheHeader *header, const char *source,
+                            word file_size) {
+  return memcmp(header->magic, kDiskCacheMagic, sizeof kDiskCacheMagic) == 0 &&
+         header->version == kDiskCacheVersion &&
+         header->build_id != 0 && header->build_id == DiskCache_build_id() &&
+         header->source_hash == hash_cstr(source) &&
+         header->source_length == (word)strlen(source) &&
+         header->code_length > 0 &&
+         header->code_offset % sysconf(_SC_PAGESIZE) == 0 &&
+         header->code_offset + header->code_length == file_size;
+}
+
+int DiskCache_map(int fd, const char *source, Buffer *buf) {
+  struct stat st;
+  DiskCacheHeader header;
+  if (fstat(fd, &st) < 0 ||
+      !DiskCache_read_at(fd, &header, sizeof header, /*offset=*/0) ||
+      !DiskCache_valid_header(&header, source, st.st_size)) {
+    return -1;
+  }
+  char *cached_source = malloc(header.source_length);
+  assert(cached_source != NULL);
+  bool same_source = DiskCache_read_at(fd, cached_source, header.source_length,
+                                       sizeof header) &&
+                     memcmp(cached_source, source, header.source_length) == 0;
+  free(cached_source);
+  if (!same_source) {
+    return -1;
+  }
+  // Readable too, so that the code can be copied into a code heap
+  void *code = mmap(/*addr=*/NULL, header.code_length, PROT_READ | PROT_EXEC,
+                    MAP_PRIVATE, fd, header.code_offset);
+  if (code == MAP_FAILED) {
+    return -1;
+  }
+  buf->address = code;
+  buf->exec_address = code;
+  buf->state = kExecutable;
+  buf->len = header.code_length;
+  buf->capacity = header.code_length;
+  return 0;
+}
+
+// Map the code cached for source into buf, which is left executable. Returns
+// 0 on success and -1 if there is no usable cached code.
+int DiskCache_load(const char *dir, const char *source, Buffer *buf) {
+  char *path = DiskCache_path(dir, source);
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if (fd < 0) {
+    return -1;
+  }
+  // The mapping outlives the descriptor
+  int result = DiskCache_map(fd, source, buf);
+  close(fd);
+  return result;
+}
+
+bool DiskCache_write_at(int fd, const void *src, word size, word offset) {
+  return pwrite(fd, src, size, offset) == size;
+}
+
+bool DiskCache_write_file(int fd, const char *source, Buffer *buf) {
+  word page_size = sysconf(_SC_PAGESIZE);
+  DiskCacheHeader header = {
+      .version = kDiskCacheVersion,
+      .build_id = DiskCache_build_id(),
+      .source_hash = hash_cstr(source),
+      .source_length = strlen(source),
+      .code_length = Buffer_len(buf),
+  };
+  memcpy(header.magic, kDiskCacheMagic, sizeof kDiskCacheMagic);
+  header.code_offset =
+      (sizeof header + header.source_length + page_size - 1) & -page_size;
+  return DiskCache_write_at(fd, &header, sizeof header, /*offset=*/0) &&
+         DiskCache_write_at(fd, source, header.source_length, sizeof header) &&
+         DiskCache_write_at(fd, buf->address, header.code_length,
+                            header.code_offset);
+}
+
+// Save the code in buf, which must still be writable (and so readable), as
+// the code for source. Returns 0 on success. The file is written under a
+// temporary name and renamed into place, so a concurrent load never sees
+// half of it.
+int DiskCache_store(const char *dir, const char *source, Buffer *buf) {
+  assert(buf->state != kExecutable);
+  if (DiskCache_build_id() == 0) {
+    return -1;
+  }
+  char *path = DiskCache_path(dir, source);
+  word tmp_size = strlen(path) + sizeof ".tmp.4294967295";
+  char *tmp_path = malloc(tmp_size);
+  assert(tmp_path != NULL);
+  snprintf(tmp_path, tmp_size, "%s.tmp.%d", path, (int)getpid());
+  int result = -1;
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    bool written = DiskCache_write_file(fd, source, buf);
+    if (close(fd) == 0 && written && rename(tmp_path, path) == 0) {
+      result = 0;
+    } else {
+      unlink(tmp_path);
+    }
+  }
+  free(tmp_path);
+  free(path);
+  return result;
+}
+
+// End Disk cache
+
+// Batch
+
+// Compiles many top-level forms into one Buffer, so that they share a single
+// mapping and a single mprotect instead of paying for one each. Each form
+// gets its own entry point; entries[i] is the offset of form i's in buf, or
+// -1 if it failed to compile or did not fit.
+typedef struct {
+  Buffer buf;
+  // Each form is compiled here first, then copied into buf if it fits
+  Buffer scratch;
+  word *entries;
+  word num_entries;
+  word entries_capacity;
+} Batch;
+
+// Address space only; a batch uses as many pages as its code fills
+const word kBatchReservation = 256 * 1024 * 1024; // bytes
+
+void Batch_init(Batch *batch, word reservation) {
+  if (Buffer_init_dual(&batch->buf, reservation) < 0) {
+    Buffer_init_reserved(&batch->buf, reservation);
+  }
+  Buffer_init(&batch->scratch, 1);
+  batch->entries = NULL;
+  batch->num_entries = 0;
+  batch->entries_capacity = 0;
+}
+
+void Batch_deinit(Batch *batch) {
+  Buffer_deinit(&batch->buf);
+  Buffer_deinit(&batch->scratch);
+  free(batch->entries);
+  batch->entries = NULL;
+  batch->num_entries = 0;
+  batch->entries_capacity = 0;
+}
+
+// Compile node into the batch. Returns 0 on success. Either way, the form
+// gets the next entry. A dual-mapped batch cannot grow, so a form that does
+// not fit in what is left of it is rejected.
+int Batch_add(Batch *batch, ASTNode *node) {
+  assert(batch->buf.state != kExecutable);
+  if (batch->num_entries == batch->entries_capacity) {
+    batch->entries_capacity =
+        batch->entries_capacity ? batch->entries_capacity * 2 : 64;
+    batch->entries = realloc(batch->entries, batch->entries_capacity *
+                                                 sizeof *batch->entries);
+    assert(batch->entries != NULL);
+  }
+  Buffer *scratch = &batch->scratch;
+  scratch->len = 0;
+  scratch->jump_target = 0;
+  word start = Buffer_len(&batch->buf);
+  if (Compile_entry(scratch, node) < 0 ||
+      (batch->buf.state == kDualMapped &&
+       start + Buffer_len(scratch) > batch->buf.capacity)) {
+    batch->entries[batch->num_entries++] = -1;
+    return -1;
+  }
+  // Jumps and calls are all relative, so code compiled at the start of a
+  // Buffer works just as well at an offset
+  Buffer_write_arr(&batch->buf, scratch->address, Buffer_len(scratch));
+  batch->entries[batch->num_entries++] = start;
+  return 0;
+}
+
+// Read, fold, and compile every form from reader. Returns 0 if every form
+// parsed, even if some failed to compile; stops at the first parse error and
+// returns -1.
+int Batch_add_all(Batch *batch, Reader *reader) {
+  // The caller may have an arena of its own
+  Arena *saved_arena = ast_arena;
+  while (!Reader_at_end(reader)) {
+    // Every AST node for this form comes from one arena
+    Arena arena;
+    Arena_init(&arena);
+    ast_arena = &arena;
+    ASTNode *node = Reader_read_next(reader);
+    int result = 0;
+    if (AST_is_error(node)) {
+      result = -1;
+    } else {
+      Batch_add(batch, Fold(node));
+    }
+    ast_arena = saved_arena;
+    Arena_release(&arena);
+    if (result < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Make the whole batch executable at once. No more forms can be added,
+// unless the batch is dual-mapped: then its forms are runnable as soon as
+// they are added and this does nothing.
+void Batch_finish(Batch *batch) { Buffer_make_executable(&batch->buf); }
+
+// The entry point of form index, or NULL if it failed to compile.
+JitFunction Batch_function(Batch *batch, word index) {
+  assert(Buffer_is_executable(&batch->buf));
+  assert(index >= 0 && index < batch->num_entries);
+  if (batch->entries[index] < 0) {
+    return NULL;
+  }
+  // See Testing_execute_entry about the cast
+  byte *address = batch->buf.exec_address + batch->entries[index];
+  return *(JitFunction *)(&address);
+}
+
+// End Batch
+
+// ELF
+
+// Ahead-of-time output: a compiled Buffer written out as a relocatable x86-64
+// ELF object that can be linked into a C program. Generated code only jumps
+// and calls within itself, using relative displacements, and reaches the
+// collector through the Heap it is passed, so .text needs no relocations.
+
+typedef struct {
+  const char *name;
+  word offset;
+  word size;
+} ElfSymbol;
+
+word Elf_add_string(Buffer *strtab, const char *str) {
+  word offset = Buffer_len(strtab);
+  Buffer_write_arr(strtab, (const byte *)str, strlen(str) + 1);
+  return offset;
+}
+
+word Elf_align(word offset, word alignment) {
+  return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+bool Elf_write_at(FILE *fp, word *pos, word offset, const void *data,
+                  word size) {
+  assert(offset >= *pos);
+  for (; *pos < offset; ++*pos) {
+    if (fputc(0, fp) == EOF) {
+      return false;
+    }
+  }
+  if (size > 0 && fwrite(data, size, 1, fp) != 1) {
+    return false;
+  }
+  *pos += size;
+  return true;
+}
+
+// Write code as the .text of an object file, with a global function symbol
+// for each of symbols. Returns 0 on success.
+int Elf_write_object(FILE *fp, Buffer *code, ElfSymbol *symbols,
+                     word num_symbols) {
+  enum {
+    kSectionNull,
+    kSectionText,
+    kSectionNoteStack,
+    kSectionSymtab,
+    kSectionStrtab,
+    kSectionShstrtab,
+    kNumSections,
+  };
+  Buffer shstrtab, strtab;
+  Buffer_init(&shstrtab, 64);
+  Buffer_init(&strtab, 64);
+  Elf64_Shdr sections[kNumSections];
+  memset(sections, 0, sizeof sections);
+  Elf_add_string(&shstrtab, "");
+  Elf_add_string(&strtab, "");
+
+  // The null symbol and the .text section symbol are local; every other
+  // symbol is global
+  word num_syms = num_symbols + 2;
+  Elf64_Sym *syms = calloc(num_syms, sizeof *syms);
+  assert(syms != NULL);
+  syms[1].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+  syms[1].st_shndx = kSectionText;
+  for (word i = 0; i < num_symbols; i++) {
+    Elf64_Sym *sym = &syms[i + 2];
+    sym->st_name = Elf_add_string(&strtab, symbols[i].name);
+    sym->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+    sym->st_shndx = kSectionText;
+    sym->st_value = symbols[i].offset;
+    sym->st_size = symbols[i].size;
+  }
+
+  // Lay out the file: header, then the section contents, then the section
+  // headers
+  word text_offset = Elf_align(sizeof(Elf64_Ehdr), 16);
+  word symtab_offset = Elf_align(text_offset + Buffer_len(code), 8);
+  word symtab_size = num_syms * sizeof *syms;
+  word strtab_offset = symtab_offset + symtab_size;
+  sections[kSectionText] = (Elf64_Shdr){
+      .sh_name = Elf_add_string(&shstrtab, ".text"),
+      .sh_type = SHT_PROGBITS,
+      .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
+      .sh_offset = text_offset,
+      .sh_size = Buffer_len(code),
+      .sh_addralign = 16,
+  };
+  // Without this, linkers assume that the object needs an executable stack
+  sections[kSectionNoteStack] = (Elf64_Shdr){
+      .sh_name = Elf_add_string(&shstrtab, ".note.GNU-stack"),
+      .sh_type = SHT_PROGBITS,
+      .sh_offset = text_offset,
+      .sh_addralign = 1,
+  };
+  sections[kSectionSymtab] = (Elf64_Shdr){
+      .sh_name = Elf_add_string(&shstrtab, ".symtab"),
+      .sh_type = SHT_SYMTAB,
+      .sh_offset = symtab_offset,
+      .sh_size = symtab_size,
+      .sh_link = kSectionStrtab,
+      // Index of the first global symbol
+      .sh_info = 2,
+      .sh_addralign = 8,
+      .sh_entsize = sizeof *syms,
+  };
+  sections[kSectionStrtab] = (Elf64_Shdr){
+      .sh_name = Elf_add_string(&shstrtab, ".strtab"),
+      .sh_type = SHT_STRTAB,
+      .sh_offset = strtab_offset,
+      .sh_size = Buffer_len(&strtab),
+      .sh_addralign = 1,
+  };
+  word shstrtab_name = Elf_add_string(&shstrtab, ".shstrtab");
+  word shstrtab_offset = strtab_offset + Buffer_len(&strtab);
+  sections[kSectionShstrtab] = (Elf64_Shdr){
+      .sh_name = shstrtab_name,
+      .sh_type = SHT_STRTAB,
+      .sh_offset = shstrtab_offset,
+      .sh_size = Buffer_len(&shstrtab),
+      .sh_addralign = 1,
+  };
+  word section_headers_offset =
+      Elf_align(shstrtab_offset + Buffer_len(&shstrtab), 8);
+
+  Elf64_Ehdr header = {
+      .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB,
+                  EV_CURRENT, ELFOSABI_SYSV},
+      .e_type = ET_REL,
+      .e_machine = EM_X86_64,
+      .e_version = EV_CURRENT,
+      .e_shoff = section_headers_offset,
+      .e_ehsize = sizeof(Elf64_Ehdr),
+      .e_shentsize = sizeof(Elf64_Shdr),
+      .e_shnum = kNumSections,
+      .e_shstrndx = kSectionShstrtab,
+  };
+  word pos = 0;
+  bool ok =
+      Elf_write_at(fp, &pos, 0, &header, sizeof header) &&
+      Elf_write_at(fp, &pos, text_offset, code->address, Buffer_len(code)) &&
+      Elf_write_at(fp, &pos, symtab_offset, syms, symtab_size) &&
+      Elf_write_at(fp, &pos, strtab_offset, strtab.address,
+                   Buffer_len(&strtab)) &&
+      Elf_write_at(fp, &pos, shstrtab_offset, shstrtab.address,
+                   Buffer_len(&shstrtab)) &&
+      Elf_write_at(fp, &pos, section_headers_offset, sections,
+                   sizeof sections);
+  free(syms);
+  Buffer_deinit(&strtab);
+  Buffer_deinit(&shstrtab);
+  return ok ? 0 : -1;
+}
+
+// Compile node and write it to fp as an object file. The entry point is
+// exported as entry_name and has the JitFunction signature. Each labels
+// function is exported as entry_name.label so that it shows up in
+// disassemblers and profilers, but it uses the generated code's internal
+// calling convention and cannot be called from C. Returns 0 on success.
+int Elf_compile_object(FILE *fp, ASTNode *node, const char *entry_name) {
+  Buffer buf;
+  Buffer_init(&buf, 1);
+  Env labels;
+  Env_init(&labels);
+  int result = Compile_entry_with_labels(&buf, node, &labels);
+  if (result == 0) {
+    word num_symbols = labels.num_bindings + 1;
+    ElfSymbol *symbols = calloc(num_symbols, sizeof *symbols);
+    assert(symbols != NULL);
+    symbols[0] = (ElfSymbol){
+        .name = entry_name, .offset = 0, .size = Buffer_len(&buf)};
+    for (word i = 0; i < labels.num_bindings; i++) {
+      Binding *binding = &labels.bindings[i];
+      const char *label = AST_symbol_cstr(binding->name);
+      char *name = malloc(strlen(entry_name) + strlen(label) + 2);
+      assert(name != NULL);
+      sprintf(name, "%s.%s", entry_name, label);
+      symbols[i + 1] = (ElfSymbol){
+          .name = name, .offset = binding->value, .size = 0};
+    }
+    result = Elf_write_object(fp, &buf, symbols, num_symbols);
+    for (word i = 1; i < num_symbols; i++) {
+      free((char *)symbols[i].name);
+    }
+    free(symbols);
+  }
+  Env_deinit(&labels);
+  Buffer_deinit(&buf);
+  return result;
+}
+
+// End ELF
 
 // Testing
 
-uword Testing_execute_entry(Buffer *buf, uword *heap) {
+// Each call starts with an empty nursery, so pairs returned by an earlier call
+// are only valid until the next one. heap may be NULL if the code does not
+// allocate.
+uword Testing_call_function(JitFunction function, Heap *heap) {
+  if (heap == NULL) {
+    return function(/*alloc_ptr=*/NULL, heap);
+  }
+  return function(heap->nursery, heap);
+}
+
+uword Testing_execute_function(JitFunction function, Heap *heap) {
+  word start = Stats_now_ns();
+  uword result = Testing_call_function(function, heap);
+  Stats_record(kPhaseExecute, start);
+  return result;
+}
+
+uword Testing_execute_entry(Buffer *buf, Heap *heap) {
   assert(buf != NULL);
   assert(buf->address != NULL);
-  assert(buf->state == kExecutable);
+  assert(Buffer_is_executable(buf));
   // The pointer-pointer cast is allowed but the underlying
   // data-to-function-pointer back-and-forth is only guaranteed to work on
   // POSIX systems (because of eg dlsym).
-  JitFunction function = *(JitFunction *)(&buf->address);
-  return function(heap);
+  JitFunction function = *(JitFunction *)(&buf->exec_address);
+  return Testing_execute_function(function, heap);
 }
 
 uword Testing_execute_expr(Buffer *buf) {
@@ -1298,43 +4858,117 @@ TEST Testing_expect_entry_has_contents(Buffer *buf, byte *arr,
 #define EXPECT_ENTRY_CONTAINS_CODE(buf, arr)                                   \
   CHECK_CALL(Testing_expect_entry_has_contents(buf, arr, sizeof arr))
 
-#define RUN_BUFFER_TEST(test_name)                                             \
-  do {                                                                         \
-    Buffer buf;                                                                \
-    Buffer_init(&buf, 1);                                                      \
-    GREATEST_RUN_TEST1(test_name, &buf);                                       \
-    Buffer_deinit(&buf);                                                       \
-  } while (0)
+#define RUN_BUFFER_TEST(test_name)                                             \
+  do {                                                                         \
+    Buffer buf;                                                                \
+    Buffer_init(&buf, 1);                                                      \
+    GREATEST_RUN_TEST1(test_name, &buf);                                       \
+    Buffer_deinit(&buf);                                                       \
+  } while (0)
+
+#define RUN_HEAP_TEST(test_name)                                               \
+  do {                                                                         \
+    Buffer buf;                                                                \
+    Buffer_init(&buf, 1);                                                      \
+    Heap heap;                                                                 \
+    Heap_init(&heap, kNurserySize, kOldSize);                                  \
+    GREATEST_RUN_TESTp(test_name, &buf, &heap);                                \
+    Heap_deinit(&heap);                                                        \
+    Buffer_deinit(&buf);                                                       \
+  } while (0)
+
+ASTNode *new_unary_call(const char *name, ASTNode *arg) {
+  return list2(AST_new_symbol(name), arg);
+}
+
+ASTNode *new_binary_call(const char *name, ASTNode *arg0, ASTNode *arg1) {
+  return list3(AST_new_symbol(name), arg0, arg1);
+}
+
+// End Testing
+
+// Bench
+
+// Benchmarks in the style of greatest's tests. A BENCH function does one
+// operation on its argument. Bench_run calls it enough times in a row that
+// each timed sample is well above the clock's resolution and overhead, warms
+// up, then takes kBenchSamples samples and reports their spread in
+// nanoseconds per operation.
+
+#define BENCH static void
 
-#define RUN_HEAP_TEST(test_name)                                               \
-  do {                                                                         \
-    Buffer buf;                                                                \
-    Buffer_init(&buf, 1);                                                      \
-    uword *heap = malloc(1000 * kWordSize);                                    \
-    GREATEST_RUN_TESTp(test_name, &buf, heap);                                 \
-    free(heap);                                                                \
-    Buffer_deinit(&buf);                                                       \
-  } while (0)
+typedef void (*BenchFunction)(void *arg);
 
-ASTNode *list1(ASTNode *item0) { return AST_new_pair(item0, AST_nil()); }
+const word kBenchSamples = 200;
+const word kBenchWarmupSamples = 20;
+const word kBenchMinSampleNs = 20 * 1000;
 
-ASTNode *list2(ASTNode *item0, ASTNode *item1) {
-  return AST_new_pair(item0, list1(item1));
+typedef struct {
+  // Operations per sample
+  word iterations;
+  double min_ns;
+  double median_ns;
+  double p99_ns;
+} BenchResult;
+
+int Bench_compare_samples(const void *left, const void *right) {
+  double l = *(const double *)left;
+  double r = *(const double *)right;
+  return (l > r) - (l < r);
+}
+
+// Sorts samples (ns per operation) in place.
+BenchResult Bench_summarize(double *samples, word num_samples,
+                            word iterations) {
+  assert(num_samples > 0);
+  qsort(samples, num_samples, sizeof *samples, Bench_compare_samples);
+  // Nearest rank: the smallest sample that at least 99% of them are at or
+  // below
+  word p99_rank = (num_samples * 99 + 99) / 100;
+  return (BenchResult){.iterations = iterations,
+                       .min_ns = samples[0],
+                       .median_ns = samples[num_samples / 2],
+                       .p99_ns = samples[p99_rank - 1]};
+}
+
+// Nanoseconds for iterations back-to-back calls of function.
+word Bench_time(BenchFunction function, void *arg, word iterations) {
+  word start = Stats_now_ns();
+  for (word i = 0; i < iterations; i++) {
+    function(arg);
+  }
+  return Stats_now_ns() - start;
 }
 
-ASTNode *list3(ASTNode *item0, ASTNode *item1, ASTNode *item2) {
-  return AST_new_pair(item0, list2(item1, item2));
+BenchResult Bench_run(BenchFunction function, void *arg) {
+  word iterations = 1;
+  while (Bench_time(function, arg, iterations) < kBenchMinSampleNs) {
+    iterations *= 2;
+  }
+  for (word i = 0; i < kBenchWarmupSamples; i++) {
+    (void)Bench_time(function, arg, iterations);
+  }
+  double samples[kBenchSamples];
+  for (word i = 0; i < kBenchSamples; i++) {
+    samples[i] = (double)Bench_time(function, arg, iterations) / iterations;
+  }
+  return Bench_summarize(samples, kBenchSamples, iterations);
 }
 
-ASTNode *new_unary_call(const char *name, ASTNode *arg) {
-  return list2(AST_new_symbol(name), arg);
+void Bench_print_header(FILE *fp) {
+  fprintf(fp, "%-28s %10s %10s %10s %10s\n", "benchmark", "iterations",
+          "min ns", "median ns", "p99 ns");
 }
 
-ASTNode *new_binary_call(const char *name, ASTNode *arg0, ASTNode *arg1) {
-  return list3(AST_new_symbol(name), arg0, arg1);
+void Bench_report(const char *name, BenchFunction function, void *arg) {
+  BenchResult result = Bench_run(function, arg);
+  fprintf(stdout, "%-28s %10ld %10.1f %10.1f %10.1f\n", name,
+          result.iterations, result.min_ns, result.median_ns, result.p99_ns);
 }
 
-// End Testing
+#define RUN_BENCH(function, arg) Bench_report(#function, function, arg)
+
+// End Bench
 
 // Tests
 
@@ -1417,6 +5051,37 @@ TEST ast_new_symbol(void) {
   PASS();
 }
 
+TEST ast_new_symbol_interns(void) {
+  char name[] = "interned";
+  ASTNode *node = AST_new_symbol(name);
+  // A different string with the same contents
+  ASSERT_EQ(AST_new_symbol("interned"), node);
+  ASSERT_EQ(AST_symbol_cstr(AST_new_symbol("interned")),
+            AST_symbol_cstr(node));
+  ASSERT(AST_new_symbol("interned2") != node);
+  PASS();
+}
+
+TEST ast_new_symbol_assigns_primitive(void) {
+  ASSERT_EQ(AST_symbol_primitive(AST_new_symbol("add1")), kPrimitiveAdd1);
+  ASSERT_EQ(AST_symbol_primitive(AST_new_symbol("labelcall")),
+            kPrimitiveLabelcall);
+  ASSERT_EQ(AST_symbol_primitive(AST_new_symbol("add2")), kNotPrimitive);
+  PASS();
+}
+
+TEST ast_symbol_table_grows(void) {
+  char name[16];
+  ASTNode *first = AST_new_symbol("sym0");
+  for (word i = 0; i < 1000; i++) {
+    snprintf(name, sizeof name, "sym%ld", i);
+    ASSERT(AST_is_symbol(AST_new_symbol(name)));
+  }
+  ASSERT_EQ(AST_new_symbol("sym0"), first);
+  ASSERT(symbol_table.capacity >= 2 * symbol_table.num_symbols);
+  PASS();
+}
+
 #define ASSERT_IS_CHAR_EQ(node, c)                                             \
   do {                                                                         \
     ASTNode *__tmp = node;                                                     \
@@ -1553,6 +5218,104 @@ TEST read_with_nested_list_returns_list(void) {
   PASS();
 }
 
+TEST read_with_unterminated_list_returns_error(void) {
+  ASSERT(AST_is_error(Reader_read("(1 (2 3)")));
+  ASSERT(AST_is_error(Reader_read("(1 #x)")));
+  PASS();
+}
+
+TEST span_matches_scalar_classification(void) {
+  // Runs of every class end at every offset within and across vectors
+  const char input[] = "  \t\n\r 0123456789 foo-bar? A<=Z*+ \x80\xff"
+                       "abcdefghijklmnopqrstuvwxyz 12345678901234567890\v\f"
+                       "                                 x";
+  word len = sizeof input - 1;
+  SpanClass classes[] = {kSpanWhitespace, kSpanDigits, kSpanSymbol};
+  for (word c = 0; c < 3; c++) {
+    for (word start = 0; start < len; start++) {
+      word expected = 0;
+      while (start + expected < len &&
+             span_contains(input[start + expected], classes[c])) {
+        expected++;
+      }
+      ASSERT_EQ_FMT(expected, span(input + start, len - start, classes[c]),
+                    "%ld");
+    }
+  }
+  PASS();
+}
+
+TEST read_symbol_longer_than_atom_max_is_truncated(void) {
+  Reader reader;
+  Reader_init_cstr(&reader, "abcdefghijklmnopqrstuvwxyzabcdefghij");
+  ASSERT_IS_SYM_EQ(Reader_read_next(&reader),
+                   "abcdefghijklmnopqrstuvwxyzabcdef");
+  ASSERT_IS_SYM_EQ(Reader_read_next(&reader), "ghij");
+  ASSERT(Reader_at_end(&reader));
+  Reader_deinit(&reader);
+  PASS();
+}
+
+TEST reader_reads_forms_in_sequence(void) {
+  Reader reader;
+  Reader_init_cstr(&reader, " 1 (a b)\n#t  ");
+  ASSERT_FALSE(Reader_at_end(&reader));
+  ASSERT_IS_INT_EQ(Reader_read_next(&reader), 1);
+  ASTNode *list = Reader_read_next(&reader);
+  ASSERT(AST_is_pair(list));
+  ASSERT_IS_SYM_EQ(AST_pair_car(list), "a");
+  AST_heap_free(list);
+  ASSERT_EQ(Reader_read_next(&reader), AST_new_bool(true));
+  ASSERT(Reader_at_end(&reader));
+  Reader_deinit(&reader);
+  PASS();
+}
+
+TEST reader_resumes_datum_across_chunks(void) {
+  const char *input = "(foo 123 (bar -45)) #f";
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  ASSERT_EQ(write(fds[1], input, strlen(input)), (ssize_t)strlen(input));
+  close(fds[1]);
+  Reader reader;
+  // Every token straddles a chunk boundary somewhere
+  Reader_init_fd(&reader, fds[0], /*chunk_size=*/2);
+  ASTNode *node = Reader_read_next(&reader);
+  ASSERT(AST_is_pair(node));
+  ASSERT_IS_SYM_EQ(AST_pair_car(node), "foo");
+  ASSERT_IS_INT_EQ(operand2(node), 123);
+  ASTNode *inner = operand3(node);
+  ASSERT_IS_SYM_EQ(AST_pair_car(inner), "bar");
+  ASSERT_IS_INT_EQ(operand2(inner), -45);
+  AST_heap_free(node);
+  ASSERT_EQ(Reader_read_next(&reader), AST_new_bool(false));
+  ASSERT(Reader_at_end(&reader));
+  Reader_deinit(&reader);
+  close(fds[0]);
+  PASS();
+}
+
+TEST reader_reads_mapped_file(void) {
+  char path[] = "/tmp/reader-test-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT(fd >= 0);
+  const char *input = "(+ 1 2)\n'x'\n";
+  ASSERT_EQ(write(fd, input, strlen(input)), (ssize_t)strlen(input));
+  close(fd);
+  Reader reader;
+  ASSERT_EQ(Reader_init_file(&reader, path), 0);
+  unlink(path);
+  ASTNode *node = Reader_read_next(&reader);
+  ASSERT(AST_is_pair(node));
+  ASSERT_IS_SYM_EQ(AST_pair_car(node), "+");
+  AST_heap_free(node);
+  ASSERT_IS_CHAR_EQ(Reader_read_next(&reader), 'x');
+  ASSERT(Reader_at_end(&reader));
+  Reader_deinit(&reader);
+  ASSERT_EQ(Reader_init_file(&reader, path), -1);
+  PASS();
+}
+
 TEST buffer_write8_increases_length(Buffer *buf) {
   ASSERT_EQ(Buffer_len(buf), 0);
   Buffer_write8(buf, 0xdb);
@@ -1561,15 +5324,32 @@ TEST buffer_write8_increases_length(Buffer *buf) {
   PASS();
 }
 
-TEST buffer_write8_expands_buffer(void) {
+TEST buffer_init_rounds_capacity_to_pages(void) {
+  word page_size = sysconf(_SC_PAGESIZE);
   Buffer buf;
   Buffer_init(&buf, 1);
-  ASSERT_EQ(buf.capacity, 1);
+  ASSERT_EQ(buf.capacity, page_size);
   ASSERT_EQ(buf.len, 0);
-  Buffer_write8(&buf, 0xdb);
-  Buffer_write8(&buf, 0xef);
-  ASSERT(buf.capacity > 1);
-  ASSERT_EQ(buf.len, 2);
+  Buffer_deinit(&buf);
+  Buffer_init(&buf, page_size + 1);
+  ASSERT_EQ(buf.capacity, 2 * page_size);
+  Buffer_deinit(&buf);
+  PASS();
+}
+
+TEST buffer_write8_expands_buffer(void) {
+  Buffer buf;
+  Buffer_init(&buf, 1);
+  word capacity = buf.capacity;
+  for (word i = 0; i <= capacity; i++) {
+    Buffer_write8(&buf, i & 0xff);
+  }
+  ASSERT(buf.capacity > capacity);
+  ASSERT_EQ(buf.len, capacity + 1);
+  // Growing keeps what was already written
+  for (word i = 0; i <= capacity; i++) {
+    ASSERT_EQ(Buffer_at8(&buf, i), i & 0xff);
+  }
   Buffer_deinit(&buf);
   PASS();
 }
@@ -1577,11 +5357,43 @@ TEST buffer_write8_expands_buffer(void) {
 TEST buffer_write32_expands_buffer(void) {
   Buffer buf;
   Buffer_init(&buf, 1);
-  ASSERT_EQ(buf.capacity, 1);
-  ASSERT_EQ(buf.len, 0);
+  word capacity = buf.capacity;
+  buf.len = capacity - 2;
+  Buffer_write32(&buf, 0xdeadbeef);
+  ASSERT(buf.capacity > capacity);
+  ASSERT_EQ(buf.len, capacity + 2);
+  ASSERT_EQ(Buffer_at8(&buf, capacity + 1), 0xde);
+  Buffer_deinit(&buf);
+  PASS();
+}
+
+TEST buffer_init_reserved_does_not_grow(void) {
+  Buffer buf;
+  Buffer_init_reserved(&buf, 1024 * 1024);
+  byte *address = buf.address;
+  for (word i = 0; i < 100000; i++) {
+    Buffer_write8(&buf, 0xc3);
+  }
+  ASSERT_EQ(buf.address, address);
+  ASSERT_EQ(buf.capacity, 1024 * 1024);
+  Buffer_deinit(&buf);
+  PASS();
+}
+
+TEST buffer_init_dual_writes_through_to_exec_view(void) {
+  Buffer buf;
+  if (Buffer_init_dual(&buf, 1) < 0) {
+    SKIPm("memfd_create not available");
+  }
+  ASSERT_EQ(buf.state, kDualMapped);
+  ASSERT(buf.exec_address != buf.address);
+  ASSERT(Buffer_is_executable(&buf));
   Buffer_write32(&buf, 0xdeadbeef);
-  ASSERT(buf.capacity > 1);
-  ASSERT_EQ(buf.len, 4);
+  ASSERT_MEM_EQ(buf.address, buf.exec_address, 4);
+  ASSERT_EQ(Buffer_make_executable(&buf), 0);
+  // Still writable
+  Buffer_at_put8(&buf, 0, 0xab);
+  ASSERT_EQ(buf.exec_address[0], 0xab);
   Buffer_deinit(&buf);
   PASS();
 }
@@ -1595,6 +5407,50 @@ TEST buffer_write32_writes_little_endian(Buffer *buf) {
   PASS();
 }
 
+TEST emit_with_extended_registers(Buffer *buf) {
+  Emit_mov_reg_reg(buf, /*dst=*/kR8, /*src=*/kRax);
+  Emit_add_reg_reg(buf, /*dst=*/kRax, /*src=*/kR10);
+  Emit_imul_reg_reg(buf, /*dst=*/kRax, /*src=*/kR9);
+  Emit_store_reg_indirect(buf, /*dst=*/Ind(kR12, 8), /*src=*/kR11);
+  Emit_load_reg_indirect(buf, /*dst=*/kR11, /*src=*/Ind(kRsp, -8));
+  byte expected[] = {
+      // mov r8, rax
+      0x49, 0x89, 0xc0,
+      // add rax, r10
+      0x4c, 0x01, 0xd0,
+      // imul rax, r9
+      0x49, 0x0f, 0xaf, 0xc1,
+      // mov [r12+8], r11
+      0x4d, 0x89, 0x5c, 0x24, 0x08,
+      // mov r11, [rsp-8]
+      0x4c, 0x8b, 0x5c, 0x24, 0xf8,
+  };
+  EXPECT_EQUALS_BYTES(buf, expected);
+  PASS();
+}
+
+TEST emit_byte_register_checks(Buffer *buf) {
+  Emit_test_reg8_imm8(buf, kRax, 3);
+  Emit_test_reg8_imm8(buf, kRcx, 3);
+  Emit_test_reg8_imm8(buf, kR9, 3);
+  Emit_cmp_reg8_imm8(buf, kRax, 0xf);
+  Emit_cmp_reg8_imm8(buf, kR10, 0xf);
+  byte expected[] = {
+      // test al, 0x3
+      0xa8, 0x03,
+      // test cl, 0x3
+      0xf6, 0xc1, 0x03,
+      // test r9b, 0x3
+      0x41, 0xf6, 0xc1, 0x03,
+      // cmp al, 0xf
+      0x3c, 0x0f,
+      // cmp r10b, 0xf
+      0x41, 0x80, 0xfa, 0x0f,
+  };
+  EXPECT_EQUALS_BYTES(buf, expected);
+  PASS();
+}
+
 TEST compile_positive_integer(Buffer *buf) {
   word value = 123;
   ASTNode *node = AST_new_integer(value);
@@ -1983,12 +5839,12 @@ TEST compile_binary_plus(Buffer *buf) {
   byte expected[] = {
       // 0:  48 c7 c0 20 00 00 00    mov    rax,0x20
       0x48, 0xc7, 0xc0, 0x20, 0x00, 0x00, 0x00,
-      // 7:  48 89 45 f8             mov    QWORD PTR [rsp-0x8],rax
-      0x48, 0x89, 0x44, 0x24, 0xf8,
-      // b:  48 c7 c0 14 00 00 00    mov    rax,0x14
+      // 7:  48 89 c1                mov    rcx,rax
+      0x48, 0x89, 0xc1,
+      // a:  48 c7 c0 14 00 00 00    mov    rax,0x14
       0x48, 0xc7, 0xc0, 0x14, 0x00, 0x00, 0x00,
-      // 12: 48 03 45 f8             add    rax,QWORD PTR [rsp-0x8]
-      0x48, 0x03, 0x44, 0x24, 0xf8};
+      // 11: 48 01 c8                add    rax,rcx
+      0x48, 0x01, 0xc8};
   EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
   Buffer_make_executable(buf);
   uword result = Testing_execute_expr(buf);
@@ -2004,26 +5860,26 @@ TEST compile_binary_plus_nested(Buffer *buf) {
   int compile_result = Compile_entry(buf, node);
   ASSERT_EQ(compile_result, 0);
   byte expected[] = {
-      // 4:  48 c7 c0 10 00 00 00    mov    rax,0x10
+      // 0:  48 c7 c0 10 00 00 00    mov    rax,0x10
       0x48, 0xc7, 0xc0, 0x10, 0x00, 0x00, 0x00,
-      // b:  48 89 45 f8             mov    QWORD PTR [rsp-0x8],rax
-      0x48, 0x89, 0x44, 0x24, 0xf8,
-      // f:  48 c7 c0 0c 00 00 00    mov    rax,0xc
+      // 7:  48 89 c1                mov    rcx,rax
+      0x48, 0x89, 0xc1,
+      // a:  48 c7 c0 0c 00 00 00    mov    rax,0xc
       0x48, 0xc7, 0xc0, 0x0c, 0x00, 0x00, 0x00,
-      // 16: 48 03 45 f8             add    rax,QWORD PTR [rsp-0x8]
-      0x48, 0x03, 0x44, 0x24, 0xf8,
-      // 1a: 48 89 45 f8             mov    QWORD PTR [rsp-0x8],rax
-      0x48, 0x89, 0x44, 0x24, 0xf8,
-      // 1e: 48 c7 c0 08 00 00 00    mov    rax,0x8
+      // 11: 48 01 c8                add    rax,rcx
+      0x48, 0x01, 0xc8,
+      // 14: 48 89 c1                mov    rcx,rax
+      0x48, 0x89, 0xc1,
+      // 17: 48 c7 c0 08 00 00 00    mov    rax,0x8
       0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00,
-      // 25: 48 89 45 f0             mov    QWORD PTR [rsp-0x10],rax
-      0x48, 0x89, 0x44, 0x24, 0xf0,
-      // 29: 48 c7 c0 04 00 00 00    mov    rax,0x4
+      // 1e: 48 89 c2                mov    rdx,rax
+      0x48, 0x89, 0xc2,
+      // 21: 48 c7 c0 04 00 00 00    mov    rax,0x4
       0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00,
-      // 30: 48 03 45 f0             add    rax,QWORD PTR [rsp-0x10]
-      0x48, 0x03, 0x44, 0x24, 0xf0,
-      // 34: 48 03 45 f8             add    rax,QWORD PTR [rsp-0x8]
-      0x48, 0x03, 0x44, 0x24, 0xf8};
+      // 28: 48 01 d0                add    rax,rdx
+      0x48, 0x01, 0xd0,
+      // 2b: 48 01 c8                add    rax,rcx
+      0x48, 0x01, 0xc8};
   EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
   Buffer_make_executable(buf);
   uword result = Testing_execute_expr(buf);
@@ -2032,6 +5888,19 @@ TEST compile_binary_plus_nested(Buffer *buf) {
   PASS();
 }
 
+TEST compile_binary_plus_spills_when_out_of_registers(Buffer *buf) {
+  // Each level holds its right operand while computing its left operand, so
+  // this needs one more temporary than there are registers.
+  ASTNode *node = Reader_read("(+ (+ (+ (+ (+ (+ 1 2) 3) 4) 5) 6) 7)");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_expr(buf);
+  ASSERT_EQ_FMT(Object_encode_integer(28), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
 TEST compile_binary_minus(Buffer *buf) {
   ASTNode *node = new_binary_call("-", AST_new_integer(5), AST_new_integer(8));
   int compile_result = Compile_entry(buf, node);
@@ -2039,12 +5908,12 @@ TEST compile_binary_minus(Buffer *buf) {
   byte expected[] = {
       // 0:  48 c7 c0 20 00 00 00    mov    rax,0x20
       0x48, 0xc7, 0xc0, 0x20, 0x00, 0x00, 0x00,
-      // 7:  48 89 45 f8             mov    QWORD PTR [rsp-0x8],rax
-      0x48, 0x89, 0x44, 0x24, 0xf8,
-      // b:  48 c7 c0 14 00 00 00    mov    rax,0x14
+      // 7:  48 89 c1                mov    rcx,rax
+      0x48, 0x89, 0xc1,
+      // a:  48 c7 c0 14 00 00 00    mov    rax,0x14
       0x48, 0xc7, 0xc0, 0x14, 0x00, 0x00, 0x00,
-      // 12: 48 2b 45 f8             add    rax,QWORD PTR [rsp-0x8]
-      0x48, 0x2b, 0x44, 0x24, 0xf8};
+      // 11: 48 29 c8                sub    rax,rcx
+      0x48, 0x29, 0xc8};
   EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
   Buffer_make_executable(buf);
   uword result = Testing_execute_expr(buf);
@@ -2060,26 +5929,26 @@ TEST compile_binary_minus_nested(Buffer *buf) {
   int compile_result = Compile_entry(buf, node);
   ASSERT_EQ(compile_result, 0);
   byte expected[] = {
-      // 4:  48 c7 c0 0c 00 00 00    mov    rax,0xc
+      // 0:  48 c7 c0 0c 00 00 00    mov    rax,0xc
       0x48, 0xc7, 0xc0, 0x0c, 0x00, 0x00, 0x00,
-      // b:  48 89 45 f8             mov    QWORD PTR [rsp-0x8],rax
-      0x48, 0x89, 0x44, 0x24, 0xf8,
-      // f:  48 c7 c0 10 00 00 00    mov    rax,0x10
+      // 7:  48 89 c1                mov    rcx,rax
+      0x48, 0x89, 0xc1,
+      // a:  48 c7 c0 10 00 00 00    mov    rax,0x10
       0x48, 0xc7, 0xc0, 0x10, 0x00, 0x00, 0x00,
-      // 16: 48 2b 45 f8             add    rax,QWORD PTR [rsp-0x8]
-      0x48, 0x2b, 0x44, 0x24, 0xf8,
-      // 1a: 48 89 45 f8             mov    QWORD PTR [rsp-0x8],rax
-      0x48, 0x89, 0x44, 0x24, 0xf8,
-      // 1e: 48 c7 c0 04 00 00 00    mov    rax,0x4
+      // 11: 48 29 c8                sub    rax,rcx
+      0x48, 0x29, 0xc8,
+      // 14: 48 89 c1                mov    rcx,rax
+      0x48, 0x89, 0xc1,
+      // 17: 48 c7 c0 04 00 00 00    mov    rax,0x4
       0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00,
-      // 25: 48 89 45 f0             mov    QWORD PTR [rsp-0x10],rax
-      0x48, 0x89, 0x44, 0x24, 0xf0,
-      // 29: 48 c7 c0 14 00 00 00    mov    rax,0x14
+      // 1e: 48 89 c2                mov    rdx,rax
+      0x48, 0x89, 0xc2,
+      // 21: 48 c7 c0 14 00 00 00    mov    rax,0x14
       0x48, 0xc7, 0xc0, 0x14, 0x00, 0x00, 0x00,
-      // 30: 48 2b 45 f0             add    rax,QWORD PTR [rsp-0x10]
-      0x48, 0x2b, 0x44, 0x24, 0xf0,
-      // 34: 48 2b 45 f8             add    rax,QWORD PTR [rsp-0x8]
-      0x48, 0x2b, 0x44, 0x24, 0xf8};
+      // 28: 48 29 d0                sub    rax,rdx
+      0x48, 0x29, 0xd0,
+      // 2b: 48 29 c8                sub    rax,rcx
+      0x48, 0x29, 0xc8};
   EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
   Buffer_make_executable(buf);
   uword result = Testing_execute_expr(buf);
@@ -2169,10 +6038,15 @@ TEST compile_binary_lt_with_left_greater_than_right_returns_false(Buffer *buf) {
 
 TEST compile_symbol_in_env_returns_value(Buffer *buf) {
   ASTNode *node = AST_new_symbol("hello");
-  Env env0 = Env_bind("hello", 33, /*prev=*/NULL);
-  Env env1 = Env_bind("world", 66, &env0);
+  Env env;
+  Env_init(&env);
+  Env_bind(&env, node, 33);
+  Env_bind(&env, AST_new_symbol("world"), 66);
+  Env_show(&env, /*mark=*/0);
   int compile_result =
-      Compile_expr(buf, node, -kWordSize, &env1, /*labels=*/NULL);
+      Compile_expr(buf, node, -kWordSize, /*reg_index=*/0, &env,
+                   /*labels=*/NULL);
+  Env_deinit(&env);
   ASSERT_EQ(compile_result, 0);
   byte expected[] = {// mov rax, [rsp+33]
                      0x48, 0x8b, 0x44, 0x24, 33};
@@ -2183,10 +6057,17 @@ TEST compile_symbol_in_env_returns_value(Buffer *buf) {
 
 TEST compile_symbol_in_env_returns_first_value(Buffer *buf) {
   ASTNode *node = AST_new_symbol("hello");
-  Env env0 = Env_bind("hello", 55, /*prev=*/NULL);
-  Env env1 = Env_bind("hello", 66, &env0);
+  Env env;
+  Env_init(&env);
+  Env_bind(&env, node, 55);
+  Env_show(&env, /*mark=*/0);
+  word mark = Env_mark(&env);
+  Env_bind(&env, node, 66);
+  Env_show(&env, mark);
   int compile_result =
-      Compile_expr(buf, node, -kWordSize, &env1, /*labels=*/NULL);
+      Compile_expr(buf, node, -kWordSize, /*reg_index=*/0, &env,
+                   /*labels=*/NULL);
+  Env_deinit(&env);
   ASSERT_EQ(compile_result, 0);
   byte expected[] = {// mov rax, [rsp+66]
                      0x48, 0x8b, 0x44, 0x24, 66};
@@ -2195,10 +6076,59 @@ TEST compile_symbol_in_env_returns_first_value(Buffer *buf) {
   PASS();
 }
 
+TEST env_bindings_are_hidden_until_shown(void) {
+  ASTNode *a = AST_new_symbol("a");
+  Env env;
+  Env_init(&env);
+  Env_bind(&env, a, 1);
+  Env_show(&env, /*mark=*/0);
+  word mark = Env_mark(&env);
+  Env_bind(&env, a, 2);
+  word value;
+  ASSERT(Env_find(&env, a, &value));
+  ASSERT_EQ(value, 1);
+  Env_show(&env, mark);
+  ASSERT(Env_find(&env, a, &value));
+  ASSERT_EQ(value, 2);
+  Env_pop(&env, mark);
+  ASSERT(Env_find(&env, a, &value));
+  ASSERT_EQ(value, 1);
+  Env_pop(&env, /*mark=*/0);
+  ASSERT_FALSE(Env_find(&env, a, &value));
+  Env_deinit(&env);
+  PASS();
+}
+
+TEST env_finds_every_binding_after_growing(void) {
+  ASTNode *names[100];
+  Env env;
+  Env_init(&env);
+  for (word i = 0; i < 100; i++) {
+    char name[16];
+    snprintf(name, sizeof name, "env-name-%ld", i);
+    names[i] = AST_new_symbol(name);
+    Env_bind(&env, names[i], i);
+  }
+  Env_show(&env, /*mark=*/0);
+  for (word i = 0; i < 100; i++) {
+    word value;
+    ASSERT(Env_find(&env, names[i], &value));
+    ASSERT_EQ(value, i);
+  }
+  Env_pop(&env, /*mark=*/0);
+  for (word i = 0; i < 100; i++) {
+    word value;
+    ASSERT_FALSE(Env_find(&env, names[i], &value));
+  }
+  Env_deinit(&env);
+  PASS();
+}
+
 TEST compile_symbol_not_in_env_raises_compile_error(Buffer *buf) {
   ASTNode *node = AST_new_symbol("hello");
   int compile_result =
-      Compile_expr(buf, node, -kWordSize, /*varenv=*/NULL, /*labels=*/NULL);
+      Compile_expr(buf, node, -kWordSize, /*reg_index=*/0, /*varenv=*/NULL,
+                   /*labels=*/NULL);
   ASSERT_EQ(compile_result, -1);
   AST_heap_free(node);
   PASS();
@@ -2248,6 +6178,38 @@ TEST compile_nested_let(Buffer *buf) {
   PASS();
 }
 
+TEST compile_let_keeps_binding_in_register(Buffer *buf) {
+  ASTNode *node = Reader_read("(let ((a 1)) a)");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  byte expected[] = {
+      // mov rax, compile(1)
+      0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00,
+      // mov rcx, rax
+      0x48, 0x89, 0xc1,
+      // No mov rax, rcx: a is still in rax too
+  };
+  EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_expr(buf);
+  ASSERT_EQ_FMT(Object_encode_integer(1), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST compile_let_with_more_bindings_than_registers(Buffer *buf) {
+  ASTNode *node =
+      Reader_read("(let ((a 1) (b 2) (c 3) (d 4) (e 5) (f 6) (g 7)) "
+                  "(+ a (+ b (+ c (+ d (+ e (+ f g)))))))");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_expr(buf);
+  ASSERT_EQ_FMT(Object_encode_integer(28), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
 TEST compile_let_is_not_let_star(Buffer *buf) {
   ASTNode *node = Reader_read("(let ((a 1) (b a)) a)");
   int compile_result = Compile_entry(buf, node);
@@ -2256,6 +6218,48 @@ TEST compile_let_is_not_let_star(Buffer *buf) {
   PASS();
 }
 
+TEST compile_let_bindings_see_shadowed_outer_name(Buffer *buf) {
+  ASTNode *node = Reader_read("(let ((a 1)) (let ((a 10) (b a)) b))");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_expr(buf);
+  ASSERT_EQ_FMT(Object_encode_integer(1), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST compile_let_restores_outer_binding_after_body(Buffer *buf) {
+  ASTNode *node = Reader_read("(let ((a 1)) (+ (let ((a 2)) a) a))");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_expr(buf);
+  ASSERT_EQ_FMT(Object_encode_integer(3), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST stats_count_bytes_by_expression_kind(Buffer *buf) {
+  Stats_reset();
+  ASTNode *node = Reader_read("(let ((a 1)) (add1 (add1 a)))");
+  ASSERT_EQ(stats.ast_nodes, 10);
+  ASSERT_EQ(stats.phase_count[kPhaseRead], 1);
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  ASSERT_EQ(stats.phase_count[kPhaseCompile], 1);
+  // mov rax, compile(1)
+  ASSERT_EQ(compile_bytes[kCompileKindLiteral], 7);
+  // Nothing, since a is still in rax after mov rcx, rax
+  ASSERT_EQ(compile_bytes[kCompileKindVariable], 0);
+  // add rax, compile(1), twice
+  ASSERT_EQ(compile_bytes[kPrimitiveAdd1], 12);
+  // mov rcx, rax
+  ASSERT_EQ(compile_bytes[kPrimitiveLet], 3);
+  AST_heap_free(node);
+  PASS();
+}
+
 TEST compile_if_with_true_cond(Buffer *buf) {
   ASTNode *node = Reader_read("(if #t 1 2)");
   int compile_result = Compile_entry(buf, node);
@@ -2272,48 +6276,180 @@ TEST compile_if_with_true_cond(Buffer *buf) {
       // jmp end
       0xe9, 0x07, 0x00, 0x00, 0x00,
       // alternate:
-      // mov rax, compile(2)
-      0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00
+      // mov rax, compile(2)
+      0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00
+      // end:
+  };
+  EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_expr(buf);
+  ASSERT_EQ_FMT(Object_encode_integer(1), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST compile_if_with_false_cond(Buffer *buf) {
+  ASTNode *node = Reader_read("(if #f 1 2)");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  byte expected[] = {
+      // mov rax, 0x1f
+      0x48, 0xc7, 0xc0, 0x1f, 0x00, 0x00, 0x00,
+      // cmp rax, 0x1f
+      0x48, 0x3d, 0x1f, 0x00, 0x00, 0x00,
+      // je alternate
+      0x0f, 0x84, 0x0c, 0x00, 0x00, 0x00,
+      // mov rax, compile(1)
+      0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00,
+      // jmp end
+      0xe9, 0x07, 0x00, 0x00, 0x00,
+      // alternate:
+      // mov rax, compile(2)
+      0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00
+      // end:
+  };
+  EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_expr(buf);
+  ASSERT_EQ_FMT(Object_encode_integer(2), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST compile_nested_if(Buffer *buf) {
+  ASTNode *node = Reader_read("(if (< 1 2) (if #f 3 4) 5)");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_expr(buf);
+  ASSERT_EQ_FMT(Object_encode_integer(4), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST compile_if_with_compare_branches_on_flags(Buffer *buf) {
+  ASTNode *node = Reader_read("(if (< 1 2) 3 4)");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  byte expected[] = {
+      // mov rax, compile(2)
+      0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00,
+      // mov rcx, rax
+      0x48, 0x89, 0xc1,
+      // mov rax, compile(1)
+      0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00,
+      // cmp rax, rcx
+      0x48, 0x39, 0xc8,
+      // jge alternate
+      0x0f, 0x8d, 0x0c, 0x00, 0x00, 0x00,
+      // mov rax, compile(3)
+      0x48, 0xc7, 0xc0, 0x0c, 0x00, 0x00, 0x00,
+      // jmp end
+      0xe9, 0x07, 0x00, 0x00, 0x00,
+      // alternate:
+      // mov rax, compile(4)
+      0x48, 0xc7, 0xc0, 0x10, 0x00, 0x00, 0x00,
+      // end:
+  };
+  EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_expr(buf);
+  ASSERT_EQ_FMT(Object_encode_integer(3), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST compile_if_with_not_inverts_the_branch(Buffer *buf) {
+  ASTNode *node = Reader_read("(if (not (< 1 2)) 3 4)");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  byte expected[] = {
+      // mov rax, compile(2)
+      0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00,
+      // mov rcx, rax
+      0x48, 0x89, 0xc1,
+      // mov rax, compile(1)
+      0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00,
+      // cmp rax, rcx
+      0x48, 0x39, 0xc8,
+      // jl alternate
+      0x0f, 0x8c, 0x0c, 0x00, 0x00, 0x00,
+      // mov rax, compile(3)
+      0x48, 0xc7, 0xc0, 0x0c, 0x00, 0x00, 0x00,
+      // jmp end
+      0xe9, 0x07, 0x00, 0x00, 0x00,
+      // alternate:
+      // mov rax, compile(4)
+      0x48, 0xc7, 0xc0, 0x10, 0x00, 0x00, 0x00,
       // end:
   };
   EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
   Buffer_make_executable(buf);
   uword result = Testing_execute_expr(buf);
-  ASSERT_EQ_FMT(Object_encode_integer(1), result, "0x%lx");
+  ASSERT_EQ_FMT(Object_encode_integer(4), result, "0x%lx");
   AST_heap_free(node);
   PASS();
 }
 
-TEST compile_if_with_false_cond(Buffer *buf) {
-  ASTNode *node = Reader_read("(if #f 1 2)");
+TEST compile_if_with_zero_p_compares_to_zero(Buffer *buf) {
+  ASTNode *node = Reader_read("(if (zero? 0) 3 4)");
   int compile_result = Compile_entry(buf, node);
   ASSERT_EQ(compile_result, 0);
   byte expected[] = {
-      // mov rax, 0x1f
-      0x48, 0xc7, 0xc0, 0x1f, 0x00, 0x00, 0x00,
-      // cmp rax, 0x1f
-      0x48, 0x3d, 0x1f, 0x00, 0x00, 0x00,
-      // je alternate
-      0x0f, 0x84, 0x0c, 0x00, 0x00, 0x00,
-      // mov rax, compile(1)
-      0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00,
+      // mov rax, compile(0)
+      0x48, 0xc7, 0xc0, 0x00, 0x00, 0x00, 0x00,
+      // cmp rax, compile(0)
+      0x48, 0x3d, 0x00, 0x00, 0x00, 0x00,
+      // jne alternate
+      0x0f, 0x85, 0x0c, 0x00, 0x00, 0x00,
+      // mov rax, compile(3)
+      0x48, 0xc7, 0xc0, 0x0c, 0x00, 0x00, 0x00,
       // jmp end
       0xe9, 0x07, 0x00, 0x00, 0x00,
       // alternate:
-      // mov rax, compile(2)
-      0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00
+      // mov rax, compile(4)
+      0x48, 0xc7, 0xc0, 0x10, 0x00, 0x00, 0x00,
       // end:
   };
   EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
   Buffer_make_executable(buf);
   uword result = Testing_execute_expr(buf);
-  ASSERT_EQ_FMT(Object_encode_integer(2), result, "0x%lx");
+  ASSERT_EQ_FMT(Object_encode_integer(3), result, "0x%lx");
   AST_heap_free(node);
   PASS();
 }
 
-TEST compile_nested_if(Buffer *buf) {
-  ASTNode *node = Reader_read("(if (< 1 2) (if #f 3 4) 5)");
+TEST compile_if_branches_on_predicates(void) {
+  const char *sources[] = {
+      "(if (= 2 2) 1 0)",
+      "(if (not (= 2 3)) 1 0)",
+      "(if (nil? ()) 1 0)",
+      "(if (not (nil? 5)) 1 0)",
+      "(if (not (not (< 2 3))) 1 0)",
+      "(if (not #f) 1 0)",
+      "(if (let ((a 1)) (< a 2)) 1 0)",
+      "(if (integer? 5) 1 0)",
+  };
+  for (word i = 0; i < (word)(sizeof sources / sizeof sources[0]); i++) {
+    Buffer buf;
+    Buffer_init(&buf, 1);
+    ASTNode *node = Reader_read((char *)sources[i]);
+    int compile_result = Compile_entry(&buf, node);
+    ASSERT_EQ(compile_result, 0);
+    Buffer_make_executable(&buf);
+    uword result = Testing_execute_expr(&buf);
+    ASSERT_EQ_FMTm(sources[i], Object_encode_integer(1), result, "0x%lx");
+    Buffer_deinit(&buf);
+    AST_heap_free(node);
+  }
+  PASS();
+}
+
+TEST compile_if_does_not_fuse_compare_that_is_jumped_past(Buffer *buf) {
+  // The inner if's consequent jumps to just after the compare in its
+  // alternate, with #f in rax and no flags set, so the outer if has to test
+  // the boolean.
+  ASTNode *node = Reader_read("(if (if #t #f (< 1 2)) 3 4)");
   int compile_result = Compile_entry(buf, node);
   ASSERT_EQ(compile_result, 0);
   Buffer_make_executable(buf);
@@ -2323,29 +6459,110 @@ TEST compile_nested_if(Buffer *buf) {
   PASS();
 }
 
-TEST compile_cons(Buffer *buf, uword *heap) {
+TEST peephole_replaces_load_of_just_stored_slot(Buffer *buf) {
+  Emit_store_reg_indirect(buf, Ind(kRsp, -16), kR9);
+  Peephole_load_reg_stack(buf, kRcx, -16);
+  byte expected[] = {
+      // mov [rsp-0x10], r9
+      0x4c, 0x89, 0x4c, 0x24, 0xf0,
+      // mov rcx, r9
+      0x4c, 0x89, 0xc9,
+  };
+  EXPECT_EQUALS_BYTES(buf, expected);
+  PASS();
+}
+
+TEST peephole_keeps_load_after_jump_target(Buffer *buf) {
+  Emit_store_reg_indirect(buf, Ind(kRsp, -16), kR9);
+  Buffer_mark_jump_target(buf);
+  Peephole_load_reg_stack(buf, kRcx, -16);
+  Peephole_load_reg_stack(buf, kRdx, -8);
+  byte expected[] = {
+      // mov [rsp-0x10], r9
+      0x4c, 0x89, 0x4c, 0x24, 0xf0,
+      // mov rcx, [rsp-0x10]
+      0x48, 0x8b, 0x4c, 0x24, 0xf0,
+      // mov rdx, [rsp-0x8]
+      0x48, 0x8b, 0x54, 0x24, 0xf8,
+  };
+  EXPECT_EQUALS_BYTES(buf, expected);
+  PASS();
+}
+
+TEST compile_cons(Buffer *buf, Heap *heap) {
   ASTNode *node = Reader_read("(cons 1 2)");
   int compile_result = Compile_entry(buf, node);
   ASSERT_EQ(compile_result, 0);
   // clang-format off
   byte expected[] = {
-      // mov rax, 0x2
+      // xchg rsi, rdi
+      0x48, 0x87, 0xfe,
+      // test rdi, rdi
+      0x48, 0x85, 0xff,
+      // je past the store
+      0x74, 0x04,
+      // mov [rdi+0x10], rsp
+      0x48, 0x89, 0x67, 0x10,
+      // mov rax, 0x8
+      0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00,
+      // mov rcx, rax
+      0x48, 0x89, 0xc1,
+      // mov rax, 0x4
       0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00,
-      // mov [rsi], rax
+      // cmp rsi, [rdi+0x0]
+      0x48, 0x3b, 0x77, 0x00,
+      // ja slow_path
+      0x0f, 0x87, 0x14, 0x00, 0x00, 0x00,
+      // mov [rsi+0x0], rax
       0x48, 0x89, 0x46, 0x00,
-      // mov rax, 0x4
-      0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00,
-      // mov [rsi+kWordSize], rax
-      0x48, 0x89, 0x46, 0x08,
-      // mov rax, rsi
-      0x48, 0x89, 0xf0,
-      // or rax, kPairTag
-      0x48, 0x83, 0xc8, 0x01,
-      // add rsi, 2*kWordSize
+      // mov [rsi+0x8], rcx
+      0x48, 0x89, 0x4e, 0x08,
+      // lea rax, [rsi+0x1]
+      0x48, 0x8d, 0x46, 0x01,
+      // add rsi, 0x10
       0x48, 0x81, 0xc6, 0x10, 0x00, 0x00, 0x00,
+      // ret
+      0xc3,
+      // slow_path:
+      // mov [rsp-0x10], rax
+      0x48, 0x89, 0x44, 0x24, 0xf0,
+      // mov [rsp-0x18], r11
+      0x4c, 0x89, 0x5c, 0x24, 0xe8,
+      // mov [rsp-0x20], rcx
+      0x48, 0x89, 0x4c, 0x24, 0xe0,
+      // mov [rsp-0x28], rdi
+      0x48, 0x89, 0x7c, 0x24, 0xd8,
+      // lea rdx, [rsp-0x28]
+      0x48, 0x8d, 0x54, 0x24, 0xd8,
+      // mov rax, rsp
+      0x48, 0x89, 0xe0,
+      // sub rsp, 0x28
+      0x48, 0x81, 0xec, 0x28, 0x00, 0x00, 0x00,
+      // and rsp, -16
+      0x48, 0x83, 0xe4, 0xf0,
+      // push rax
+      0x50,
+      // push rax
+      0x50,
+      // call [rdi+0x8]
+      0xff, 0x57, 0x08,
+      // mov rsp, [rsp+0x0]
+      0x48, 0x8b, 0x64, 0x24, 0x00,
+      // mov rsi, rax
+      0x48, 0x89, 0xc6,
+      // mov rdi, [rsp-0x28]
+      0x48, 0x8b, 0x7c, 0x24, 0xd8,
+      // mov rcx, [rsp-0x20]
+      0x48, 0x8b, 0x4c, 0x24, 0xe0,
+      // mov r11, [rsp-0x18]
+      0x4c, 0x8b, 0x5c, 0x24, 0xe8,
+      // mov rax, [rsp-0x10]
+      0x48, 0x8b, 0x44, 0x24, 0xf0,
+      // jmp back to the fast path
+      0xe9, 0x9f, 0xff, 0xff, 0xff,
   };
   // clang-format on
-  EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
+  EXPECT_EQUALS_BYTES(buf, expected);
   Buffer_make_executable(buf);
   uword result = Testing_execute_entry(buf, heap);
   ASSERT(Object_is_pair(result));
@@ -2355,7 +6572,7 @@ TEST compile_cons(Buffer *buf, uword *heap) {
   PASS();
 }
 
-TEST compile_two_cons(Buffer *buf, uword *heap) {
+TEST compile_two_cons(Buffer *buf, Heap *heap) {
   ASTNode *node = Reader_read(
       "(let ((a (cons 1 2)) (b (cons 3 4))) (cons (cdr a) (cdr b)))");
   int compile_result = Compile_entry(buf, node);
@@ -2369,31 +6586,82 @@ TEST compile_two_cons(Buffer *buf, uword *heap) {
   PASS();
 }
 
-TEST compile_car(Buffer *buf, uword *heap) {
+TEST compile_car(Buffer *buf, Heap *heap) {
   ASTNode *node = Reader_read("(car (cons 1 2))");
   int compile_result = Compile_entry(buf, node);
   ASSERT_EQ(compile_result, 0);
   // clang-format off
   byte expected[] = {
-      // mov rax, 0x2
+      // xchg rsi, rdi
+      0x48, 0x87, 0xfe,
+      // test rdi, rdi
+      0x48, 0x85, 0xff,
+      // je past the store
+      0x74, 0x04,
+      // mov [rdi+0x10], rsp
+      0x48, 0x89, 0x67, 0x10,
+      // mov rax, 0x8
+      0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00,
+      // mov rcx, rax
+      0x48, 0x89, 0xc1,
+      // mov rax, 0x4
       0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00,
-      // mov [rsi], rax
+      // cmp rsi, [rdi+0x0]
+      0x48, 0x3b, 0x77, 0x00,
+      // ja slow_path
+      0x0f, 0x87, 0x18, 0x00, 0x00, 0x00,
+      // mov [rsi+0x0], rax
       0x48, 0x89, 0x46, 0x00,
-      // mov rax, 0x4
-      0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00,
-      // mov [rsi+kWordSize], rax
-      0x48, 0x89, 0x46, 0x08,
-      // mov rax, rsi
-      0x48, 0x89, 0xf0,
-      // or rax, kPairTag
-      0x48, 0x83, 0xc8, 0x01,
-      // add rsi, 2*kWordSize
+      // mov [rsi+0x8], rcx
+      0x48, 0x89, 0x4e, 0x08,
+      // lea rax, [rsi+0x1]
+      0x48, 0x8d, 0x46, 0x01,
+      // add rsi, 0x10
       0x48, 0x81, 0xc6, 0x10, 0x00, 0x00, 0x00,
-      // mov rax, [rax-1]
+      // mov rax, [rax-0x1]
       0x48, 0x8b, 0x40, 0xff,
+      // ret
+      0xc3,
+      // slow_path:
+      // mov [rsp-0x10], rax
+      0x48, 0x89, 0x44, 0x24, 0xf0,
+      // mov [rsp-0x18], r11
+      0x4c, 0x89, 0x5c, 0x24, 0xe8,
+      // mov [rsp-0x20], rcx
+      0x48, 0x89, 0x4c, 0x24, 0xe0,
+      // mov [rsp-0x28], rdi
+      0x48, 0x89, 0x7c, 0x24, 0xd8,
+      // lea rdx, [rsp-0x28]
+      0x48, 0x8d, 0x54, 0x24, 0xd8,
+      // mov rax, rsp
+      0x48, 0x89, 0xe0,
+      // sub rsp, 0x28
+      0x48, 0x81, 0xec, 0x28, 0x00, 0x00, 0x00,
+      // and rsp, -16
+      0x48, 0x83, 0xe4, 0xf0,
+      // push rax
+      0x50,
+      // push rax
+      0x50,
+      // call [rdi+0x8]
+      0xff, 0x57, 0x08,
+      // mov rsp, [rsp+0x0]
+      0x48, 0x8b, 0x64, 0x24, 0x00,
+      // mov rsi, rax
+      0x48, 0x89, 0xc6,
+      // mov rdi, [rsp-0x28]
+      0x48, 0x8b, 0x7c, 0x24, 0xd8,
+      // mov rcx, [rsp-0x20]
+      0x48, 0x8b, 0x4c, 0x24, 0xe0,
+      // mov r11, [rsp-0x18]
+      0x4c, 0x8b, 0x5c, 0x24, 0xe8,
+      // mov rax, [rsp-0x10]
+      0x48, 0x8b, 0x44, 0x24, 0xf0,
+      // jmp back to the fast path
+      0xe9, 0x9b, 0xff, 0xff, 0xff,
   };
   // clang-format on
-  EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
+  EXPECT_EQUALS_BYTES(buf, expected);
   Buffer_make_executable(buf);
   uword result = Testing_execute_entry(buf, heap);
   ASSERT_EQ_FMT(Object_encode_integer(1), result, "0x%lx");
@@ -2401,31 +6669,82 @@ TEST compile_car(Buffer *buf, uword *heap) {
   PASS();
 }
 
-TEST compile_cdr(Buffer *buf, uword *heap) {
+TEST compile_cdr(Buffer *buf, Heap *heap) {
   ASTNode *node = Reader_read("(cdr (cons 1 2))");
   int compile_result = Compile_entry(buf, node);
   ASSERT_EQ(compile_result, 0);
   // clang-format off
   byte expected[] = {
-      // mov rax, 0x2
+      // xchg rsi, rdi
+      0x48, 0x87, 0xfe,
+      // test rdi, rdi
+      0x48, 0x85, 0xff,
+      // je past the store
+      0x74, 0x04,
+      // mov [rdi+0x10], rsp
+      0x48, 0x89, 0x67, 0x10,
+      // mov rax, 0x8
+      0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00,
+      // mov rcx, rax
+      0x48, 0x89, 0xc1,
+      // mov rax, 0x4
       0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00,
-      // mov [rsi], rax
+      // cmp rsi, [rdi+0x0]
+      0x48, 0x3b, 0x77, 0x00,
+      // ja slow_path
+      0x0f, 0x87, 0x18, 0x00, 0x00, 0x00,
+      // mov [rsi+0x0], rax
       0x48, 0x89, 0x46, 0x00,
-      // mov rax, 0x4
-      0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00,
-      // mov [rsi+kWordSize], rax
-      0x48, 0x89, 0x46, 0x08,
-      // mov rax, rsi
-      0x48, 0x89, 0xf0,
-      // or rax, kPairTag
-      0x48, 0x83, 0xc8, 0x01,
-      // add rsi, 2*kWordSize
+      // mov [rsi+0x8], rcx
+      0x48, 0x89, 0x4e, 0x08,
+      // lea rax, [rsi+0x1]
+      0x48, 0x8d, 0x46, 0x01,
+      // add rsi, 0x10
       0x48, 0x81, 0xc6, 0x10, 0x00, 0x00, 0x00,
-      // mov rax, [rax+7]
+      // mov rax, [rax+0x7]
       0x48, 0x8b, 0x40, 0x07,
+      // ret
+      0xc3,
+      // slow_path:
+      // mov [rsp-0x10], rax
+      0x48, 0x89, 0x44, 0x24, 0xf0,
+      // mov [rsp-0x18], r11
+      0x4c, 0x89, 0x5c, 0x24, 0xe8,
+      // mov [rsp-0x20], rcx
+      0x48, 0x89, 0x4c, 0x24, 0xe0,
+      // mov [rsp-0x28], rdi
+      0x48, 0x89, 0x7c, 0x24, 0xd8,
+      // lea rdx, [rsp-0x28]
+      0x48, 0x8d, 0x54, 0x24, 0xd8,
+      // mov rax, rsp
+      0x48, 0x89, 0xe0,
+      // sub rsp, 0x28
+      0x48, 0x81, 0xec, 0x28, 0x00, 0x00, 0x00,
+      // and rsp, -16
+      0x48, 0x83, 0xe4, 0xf0,
+      // push rax
+      0x50,
+      // push rax
+      0x50,
+      // call [rdi+0x8]
+      0xff, 0x57, 0x08,
+      // mov rsp, [rsp+0x0]
+      0x48, 0x8b, 0x64, 0x24, 0x00,
+      // mov rsi, rax
+      0x48, 0x89, 0xc6,
+      // mov rdi, [rsp-0x28]
+      0x48, 0x8b, 0x7c, 0x24, 0xd8,
+      // mov rcx, [rsp-0x20]
+      0x48, 0x8b, 0x4c, 0x24, 0xe0,
+      // mov r11, [rsp-0x18]
+      0x4c, 0x8b, 0x5c, 0x24, 0xe8,
+      // mov rax, [rsp-0x10]
+      0x48, 0x8b, 0x44, 0x24, 0xf0,
+      // jmp back to the fast path
+      0xe9, 0x9b, 0xff, 0xff, 0xff,
   };
   // clang-format on
-  EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
+  EXPECT_EQUALS_BYTES(buf, expected);
   Buffer_make_executable(buf);
   uword result = Testing_execute_entry(buf, heap);
   ASSERT_EQ_FMT(Object_encode_integer(2), result, "0x%lx");
@@ -2435,7 +6754,7 @@ TEST compile_cdr(Buffer *buf, uword *heap) {
 
 TEST compile_code_with_no_params(Buffer *buf) {
   ASTNode *node = Reader_read("(code () 1)");
-  int compile_result = Compile_code(buf, node);
+  int compile_result = Compile_code(buf, node, /*labels=*/NULL);
   ASSERT_EQ(compile_result, 0);
   // clang-format off
   byte expected[] = {
@@ -2455,7 +6774,7 @@ TEST compile_code_with_no_params(Buffer *buf) {
 
 TEST compile_code_with_one_param(Buffer *buf) {
   ASTNode *node = Reader_read("(code (x) x)");
-  int compile_result = Compile_code(buf, node);
+  int compile_result = Compile_code(buf, node, /*labels=*/NULL);
   ASSERT_EQ(compile_result, 0);
   // clang-format off
   byte expected[] = {
@@ -2472,18 +6791,32 @@ TEST compile_code_with_one_param(Buffer *buf) {
 
 TEST compile_code_with_two_params(Buffer *buf) {
   ASTNode *node = Reader_read("(code (x y) (+ x y))");
-  int compile_result = Compile_code(buf, node);
+  int compile_result = Compile_code(buf, node, /*labels=*/NULL);
   ASSERT_EQ(compile_result, 0);
   // clang-format off
   byte expected[] = {
       // mov rax, [rsp-16]
       0x48, 0x8b, 0x44, 0x24, 0xf0,
-      // mov [rsp-24], rax
-      0x48, 0x89, 0x44, 0x24, 0xe8,
+      // mov rcx, rax
+      0x48, 0x89, 0xc1,
       // mov rax, [rsp-8]
       0x48, 0x8b, 0x44, 0x24, 0xf8,
-      // add rax, [rsp-24]
-      0x48, 0x03, 0x44, 0x24, 0xe8,
+      // Neither parameter is known to be a fixnum
+      // test al, 0x3
+      0xa8, 0x03,
+      // jne error
+      0x0f, 0x85, 0x0d, 0x00, 0x00, 0x00,
+      // test cl, 0x3
+      0xf6, 0xc1, 0x03,
+      // jne error
+      0x0f, 0x85, 0x04, 0x00, 0x00, 0x00,
+      // add rax, rcx
+      0x48, 0x01, 0xc8,
+      // ret
+      0xc3,
+      // error:
+      // mov rax, error
+      0x48, 0xc7, 0xc0, 0x3f, 0x00, 0x00, 0x00,
       // ret
       0xc3,
   };
@@ -2499,8 +6832,14 @@ TEST compile_labels_with_no_labels(Buffer *buf) {
   ASSERT_EQ(compile_result, 0);
   // clang-format off
   byte expected[] = {
-      // mov rsi, rdi
-      0x48, 0x89, 0xfe,
+      // xchg rsi, rdi
+      0x48, 0x87, 0xfe,
+      // test rdi, rdi
+      0x48, 0x85, 0xff,
+      // je past the store
+      0x74, 0x04,
+      // mov [rdi+0x10], rsp
+      0x48, 0x89, 0x67, 0x10,
       // jmp 0x00
       0xe9, 0x00, 0x00, 0x00, 0x00,
       // mov rax, 0x2
@@ -2523,8 +6862,14 @@ TEST compile_labels_with_one_label(Buffer *buf) {
   ASSERT_EQ(compile_result, 0);
   // clang-format off
   byte expected[] = {
-      // mov rsi, rdi
-      0x48, 0x89, 0xfe,
+      // xchg rsi, rdi
+      0x48, 0x87, 0xfe,
+      // test rdi, rdi
+      0x48, 0x85, 0xff,
+      // je past the store
+      0x74, 0x04,
+      // mov [rdi+0x10], rsp
+      0x48, 0x89, 0x67, 0x10,
       // jmp 0x08
       0xe9, 0x08, 0x00, 0x00, 0x00,
       // mov rax, compile(5)
@@ -2552,8 +6897,14 @@ TEST compile_labelcall_with_no_params(Buffer *buf) {
   ASSERT_EQ(compile_result, 0);
   // clang-format off
   byte expected[] = {
-      // mov rsi, rdi
-      0x48, 0x89, 0xfe,
+      // xchg rsi, rdi
+      0x48, 0x87, 0xfe,
+      // test rdi, rdi
+      0x48, 0x85, 0xff,
+      // je past the store
+      0x74, 0x04,
+      // mov [rdi+0x10], rsp
+      0x48, 0x89, 0x67, 0x10,
       // jmp 0x08
       0xe9, 0x08, 0x00, 0x00, 0x00,
       // mov rax, compile(5)
@@ -2581,8 +6932,14 @@ TEST compile_labelcall_with_no_params_and_locals(Buffer *buf) {
   ASSERT_EQ(compile_result, 0);
   // clang-format off
   byte expected[] = {
-      // mov rsi, rdi
-      0x48, 0x89, 0xfe,
+      // xchg rsi, rdi
+      0x48, 0x87, 0xfe,
+      // test rdi, rdi
+      0x48, 0x85, 0xff,
+      // je past the store
+      0x74, 0x04,
+      // mov [rdi+0x10], rsp
+      0x48, 0x89, 0x67, 0x10,
       // jmp 0x08
       0xe9, 0x08, 0x00, 0x00, 0x00,
       // mov rax, compile(5)
@@ -2591,14 +6948,18 @@ TEST compile_labelcall_with_no_params_and_locals(Buffer *buf) {
       0xc3,
       // mov rax, compile(1)
       0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00,
-      // mov [rsp-8], rax
-      0x48, 0x89, 0x44, 0x24, 0xf8,
+      // mov rcx, rax
+      0x48, 0x89, 0xc1,
+      // mov [rsp-8], rcx
+      0x48, 0x89, 0x4c, 0x24, 0xf8,
       // sub rsp, 8
       0x48, 0x81, 0xec, 0x08, 0x00, 0x00, 0x00,
       // call `const`
-      0xe8, 0xe0, 0xff, 0xff, 0xff,
+      0xe8, 0xdd, 0xff, 0xff, 0xff,
       // add rsp, 8
       0x48, 0x81, 0xc4, 0x08, 0x00, 0x00, 0x00,
+      // mov rcx, [rsp-8]
+      0x48, 0x8b, 0x4c, 0x24, 0xf8,
       // ret
       0xc3,
   };
@@ -2617,8 +6978,14 @@ TEST compile_labelcall_with_one_param(Buffer *buf) {
   ASSERT_EQ(compile_result, 0);
   // clang-format off
   byte expected[] = {
-      // mov rsi, rdi
-      0x48, 0x89, 0xfe,
+      // xchg rsi, rdi
+      0x48, 0x87, 0xfe,
+      // test rdi, rdi
+      0x48, 0x85, 0xff,
+      // je past the store
+      0x74, 0x04,
+      // mov [rdi+0x10], rsp
+      0x48, 0x89, 0x67, 0x10,
       // jmp 0x06
       0xe9, 0x06, 0x00, 0x00, 0x00,
       // mov rax, [rsp-8]
@@ -2643,6 +7010,391 @@ TEST compile_labelcall_with_one_param(Buffer *buf) {
   PASS();
 }
 
+TEST compile_labelcall_preserves_live_registers(Buffer *buf) {
+  // Both the caller and the callee keep their let bindings in rcx
+  ASTNode *node = Reader_read("(labels ((f (code (x) (let ((y 10)) (+ x y))))) "
+                              "(let ((a 1)) (+ a (labelcall f 2))))");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_entry(buf, /*heap=*/NULL);
+  ASSERT_EQ_FMT(Object_encode_integer(13), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST compile_labelcall_recursive(Buffer *buf) {
+  ASTNode *node = Reader_read(
+      "(labels ((fact (code (n) "
+      "(if (= n 0) 1 (* n (labelcall fact (sub1 n))))))) (labelcall fact 5))");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_entry(buf, /*heap=*/NULL);
+  ASSERT_EQ_FMT(Object_encode_integer(120), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST compile_labelcall_forward_and_mutually_recursive(Buffer *buf) {
+  // f calls g before g is compiled; even and odd call each other in tail
+  // position
+  ASTNode *node = Reader_read(
+      "(labels ((f (code (x) (add1 (labelcall g x)))) "
+      "(g (code (x) (* x 2))) "
+      "(even (code (n) (if (= n 0) #t (labelcall odd (sub1 n))))) "
+      "(odd (code (n) (if (= n 0) #f (labelcall even (sub1 n)))))) "
+      "(if (labelcall odd 7) (labelcall f 5) 0))");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_entry(buf, /*heap=*/NULL);
+  ASSERT_EQ_FMT(Object_encode_integer(11), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST compile_labelcall_in_tail_position_jumps(Buffer *buf) {
+  ASTNode *node = Reader_read("(labels ((id (code (x) x)) "
+                              "(f (code (x) (labelcall id (add1 x))))) "
+                              "(labelcall f 5))");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  // clang-format off
+  byte expected[] = {
+      // xchg rsi, rdi
+      0x48, 0x87, 0xfe,
+      // test rdi, rdi
+      0x48, 0x85, 0xff,
+      // je past the store
+      0x74, 0x04,
+      // mov [rdi+0x10], rsp
+      0x48, 0x89, 0x67, 0x10,
+      // jmp 0x36
+      0xe9, 0x36, 0x00, 0x00, 0x00,
+      // mov rax, [rsp-8]
+      0x48, 0x8b, 0x44, 0x24, 0xf8,
+      // ret
+      0xc3,
+      // mov rax, [rsp-8]
+      0x48, 0x8b, 0x44, 0x24, 0xf8,
+      // test al, 0x3
+      0xa8, 0x03,
+      // jne error
+      0x0f, 0x85, 0x1b, 0x00, 0x00, 0x00,
+      // add rax, compile(1)
+      0x48, 0x05, 0x04, 0x00, 0x00, 0x00,
+      // mov [rsp-16], rax
+      0x48, 0x89, 0x44, 0x24, 0xf0,
+      // mov rax, [rsp-16]
+      0x48, 0x8b, 0x44, 0x24, 0xf0,
+      // mov [rsp-8], rax
+      0x48, 0x89, 0x44, 0x24, 0xf8,
+      // jmp `id`
+      0xe9, 0xd3, 0xff, 0xff, 0xff,
+      // ret
+      0xc3,
+      // error:
+      // mov rax, error
+      0x48, 0xc7, 0xc0, 0x3f, 0x00, 0x00, 0x00,
+      // ret
+      0xc3,
+      // mov rax, compile(5)
+      0x48, 0xc7, 0xc0, 0x14, 0x00, 0x00, 0x00,
+      // mov [rsp-16], rax
+      0x48, 0x89, 0x44, 0x24, 0xf0,
+      // call `f`
+      0xe8, 0xbf, 0xff, 0xff, 0xff,
+      // ret
+      0xc3,
+  };
+  // clang-format on
+  EXPECT_EQUALS_BYTES(buf, expected);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_entry(buf, /*heap=*/NULL);
+  ASSERT_EQ_FMT(Object_encode_integer(6), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST compile_tail_recursive_loop_runs_in_constant_stack(Buffer *buf) {
+  // Without tail calls, a million frames would overflow the native stack
+  ASTNode *node = Reader_read(
+      "(labels ((loop (code (n acc) (if (= n 0) acc "
+      "(let ((m (sub1 n))) (labelcall loop m (+ acc 2)))))))"
+      " (labelcall loop 1000000 0))");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_entry(buf, /*heap=*/NULL);
+  ASSERT_EQ_FMT(Object_encode_integer(2000000), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST compile_type_proves_fixnums(void) {
+  struct {
+    const char *source;
+    Type type;
+  } cases[] = {
+      {"5", kTypeFixnum},
+      {"'a'", kTypeChar},
+      {"#t", kTypeUnknown},
+      {"x", kTypeUnknown},
+      {"(add1 x)", kTypeFixnum},
+      {"(char->integer x)", kTypeFixnum},
+      {"(integer->char x)", kTypeChar},
+      {"(* x (car x))", kTypeFixnum},
+      {"(car x)", kTypeUnknown},
+      {"(< 1 2)", kTypeUnknown},
+      {"(if x 1 (sub1 x))", kTypeFixnum},
+      {"(if x 1 'a')", kTypeUnknown},
+      {"(let ((x 1)) (+ x x))", kTypeFixnum},
+      {"(let ((y 1)) x)", kTypeUnknown},
+  };
+  for (word i = 0; i < (word)(sizeof cases / sizeof cases[0]); i++) {
+    ASTNode *node = Reader_read((char *)cases[i].source);
+    ASSERT_EQm(cases[i].source, cases[i].type,
+               Compile_type(node, /*varenv=*/NULL));
+    AST_heap_free(node);
+  }
+  PASS();
+}
+
+TEST compile_arithmetic_on_known_fixnums_has_no_guards(Buffer *buf) {
+  ASTNode *node = Reader_read("(let ((x (add1 1))) (+ x 2))");
+  int compile_result = Compile_entry(buf, node);
+  ASSERT_EQ(compile_result, 0);
+  // clang-format off
+  byte expected[] = {
+      // mov rax, compile(1)
+      0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00,
+      // add rax, compile(1)
+      0x48, 0x05, 0x04, 0x00, 0x00, 0x00,
+      // mov rcx, rax
+      0x48, 0x89, 0xc1,
+      // mov rax, compile(2)
+      0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00,
+      // mov rdx, rax
+      0x48, 0x89, 0xc2,
+      // mov rax, rcx
+      0x48, 0x89, 0xc8,
+      // add rax, rdx
+      0x48, 0x01, 0xd0,
+  };
+  // clang-format on
+  EXPECT_ENTRY_CONTAINS_CODE(buf, expected);
+  Buffer_make_executable(buf);
+  uword result = Testing_execute_expr(buf);
+  ASSERT_EQ_FMT(Object_encode_integer(4), result, "0x%lx");
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST compile_code_checks_each_variable_once(Buffer *buf) {
+  ASTNode *node = Reader_read("(code (x) (+ x x))");
+  int compile_result = Compile_code(buf, node, /*labels=*/NULL);
+  ASSERT_EQ(compile_result, 0);
+  // clang-format off
+  byte expected[] = {
+      // mov rax, [rsp-8]
+      0x48, 0x8b, 0x44, 0x24, 0xf8,
+      // mov rcx, rax
+      0x48, 0x89, 0xc1,
+      // mov rax, [rsp-8]
+      0x48, 0x8b, 0x44, 0x24, 0xf8,
+      // test al, 0x3
+      0xa8, 0x03,
+      // jne error
+      0x0f, 0x85, 0x04, 0x00, 0x00, 0x00,
+      // x is a fixnum from here on, so rcx is not checked
+      // add rax, rcx
+      0x48, 0x01, 0xc8,
+      // ret
+      0xc3,
+      // error:
+      // mov rax, error
+      0x48, 0xc7, 0xc0, 0x3f, 0x00, 0x00, 0x00,
+      // ret
+      0xc3,
+  };
+  // clang-format on
+  EXPECT_EQUALS_BYTES(buf, expected);
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST compile_arithmetic_checks_unknown_operands(void) {
+  struct {
+    const char *source;
+    uword expected;
+  } cases[] = {
+      {"(+ 1 #t)", Object_error()},
+      {"(- 'a' 1)", Object_error()},
+      {"(* (cons 1 2) 2)", Object_error()},
+      {"(< () 1)", Object_error()},
+      {"(= 1 #f)", Object_error()},
+      {"(if (< #t 1) 1 0)", Object_error()},
+      {"(add1 #t)", Object_error()},
+      {"(integer->char 'a')", Object_error()},
+      {"(char->integer 65)", Object_error()},
+      {"(labels ((f (code (x) (sub1 x)))) (labelcall f #t))", Object_error()},
+      // A check in one arm of an if says nothing about the other arm
+      {"(labels ((f (code (x y) (if y (add1 x) (sub1 x)))))"
+       " (labelcall f #t #f))",
+       Object_error()},
+      // or about what comes after the if
+      {"(labels ((f (code (x y) (let ((z (if y (add1 x) 0))) (sub1 x)))))"
+       " (labelcall f #t #f))",
+       Object_error()},
+      {"(labels ((f (code (x y) (if (< x 1) (add1 x) (sub1 x)))))"
+       " (labelcall f 5 #f))",
+       Object_encode_integer(4)},
+      {"(let ((x (car (cons 1 2)))) (+ x 3))", Object_encode_integer(4)},
+      {"(labels ((f (code (x y) (* x y)))) (labelcall f 6 7))",
+       Object_encode_integer(42)},
+      {"(char->integer (car (cons 'a' 1)))", Object_encode_integer('a')},
+  };
+  for (word i = 0; i < (word)(sizeof cases / sizeof cases[0]); i++) {
+    Buffer buf;
+    Buffer_init(&buf, 1);
+    Heap heap;
+    Heap_init(&heap, kNurserySize, kOldSize);
+    ASTNode *node = Reader_read((char *)cases[i].source);
+    ASSERT_EQm(cases[i].source, Compile_entry(&buf, node), 0);
+    Buffer_make_executable(&buf);
+    ASSERT_EQ_FMTm(cases[i].source, cases[i].expected,
+                   Testing_execute_entry(&buf, &heap), "0x%lx");
+    AST_heap_free(node);
+    Heap_deinit(&heap);
+    Buffer_deinit(&buf);
+  }
+  PASS();
+}
+
+#define ASSERT_FOLDS_TO(input, expected)                                       \
+  do {                                                                         \
+    ASTNode *__node = Reader_read(input);                                      \
+    ASTNode *__folded = Fold(__node);                                          \
+    char *__str = AST_to_cstr(__folded);                                       \
+    ASSERT_STR_EQ(expected, __str);                                            \
+    free(__str);                                                               \
+    AST_heap_free(__folded);                                                   \
+    AST_heap_free(__node);                                                     \
+  } while (0)
+
+TEST fold_arithmetic(void) {
+  ASSERT_FOLDS_TO("(+ 1 (* 2 3))", "7");
+  ASSERT_FOLDS_TO("(- (add1 5) (sub1 3))", "4");
+  ASSERT_FOLDS_TO("(+ 1 (car x))", "(+ 1 (car x))");
+  PASS();
+}
+
+TEST fold_predicates(void) {
+  ASSERT_FOLDS_TO("(zero? 0)", "true");
+  ASSERT_FOLDS_TO("(zero? 'a')", "false");
+  ASSERT_FOLDS_TO("(not 5)", "false");
+  ASSERT_FOLDS_TO("(not #f)", "true");
+  ASSERT_FOLDS_TO("(nil? ())", "true");
+  ASSERT_FOLDS_TO("(integer? 'a')", "false");
+  ASSERT_FOLDS_TO("(boolean? #t)", "true");
+  ASSERT_FOLDS_TO("(= 3 3)", "true");
+  ASSERT_FOLDS_TO("(< 3 2)", "false");
+  ASSERT_FOLDS_TO("(integer->char 97)", "'a'");
+  ASSERT_FOLDS_TO("(char->integer 'a')", "97");
+  PASS();
+}
+
+TEST fold_leaves_comparisons_of_non_integers(void) {
+  ASSERT_FOLDS_TO("(= 'a' 'a')", "(= 'a' 'a')");
+  ASSERT_FOLDS_TO("(< 'a' 'b')", "(< 'a' 'b')");
+  ASSERT_FOLDS_TO("(if (= () ()) a b)", "(if (= nil nil) a b)");
+  // So the folded program still produces the error value
+  ASTNode *node = Reader_read("(= 'a' 'a')");
+  ASTNode *folded = Fold(node);
+  Buffer buf;
+  Buffer_init(&buf, 1);
+  ASSERT_EQ(Compile_entry(&buf, folded), 0);
+  Buffer_make_executable(&buf);
+  Heap heap;
+  Heap_init(&heap, kNurserySize, kOldSize);
+  ASSERT_EQ_FMT(Object_error(), Testing_execute_entry(&buf, &heap), "0x%lx");
+  Heap_deinit(&heap);
+  Buffer_deinit(&buf);
+  AST_heap_free(folded);
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST fold_does_not_overflow_integers(void) {
+  // The product does not fit in the imm32 that a literal compiles to
+  ASSERT_FOLDS_TO("(* 536870911 536870911)", "(* 536870911 536870911)");
+  PASS();
+}
+
+TEST fold_prunes_dead_if_arms(void) {
+  ASSERT_FOLDS_TO("(if #t a b)", "a");
+  ASSERT_FOLDS_TO("(if (< 1 2) a b)", "a");
+  // Everything except #f is truthy
+  ASSERT_FOLDS_TO("(if () a b)", "a");
+  ASSERT_FOLDS_TO("(if #f a b)", "b");
+  ASSERT_FOLDS_TO("(if (car x) (+ 1 2) b)", "(if (car x) 3 b)");
+  PASS();
+}
+
+TEST fold_propagates_let_constants(void) {
+  ASSERT_FOLDS_TO("(let ((a 1) (b (cons 1 2))) (+ a (car b)))",
+                  "(let ((b (cons 1 2))) (+ 1 (car b)))");
+  ASSERT_FOLDS_TO("(let ((a 1) (b 2)) (+ a b))", "3");
+  // Inner non-constant bindings shadow outer constants
+  ASSERT_FOLDS_TO("(let ((a 1)) (let ((a (car x))) a))",
+                  "(let ((a (car x))) a)");
+  PASS();
+}
+
+TEST fold_let_is_not_let_star(void) {
+  ASSERT_FOLDS_TO("(let ((a 1) (b a)) b)", "(let ((b a)) b)");
+  PASS();
+}
+
+TEST fold_inside_labels(void) {
+  ASSERT_FOLDS_TO(
+      "(labels ((f (code (x) (+ x (* 2 3))))) (labelcall f (+ 1 1)))",
+      "(labels ((f (code (x) (+ x 6)))) (labelcall f 2))");
+  PASS();
+}
+
+TEST ir_lower_if_joins_with_block_parameter(void) {
+  ASTNode *node = Reader_read("(if #t 1 2)");
+  IRFunction fn;
+  IRFunction_init(&fn);
+  int lower_result = IR_lower(&fn, node);
+  ASSERT_EQ(lower_result, 0);
+  // entry, consequent, alternate, join
+  ASSERT_EQ(fn.num_blocks, 4);
+  IRBlock *entry = &fn.blocks[0];
+  ASSERT_EQ(fn.instrs[entry->instrs[entry->len - 1]].op, kIRBranch);
+  IRBlock *join = &fn.blocks[3];
+  ASSERT(join->param != kIRNoValue);
+  ASSERT_EQ(fn.instrs[join->param].op, kIRParam);
+  ASSERT_EQ(join->len, 1);
+  ASSERT_EQ(fn.instrs[join->instrs[0]].op, kIRReturn);
+  ASSERT_EQ(fn.instrs[join->instrs[0]].operands[0], join->param);
+  IRFunction_deinit(&fn);
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST ir_lower_labels_is_unsupported(void) {
+  ASTNode *node = Reader_read("(labels () 1)");
+  IRFunction fn;
+  IRFunction_init(&fn);
+  ASSERT_EQ(IR_lower(&fn, node), -1);
+  IRFunction_deinit(&fn);
+  AST_heap_free(node);
+  PASS();
+}
+
 SUITE(object_tests) {
   RUN_TEST(encode_positive_integer);
   RUN_TEST(encode_negative_integer);
@@ -2660,8 +7412,14 @@ TEST compile_labelcall_with_one_param_and_locals(Buffer *buf) {
   ASSERT_EQ(compile_result, 0);
   // clang-format off
   byte expected[] = {
-      // mov rsi, rdi
-      0x48, 0x89, 0xfe,
+      // xchg rsi, rdi
+      0x48, 0x87, 0xfe,
+      // test rdi, rdi
+      0x48, 0x85, 0xff,
+      // je past the store
+      0x74, 0x04,
+      // mov [rdi+0x10], rsp
+      0x48, 0x89, 0x67, 0x10,
       // jmp 0x06
       0xe9, 0x06, 0x00, 0x00, 0x00,
       // mov rax, [rsp-8]
@@ -2670,8 +7428,10 @@ TEST compile_labelcall_with_one_param_and_locals(Buffer *buf) {
       0xc3,
       // mov rax, compile(1)
       0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00,
-      // mov [rsp-8], rax
-      0x48, 0x89, 0x44, 0x24, 0xf8,
+      // mov rcx, rax
+      0x48, 0x89, 0xc1,
+      // mov [rsp-8], rcx
+      0x48, 0x89, 0x4c, 0x24, 0xf8,
       // mov rax, compile(5)
       0x48, 0xc7, 0xc0, 0x14, 0x00, 0x00, 0x00,
       // mov [rsp-24], rax
@@ -2679,9 +7439,11 @@ TEST compile_labelcall_with_one_param_and_locals(Buffer *buf) {
       // sub rsp, 8
       0x48, 0x81, 0xec, 0x08, 0x00, 0x00, 0x00,
       // call `id`
-      0xe8, 0xd6, 0xff, 0xff, 0xff,
+      0xe8, 0xd3, 0xff, 0xff, 0xff,
       // add rsp, 8
       0x48, 0x81, 0xc4, 0x08, 0x00, 0x00, 0x00,
+      // mov rcx, [rsp-8]
+      0x48, 0x8b, 0x4c, 0x24, 0xf8,
       // ret
       0xc3,
   };
@@ -2694,11 +7456,60 @@ TEST compile_labelcall_with_one_param_and_locals(Buffer *buf) {
   PASS();
 }
 
+TEST arena_alloc_is_aligned_and_zeroed(void) {
+  Arena arena;
+  Arena_init(&arena);
+  byte *first = Arena_alloc(&arena, 3);
+  byte *second = Arena_alloc(&arena, 5);
+  ASSERT_EQ((uword)first % kWordSize, 0);
+  ASSERT_EQ((uword)second % kWordSize, 0);
+  ASSERT_EQ(second - first, kWordSize);
+  for (word i = 0; i < 5; i++) {
+    ASSERT_EQ(second[i], 0);
+  }
+  Arena_release(&arena);
+  PASS();
+}
+
+TEST arena_alloc_larger_than_chunk(void) {
+  Arena arena;
+  Arena_init(&arena);
+  Arena_alloc(&arena, kWordSize);
+  byte *big = Arena_alloc(&arena, 2 * kArenaChunkSize);
+  memset(big, 0xff, 2 * kArenaChunkSize);
+  ASSERT(Arena_alloc(&arena, kWordSize) != NULL);
+  Arena_release(&arena);
+  ASSERT_EQ(arena.chunk, NULL);
+  PASS();
+}
+
+TEST ast_nodes_in_arena(void) {
+  Arena arena;
+  Arena_init(&arena);
+  ast_arena = &arena;
+  ASTNode *node = Reader_read("(let ((foo 1) (bar #t)) (cons foo bar))");
+  // No-op; the arena owns the nodes
+  AST_heap_free(node);
+  ast_arena = NULL;
+  ASSERT(AST_is_pair(node));
+  char *str = AST_to_cstr(node);
+  ASSERT_STR_EQ("(let ((foo 1) (bar true)) (cons foo bar))", str);
+  free(str);
+  Arena_release(&arena);
+  PASS();
+}
+
 SUITE(ast_tests) {
   RUN_TEST(ast_new_pair);
   RUN_TEST(ast_pair_car_returns_car);
   RUN_TEST(ast_pair_cdr_returns_cdr);
   RUN_TEST(ast_new_symbol);
+  RUN_TEST(ast_new_symbol_interns);
+  RUN_TEST(ast_new_symbol_assigns_primitive);
+  RUN_TEST(ast_symbol_table_grows);
+  RUN_TEST(arena_alloc_is_aligned_and_zeroed);
+  RUN_TEST(arena_alloc_larger_than_chunk);
+  RUN_TEST(ast_nodes_in_arena);
 }
 
 SUITE(reader_tests) {
@@ -2713,16 +7524,752 @@ SUITE(reader_tests) {
   RUN_TEST(read_with_nested_list_returns_list);
   RUN_TEST(read_with_char_returns_char);
   RUN_TEST(read_with_bool_returns_bool);
+  RUN_TEST(read_with_unterminated_list_returns_error);
+  RUN_TEST(span_matches_scalar_classification);
+  RUN_TEST(read_symbol_longer_than_atom_max_is_truncated);
+  RUN_TEST(reader_reads_forms_in_sequence);
+  RUN_TEST(reader_resumes_datum_across_chunks);
+  RUN_TEST(reader_reads_mapped_file);
+}
+
+TEST buffer_commit_keeps_only_what_was_written(void) {
+  Buffer buf;
+  Buffer_init(&buf, 1);
+  byte *p = Buffer_reserve(&buf, kMaxInstructionLength);
+  ASSERT(buf.capacity >= kMaxInstructionLength);
+  ASSERT_EQ(buf.len, 0);
+  *p++ = 0xe9;
+  p = Encode_imm32(p, 0x01020304);
+  Buffer_commit(&buf, p);
+  byte expected[] = {0xe9, 0x04, 0x03, 0x02, 0x01};
+  EXPECT_EQUALS_BYTES(&buf, expected);
+  Buffer_deinit(&buf);
+  PASS();
 }
 
 SUITE(buffer_tests) {
   RUN_BUFFER_TEST(buffer_write8_increases_length);
+  RUN_TEST(buffer_init_rounds_capacity_to_pages);
   RUN_TEST(buffer_write8_expands_buffer);
   RUN_TEST(buffer_write32_expands_buffer);
   RUN_BUFFER_TEST(buffer_write32_writes_little_endian);
+  RUN_TEST(buffer_commit_keeps_only_what_was_written);
+  RUN_TEST(buffer_init_reserved_does_not_grow);
+  RUN_TEST(buffer_init_dual_writes_through_to_exec_view);
+}
+
+// Returns prefix repeated depth times, then leaf, then suffix repeated depth
+// times. The caller frees the result.
+char *Testing_nest(const char *prefix, const char *leaf, const char *suffix,
+                   word depth) {
+  word prefix_len = strlen(prefix);
+  word leaf_len = strlen(leaf);
+  word suffix_len = strlen(suffix);
+  char *result = malloc(depth * (prefix_len + suffix_len) + leaf_len + 1);
+  char *ptr = result;
+  for (word i = 0; i < depth; i++, ptr += prefix_len) {
+    memcpy(ptr, prefix, prefix_len);
+  }
+  memcpy(ptr, leaf, leaf_len);
+  ptr += leaf_len;
+  for (word i = 0; i < depth; i++, ptr += suffix_len) {
+    memcpy(ptr, suffix, suffix_len);
+  }
+  *ptr = '\0';
+  return result;
+}
+
+TEST heap_minor_collection_promotes_live_pairs(Buffer *buf) {
+  char *source = Testing_nest("(cons 7 ", "()", ")", 100);
+  ASTNode *node = Reader_read(source);
+  ASSERT_EQ(Compile_entry(buf, node), 0);
+  Buffer_make_executable(buf);
+  Heap heap;
+  Heap_init(&heap, /*nursery_size=*/4 * kPairSize, kOldSize);
+  uword result = Testing_execute_entry(buf, &heap);
+  for (word i = 0; i < 100; i++) {
+    ASSERT(Object_is_pair(result));
+    ASSERT_EQ_FMT(Object_encode_integer(7), Object_pair_car(result), "0x%lx");
+    result = Object_pair_cdr(result);
+  }
+  ASSERT_EQ_FMT(Object_nil(), result, "0x%lx");
+  ASSERT(heap.num_minor_collections > 0);
+  ASSERT_EQ(heap.num_major_collections, 0);
+  Heap_deinit(&heap);
+  AST_heap_free(node);
+  free(source);
+  PASS();
+}
+
+TEST heap_major_collection_reclaims_garbage(Buffer *buf) {
+  // Each level allocates a new pair that stays live just long enough to get
+  // promoted, then becomes garbage
+  char *source = Testing_nest("(let ((p ", "(cons 1 2)",
+                              ")) (cons (cdr p) (cons 1 2)))", 1000);
+  ASTNode *node = Reader_read(source);
+  ASSERT_EQ(Compile_entry(buf, node), 0);
+  Buffer_make_executable(buf);
+  Heap heap;
+  // Only enough old space for a few nurseries' worth of pairs
+  Heap_init(&heap, /*nursery_size=*/4 * kPairSize,
+            /*old_size=*/16 * kPairSize);
+  uword result = Testing_execute_entry(buf, &heap);
+  ASSERT(Object_is_pair(result));
+  result = Object_pair_cdr(result);
+  ASSERT(Object_is_pair(result));
+  ASSERT_EQ_FMT(Object_encode_integer(1), Object_pair_car(result), "0x%lx");
+  ASSERT_EQ_FMT(Object_encode_integer(2), Object_pair_cdr(result), "0x%lx");
+  ASSERT(heap.num_major_collections > 0);
+  Heap_deinit(&heap);
+  AST_heap_free(node);
+  free(source);
+  PASS();
+}
+
+TEST heap_collection_updates_registers_and_stack_slots(Buffer *buf) {
+  // More bindings than temporaries, so some live on the stack
+  char *garbage =
+      Testing_nest("(car (cons (cons 0 0) ", "(cons 0 0)", "))", 200);
+  char *sum = Testing_nest(
+      "(+ (car a) (+ (car b) (+ (car c) (+ (car d) (+ (car e) (+ (car f) ",
+      "(car g)", "))))))", 1);
+  char source[8192];
+  snprintf(source, sizeof source,
+           "(let ((a (cons 1 2)) (b (cons 3 4)) (c (cons 5 6)) (d (cons 7 8)) "
+           "(e (cons 9 10)) (f (cons 11 12)) (g (cons 13 14))) "
+           "(let ((x %s)) (+ (car x) %s)))",
+           garbage, sum);
+  ASTNode *node = Reader_read(source);
+  ASSERT_EQ(Compile_entry(buf, node), 0);
+  Buffer_make_executable(buf);
+  Heap heap;
+  Heap_init(&heap, /*nursery_size=*/4 * kPairSize,
+            /*old_size=*/16 * kPairSize);
+  uword result = Testing_execute_entry(buf, &heap);
+  ASSERT_EQ_FMT(Object_encode_integer(49), result, "0x%lx");
+  ASSERT(heap.num_major_collections > 0);
+  Heap_deinit(&heap);
+  AST_heap_free(node);
+  free(sum);
+  free(garbage);
+  PASS();
+}
+
+TEST heap_grows_when_live_data_exceeds_old_space(Buffer *buf) {
+  char *source = Testing_nest("(cons 7 ", "()", ")", 100);
+  ASTNode *node = Reader_read(source);
+  ASSERT_EQ(Compile_entry(buf, node), 0);
+  Buffer_make_executable(buf);
+  Heap heap;
+  Heap_init(&heap, /*nursery_size=*/4 * kPairSize,
+            /*old_size=*/4 * kPairSize);
+  uword result = Testing_execute_entry(buf, &heap);
+  for (word i = 0; i < 100; i++) {
+    ASSERT(Object_is_pair(result));
+    ASSERT_EQ_FMT(Object_encode_integer(7), Object_pair_car(result), "0x%lx");
+    result = Object_pair_cdr(result);
+  }
+  ASSERT_EQ_FMT(Object_nil(), result, "0x%lx");
+  ASSERT((heap.old_end - heap.old) * kWordSize >= 100 * kPairSize);
+  Heap_deinit(&heap);
+  AST_heap_free(node);
+  free(source);
+  PASS();
+}
+
+TEST heap_collects_inside_labels(Buffer *buf) {
+  ASTNode *node = Reader_read(
+      "(labels ((f (code (x) (cons x (cons x x))))) (cdr (labelcall f 5)))");
+  ASSERT_EQ(Compile_entry(buf, node), 0);
+  Buffer_make_executable(buf);
+  Heap heap;
+  Heap_init(&heap, /*nursery_size=*/kPairSize, kOldSize);
+  uword result = Testing_execute_entry(buf, &heap);
+  ASSERT(Object_is_pair(result));
+  ASSERT_EQ_FMT(Object_encode_integer(5), Object_pair_car(result), "0x%lx");
+  ASSERT_EQ_FMT(Object_encode_integer(5), Object_pair_cdr(result), "0x%lx");
+  ASSERT(heap.num_minor_collections > 0);
+  Heap_deinit(&heap);
+  AST_heap_free(node);
+  PASS();
+}
+
+TEST heap_collection_stops_at_the_entry_frame(Buffer *buf) {
+  ASTNode *node = Reader_read("(cdr (cons 1 (cons 2 3)))");
+  ASSERT_EQ(Compile_entry(buf, node), 0);
+  Buffer_make_executable(buf);
+  Heap heap;
+  Heap_init(&heap, /*nursery_size=*/kPairSize, kOldSize);
+  // The entry prologue stores rsp at this offset
+  ASSERT_EQ(offsetof(Heap, stack_top), (size_t)kHeapStackTopOffset);
+  // A word in this C frame, just above the generated code's frames, that
+  // looks like the first pair in the nursery. The second cons collects that
+  // pair, so scanning this word would forward it.
+  volatile uword decoy = (uword)heap.nursery | kPairTag;
+  // Call the code directly so that nothing sits between it and this frame.
+  // See Testing_execute_entry about the cast.
+  JitFunction function = *(JitFunction *)(&buf->address);
+  uword result = function(heap.nursery, &heap);
+  ASSERT(Object_is_pair(result));
+  ASSERT(heap.num_minor_collections > 0);
+  ASSERT(heap.stack_top < (uword *)&decoy);
+  ASSERT_EQ_FMT((uword)heap.nursery | kPairTag, decoy, "0x%lx");
+  Heap_deinit(&heap);
+  AST_heap_free(node);
+  PASS();
+}
+
+SUITE(heap_tests) {
+  RUN_BUFFER_TEST(heap_minor_collection_promotes_live_pairs);
+  RUN_BUFFER_TEST(heap_major_collection_reclaims_garbage);
+  RUN_BUFFER_TEST(heap_collection_updates_registers_and_stack_slots);
+  RUN_BUFFER_TEST(heap_collection_stops_at_the_entry_frame);
+  RUN_BUFFER_TEST(heap_grows_when_live_data_exceeds_old_space);
+  RUN_BUFFER_TEST(heap_collects_inside_labels);
+}
+
+TEST code_cache_returns_cached_buffer(void) {
+  CodeCache cache;
+  CodeCache_init(&cache, kCodeCacheBudget);
+  ASSERT_EQ(CodeCache_lookup(&cache, "(+ 1 2)"), NULL);
+  Buffer buf;
+  Buffer_init(&buf, 1);
+  ASTNode *node = Reader_read("(+ 1 2)");
+  ASSERT_EQ(Compile_entry(&buf, node), 0);
+  CodeBlock *cached = CodeCache_insert(&cache, "(+ 1 2)", &buf);
+  Buffer_deinit(&buf);
+  ASSERT(cached != NULL);
+  ASSERT_EQ(CodeCache_lookup(&cache, "(+ 1 2)"), cached);
+  ASSERT_EQ(CodeCache_lookup(&cache, "(+ 1 3)"), NULL);
+  uword result =
+      Testing_execute_function(CodeBlock_function(cached), /*heap=*/NULL);
+  ASSERT_EQ_FMT(Object_encode_integer(3), result, "0x%lx");
+  ASSERT_EQ(cache.hits, 1);
+  ASSERT_EQ(cache.misses, 2);
+  CodeCache_deinit(&cache);
+  AST_heap_free(node);
+  PASS();
+}
+
+// Fill buf with size ret instructions.
+void Testing_write_rets(Buffer *buf, word size) {
+  for (word i = 0; i < size; i++) {
+    Buffer_write8(buf, 0xc3);
+  }
+}
+
+TEST code_cache_evicts_least_recently_used(void) {
+  // 20 bytes of code take up a 32-byte block
+  CodeCache cache;
+  CodeCache_init(&cache, /*budget=*/64);
+  Buffer buf;
+  Buffer_init(&buf, 1);
+  Testing_write_rets(&buf, 20);
+  ASSERT(CodeCache_insert(&cache, "a", &buf) != NULL);
+  ASSERT(CodeCache_insert(&cache, "b", &buf) != NULL);
+  // Touch a so that b is the least recently used
+  ASSERT(CodeCache_lookup(&cache, "a") != NULL);
+  ASSERT(CodeCache_insert(&cache, "c", &buf) != NULL);
+  ASSERT(CodeCache_lookup(&cache, "a") != NULL);
+  ASSERT_EQ(CodeCache_lookup(&cache, "b"), NULL);
+  ASSERT(CodeCache_lookup(&cache, "c") != NULL);
+  ASSERT_EQ(cache.size, 64);
+  Buffer_deinit(&buf);
+  CodeCache_deinit(&cache);
+  PASS();
+}
+
+TEST code_cache_does_not_take_buffers_over_budget(void) {
+  CodeCache cache;
+  CodeCache_init(&cache, /*budget=*/64);
+  Buffer buf;
+  Buffer_init(&buf, 128);
+  Testing_write_rets(&buf, 128);
+  ASSERT_EQ(CodeCache_insert(&cache, "big", &buf), NULL);
+  ASSERT_EQ(cache.num_entries, 0);
+  Buffer_deinit(&buf);
+  CodeCache_deinit(&cache);
+  PASS();
+}
+
+TEST code_cache_packs_entries_into_one_slab(void) {
+  CodeCache cache;
+  CodeCache_init(&cache, kCodeCacheBudget);
+  char source[16];
+  for (word i = 0; i < 1000; i++) {
+    Buffer buf;
+    Buffer_init(&buf, 1);
+    ASSERT_EQ(Compile_entry(&buf, AST_new_integer(i)), 0);
+    snprintf(source, sizeof source, "%ld", i);
+    ASSERT(CodeCache_insert(&cache, source, &buf) != NULL);
+    Buffer_deinit(&buf);
+  }
+  ASSERT_EQ(cache.code_heap.num_slabs, 1);
+  for (word i = 0; i < 1000; i++) {
+    snprintf(source, sizeof source, "%ld", i);
+    CodeBlock *code = CodeCache_lookup(&cache, source);
+    ASSERT(code != NULL);
+    ASSERT_EQ_FMT(Object_encode_integer(i),
+                  Testing_execute_function(CodeBlock_function(code),
+                                           /*heap=*/NULL),
+                  "0x%lx");
+  }
+  CodeCache_deinit(&cache);
+  PASS();
+}
+
+TEST code_cache_grows_buckets(void) {
+  CodeCache cache;
+  CodeCache_init(&cache, kCodeCacheBudget);
+  char source[16];
+  for (word i = 0; i < 1000; i++) {
+    Buffer buf;
+    Buffer_init(&buf, 1);
+    snprintf(source, sizeof source, "%ld", i);
+    ASSERT(CodeCache_insert(&cache, source, &buf) != NULL);
+  }
+  ASSERT(cache.num_buckets >= 1000);
+  for (word i = 0; i < 1000; i++) {
+    snprintf(source, sizeof source, "%ld", i);
+    ASSERT(CodeCache_lookup(&cache, source) != NULL);
+  }
+  CodeCache_deinit(&cache);
+  PASS();
+}
+
+TEST batch_compiles_forms_into_one_buffer(void) {
+  Reader reader;
+  Reader_init_cstr(&reader, "(+ 1 2) (labels ((f (code (x) (add1 x)))) "
+                            "(labelcall f 9)) (car (cons 4 5))");
+  Batch batch;
+  Batch_init(&batch, kBatchReservation);
+  ASSERT_EQ(Batch_add_all(&batch, &reader), 0);
+  Reader_deinit(&reader);
+  ASSERT_EQ(batch.num_entries, 3);
+  Batch_finish(&batch);
+  Heap heap;
+  Heap_init(&heap, kNurserySize, kOldSize);
+  uword expected[] = {Object_encode_integer(3), Object_encode_integer(10),
+                      Object_encode_integer(4)};
+  // Run them out of order to show that the entry points are independent
+  for (word i = 2; i >= 0; i--) {
+    JitFunction function = Batch_function(&batch, i);
+    ASSERT(function != NULL);
+    ASSERT_EQ_FMT(expected[i], Testing_execute_function(function, &heap),
+                  "0x%lx");
+  }
+  Heap_deinit(&heap);
+  Batch_deinit(&batch);
+  PASS();
+}
+
+TEST batch_skips_forms_that_fail_to_compile(void) {
+  Reader reader;
+  Reader_init_cstr(&reader, "(add1 1) (add1 x) (add1 3)");
+  Batch batch;
+  Batch_init(&batch, kBatchReservation);
+  ASSERT_EQ(Batch_add_all(&batch, &reader), 0);
+  Reader_deinit(&reader);
+  Batch_finish(&batch);
+  ASSERT_EQ(batch.num_entries, 3);
+  ASSERT_EQ(Batch_function(&batch, 1), NULL);
+  ASSERT_EQ_FMT(Object_encode_integer(4),
+                Testing_execute_function(Batch_function(&batch, 2),
+                                         /*heap=*/NULL),
+                "0x%lx");
+  Batch_deinit(&batch);
+  PASS();
+}
+
+TEST batch_runs_forms_while_adding_more(void) {
+  Batch batch;
+  Batch_init(&batch, kBatchReservation);
+  if (batch.buf.state != kDualMapped) {
+    Batch_deinit(&batch);
+    SKIPm("batch is not dual-mapped");
+  }
+  Reader reader;
+  Reader_init_cstr(&reader, "(add1 1)");
+  ASSERT_EQ(Batch_add_all(&batch, &reader), 0);
+  Reader_deinit(&reader);
+  JitFunction first = Batch_function(&batch, 0);
+  ASSERT_EQ_FMT(Object_encode_integer(2),
+                Testing_execute_function(first, /*heap=*/NULL), "0x%lx");
+  // No Batch_finish in between: the first form keeps working as more code
+  // is written after it
+  Reader_init_cstr(&reader, "(sub1 1)");
+  ASSERT_EQ(Batch_add_all(&batch, &reader), 0);
+  Reader_deinit(&reader);
+  ASSERT_EQ_FMT(Object_encode_integer(0),
+                Testing_execute_function(Batch_function(&batch, 1),
+                                         /*heap=*/NULL),
+                "0x%lx");
+  ASSERT_EQ_FMT(Object_encode_integer(2),
+                Testing_execute_function(first, /*heap=*/NULL), "0x%lx");
+  Batch_deinit(&batch);
+  PASS();
+}
+
+TEST batch_rejects_forms_that_do_not_fit(void) {
+  Batch batch;
+  Batch_init(&batch, /*reservation=*/4096);
+  if (batch.buf.state != kDualMapped) {
+    Batch_deinit(&batch);
+    SKIPm("batch is not dual-mapped");
+  }
+  // Over a page of adds, then a form small enough for what is left
+  char *big = Testing_nest("(add1 ", "x", ")", 1000);
+  char source[16384];
+  snprintf(source, sizeof source,
+           "(add1 1) (let ((x (car (cons 1 2)))) %s) (add1 3)", big);
+  free(big);
+  Reader reader;
+  Reader_init_cstr(&reader, source);
+  ASSERT_EQ(Batch_add_all(&batch, &reader), 0);
+  Reader_deinit(&reader);
+  ASSERT_EQ(batch.num_entries, 3);
+  ASSERT_EQ(Batch_function(&batch, 1), NULL);
+  ASSERT(Buffer_len(&batch.buf) <= batch.buf.capacity);
+  ASSERT_EQ_FMT(Object_encode_integer(4),
+                Testing_execute_function(Batch_function(&batch, 2),
+                                         /*heap=*/NULL),
+                "0x%lx");
+  Batch_deinit(&batch);
+  PASS();
+}
+
+TEST batch_restores_the_callers_arena(void) {
+  Arena arena;
+  Arena_init(&arena);
+  ast_arena = &arena;
+  Reader reader;
+  Reader_init_cstr(&reader, "1 (+ 1 2)");
+  Batch batch;
+  Batch_init(&batch, kBatchReservation);
+  int result = Batch_add_all(&batch, &reader);
+  Arena *after = ast_arena;
+  ast_arena = NULL;
+  ASSERT_EQ(result, 0);
+  ASSERT_EQ(after, &arena);
+  Reader_deinit(&reader);
+  Batch_deinit(&batch);
+  Arena_release(&arena);
+  PASS();
+}
+
+TEST batch_stops_at_parse_error(void) {
+  Reader reader;
+  Reader_init_cstr(&reader, "1 (2 #x) 3");
+  Batch batch;
+  Batch_init(&batch, kBatchReservation);
+  ASSERT_EQ(Batch_add_all(&batch, &reader), -1);
+  Reader_deinit(&reader);
+  ASSERT_EQ(batch.num_entries, 1);
+  Batch_deinit(&batch);
+  PASS();
+}
+
+// Find the symbol named name in an object file image, or NULL.
+Elf64_Sym *Testing_elf_find_symbol(char *image, const char *name) {
+  Elf64_Ehdr *header = (Elf64_Ehdr *)image;
+  Elf64_Shdr *sections = (Elf64_Shdr *)(image + header->e_shoff);
+  for (word i = 0; i < header->e_shnum; i++) {
+    if (sections[i].sh_type != SHT_SYMTAB) {
+      continue;
+    }
+    Elf64_Sym *syms = (Elf64_Sym *)(image + sections[i].sh_offset);
+    char *strtab = image + sections[sections[i].sh_link].sh_offset;
+    for (word j = 0; j < (word)(sections[i].sh_size / sizeof *syms); j++) {
+      if (strcmp(strtab + syms[j].st_name, name) == 0) {
+        return &syms[j];
+      }
+    }
+  }
+  return NULL;
+}
+
+TEST elf_object_exports_entry_and_labels(void) {
+  char *source =
+      "(labels ((f (code (x) (add1 x))) (g (code () 1))) (labelcall f 2))";
+  ASTNode *node = Reader_read(source);
+  char *image = NULL;
+  size_t size = 0;
+  FILE *fp = open_memstream(&image, &size);
+  ASSERT_EQ(Elf_compile_object(fp, node, "entry"), 0);
+  fclose(fp);
+  AST_heap_free(node);
+  Elf64_Ehdr *header = (Elf64_Ehdr *)image;
+  ASSERT_MEM_EQ(ELFMAG, header->e_ident, SELFMAG);
+  ASSERT_EQ(header->e_ident[EI_CLASS], ELFCLASS64);
+  ASSERT_EQ(header->e_type, ET_REL);
+  ASSERT_EQ(header->e_machine, EM_X86_64);
+  Elf64_Sym *entry = Testing_elf_find_symbol(image, "entry");
+  ASSERT(entry != NULL);
+  ASSERT_EQ(ELF64_ST_BIND(entry->st_info), STB_GLOBAL);
+  ASSERT_EQ(ELF64_ST_TYPE(entry->st_info), STT_FUNC);
+  ASSERT_EQ(entry->st_value, 0);
+  // f comes right after the prologue and the jump over the labels
+  Elf64_Sym *f = Testing_elf_find_symbol(image, "entry.f");
+  ASSERT(f != NULL);
+  ASSERT_EQ(f->st_value, sizeof kEntryPrologue + 5);
+  Elf64_Sym *g = Testing_elf_find_symbol(image, "entry.g");
+  ASSERT(g != NULL);
+  ASSERT(g->st_value > f->st_value);
+  // The .text section holds the same code that Compile_entry makes
+  Elf64_Shdr *sections = (Elf64_Shdr *)(image + header->e_shoff);
+  Elf64_Shdr *text = &sections[entry->st_shndx];
+  Buffer buf;
+  Buffer_init(&buf, 1);
+  node = Reader_read(source);
+  ASSERT_EQ(Compile_entry(&buf, node), 0);
+  AST_heap_free(node);
+  ASSERT_EQ(text->sh_size, (uword)Buffer_len(&buf));
+  ASSERT_MEM_EQ(buf.address, image + text->sh_offset, Buffer_len(&buf));
+  Buffer_deinit(&buf);
+  free(image);
+  PASS();
+}
+
+SUITE(elf_tests) {
+  RUN_TEST(elf_object_exports_entry_and_labels);
+}
+
+SUITE(batch_tests) {
+  RUN_TEST(batch_compiles_forms_into_one_buffer);
+  RUN_TEST(batch_skips_forms_that_fail_to_compile);
+  RUN_TEST(batch_runs_forms_while_adding_more);
+  RUN_TEST(batch_rejects_forms_that_do_not_fit);
+  RUN_TEST(batch_restores_the_callers_arena);
+  RUN_TEST(batch_stops_at_parse_error);
+}
+
+TEST disk_cache_round_trips_code(void) {
+  if (DiskCache_build_id() == 0) {
+    SKIPm("linked without a build ID");
+  }
+  char dir[] = "/tmp/disk-cache-test-XXXXXX";
+  ASSERT(mkdtemp(dir) != NULL);
+  const char *source = "(+ 1 2)";
+  Buffer buf;
+  ASSERT_EQ(DiskCache_load(dir, source, &buf), -1);
+  Buffer_init(&buf, 1);
+  ASTNode *node = Reader_read((char *)source);
+  ASSERT_EQ(Compile_entry(&buf, node), 0);
+  AST_heap_free(node);
+  ASSERT_EQ(DiskCache_store(dir, source, &buf), 0);
+  Buffer_deinit(&buf);
+
+  Buffer loaded;
+  ASSERT_EQ(DiskCache_load(dir, source, &loaded), 0);
+  ASSERT_EQ(loaded.state, kExecutable);
+  ASSERT_EQ_FMT(Object_encode_integer(3), Testing_execute_expr(&loaded),
+                "0x%lx");
+  Buffer_deinit(&loaded);
+  // Same file name, different source
+  ASSERT_EQ(DiskCache_load(dir, "(+ 1 3)", &loaded), -1);
+
+  char *path = DiskCache_path(dir, source);
+  unlink(path);
+  free(path);
+  rmdir(dir);
+  PASS();
+}
+
+TEST disk_cache_ignores_other_versions(void) {
+  if (DiskCache_build_id() == 0) {
+    SKIPm("linked without a build ID");
+  }
+  char dir[] = "/tmp/disk-cache-test-XXXXXX";
+  ASSERT(mkdtemp(dir) != NULL);
+  const char *source = "5";
+  Buffer buf;
+  Buffer_init(&buf, 1);
+  ASSERT_EQ(Compile_entry(&buf, Reader_read((char *)source)), 0);
+  ASSERT_EQ(DiskCache_store(dir, source, &buf), 0);
+  Buffer_deinit(&buf);
+  char *path = DiskCache_path(dir, source);
+  int fd = open(path, O_WRONLY);
+  ASSERT(fd >= 0);
+  uint32_t version = kDiskCacheVersion + 1;
+  ASSERT_EQ(pwrite(fd, &version, sizeof version,
+                   offsetof(DiskCacheHeader, version)),
+            (ssize_t)sizeof version);
+  close(fd);
+  ASSERT_EQ(DiskCache_load(dir, source, &buf), -1);
+  unlink(path);
+  free(path);
+  rmdir(dir);
+  PASS();
+}
+
+TEST disk_cache_ignores_other_builds(void) {
+  if (DiskCache_build_id() == 0) {
+    SKIPm("linked without a build ID");
+  }
+  char dir[] = "/tmp/disk-cache-test-XXXXXX";
+  ASSERT(mkdtemp(dir) != NULL);
+  const char *source = "5";
+  Buffer buf;
+  Buffer_init(&buf, 1);
+  ASSERT_EQ(Compile_entry(&buf, Reader_read((char *)source)), 0);
+  ASSERT_EQ(DiskCache_store(dir, source, &buf), 0);
+  Buffer_deinit(&buf);
+  char *path = DiskCache_path(dir, source);
+  int fd = open(path, O_WRONLY);
+  ASSERT(fd >= 0);
+  uword build_id = DiskCache_build_id() + 1;
+  ASSERT_EQ(pwrite(fd, &build_id, sizeof build_id,
+                   offsetof(DiskCacheHeader, build_id)),
+            (ssize_t)sizeof build_id);
+  close(fd);
+  ASSERT_EQ(DiskCache_load(dir, source, &buf), -1);
+  unlink(path);
+  free(path);
+  rmdir(dir);
+  PASS();
+}
+
+SUITE(code_cache_tests) {
+  RUN_TEST(code_cache_returns_cached_buffer);
+  RUN_TEST(code_cache_evicts_least_recently_used);
+  RUN_TEST(code_cache_does_not_take_buffers_over_budget);
+  RUN_TEST(code_cache_grows_buckets);
+  RUN_TEST(code_cache_packs_entries_into_one_slab);
+  RUN_TEST(disk_cache_round_trips_code);
+  RUN_TEST(disk_cache_ignores_other_versions);
+  RUN_TEST(disk_cache_ignores_other_builds);
+}
+
+TEST code_heap_sizes_classes(void) {
+  ASSERT_EQ(CodeHeap_size_class(0), 0);
+  ASSERT_EQ(CodeHeap_size_class(16), 0);
+  ASSERT_EQ(CodeHeap_size_class(17), 1);
+  ASSERT_EQ(CodeHeap_size_class(256), 15);
+  ASSERT_EQ(CodeHeap_size_class(257), 16);
+  ASSERT_EQ(CodeHeap_class_size(16), 512);
+  ASSERT_EQ(CodeHeap_size_class(kCodeHeapSlabSize), kCodeHeapNumClasses - 1);
+  ASSERT_EQ(CodeHeap_class_size(kCodeHeapNumClasses - 1), kCodeHeapSlabSize);
+  ASSERT_EQ(CodeHeap_size_class(kCodeHeapSlabSize + 1), -1);
+  ASSERT_EQ(CodeHeap_block_size(20), 32);
+  ASSERT_EQ(CodeHeap_block_size(300), 512);
+  ASSERT_EQ(CodeHeap_block_size(kCodeHeapSlabSize + 1),
+            kCodeHeapSlabSize + 16);
+  PASS();
+}
+
+TEST code_heap_packs_blocks_back_to_back(void) {
+  CodeHeap heap;
+  CodeHeap_init(&heap);
+  CodeBlock *a = CodeHeap_alloc(&heap, 20);
+  CodeBlock *b = CodeHeap_alloc(&heap, 100);
+  CodeBlock *c = CodeHeap_alloc(&heap, 1);
+  ASSERT_EQ(heap.num_slabs, 1);
+  ASSERT_EQ(a->slab, b->slab);
+  ASSERT_EQ(a->offset, 0);
+  ASSERT_EQ(b->offset, 32);
+  ASSERT_EQ(c->offset, 32 + 112);
+  ASSERT_EQ(heap.live_bytes, 32 + 112 + 16);
+  CodeHeap_deinit(&heap);
+  PASS();
+}
+
+TEST code_heap_reuses_freed_blocks_of_the_same_class(void) {
+  CodeHeap heap;
+  CodeHeap_init(&heap);
+  CodeBlock *a = CodeHeap_alloc(&heap, 20);
+  word a_offset = a->offset;
+  CodeBlock *b = CodeHeap_alloc(&heap, 20);
+  CodeHeap_free(&heap, a);
+  ASSERT_EQ(heap.free_bytes, 32);
+  // A different class does not fit in the hole
+  CodeBlock *c = CodeHeap_alloc(&heap, 40);
+  ASSERT(c->offset > b->offset);
+  // The same class does
+  CodeBlock *d = CodeHeap_alloc(&heap, 30);
+  ASSERT_EQ(d->offset, a_offset);
+  ASSERT_EQ(heap.free_bytes, 0);
+  ASSERT_EQ(heap.live_bytes, 32 + 48 + 32);
+  CodeHeap_deinit(&heap);
+  PASS();
+}
+
+TEST code_heap_gives_big_blocks_their_own_slab(void) {
+  CodeHeap heap;
+  CodeHeap_init(&heap);
+  CodeBlock *small = CodeHeap_alloc(&heap, 16);
+  CodeBlock *big = CodeHeap_alloc(&heap, kCodeHeapSlabSize + 1);
+  ASSERT_EQ(heap.num_slabs, 2);
+  ASSERT(big->slab != small->slab);
+  ASSERT_EQ(big->offset, 0);
+  // Small blocks still go in the first slab
+  ASSERT_EQ(CodeHeap_alloc(&heap, 16)->slab, small->slab);
+  CodeHeap_free(&heap, big);
+  ASSERT_EQ(heap.num_slabs, 1);
+  ASSERT_EQ(heap.free_bytes, 0);
+  CodeHeap_deinit(&heap);
+  PASS();
+}
+
+TEST code_heap_compact_slides_live_code_down(void) {
+  CodeHeap heap;
+  CodeHeap_init(&heap);
+  CodeBlock *blocks[3];
+  for (word i = 0; i < 3; i++) {
+    Buffer buf;
+    Buffer_init(&buf, 1);
+    ASSERT_EQ(Compile_entry(&buf, AST_new_integer(i)), 0);
+    blocks[i] = CodeHeap_add(&heap, &buf);
+    Buffer_deinit(&buf);
+  }
+  word size = blocks[0]->size;
+  CodeHeap_free(&heap, blocks[0]);
+  ASSERT_EQ(CodeHeap_compact(&heap), size);
+  ASSERT_EQ(heap.free_bytes, 0);
+  ASSERT_EQ(blocks[1]->offset, 0);
+  ASSERT_EQ(blocks[2]->offset, size);
+  ASSERT_EQ(blocks[1]->slab->buf.len, 2 * size);
+  for (word i = 1; i < 3; i++) {
+    ASSERT_EQ_FMT(Object_encode_integer(i),
+                  Testing_execute_function(CodeBlock_function(blocks[i]),
+                                           /*heap=*/NULL),
+                  "0x%lx");
+  }
+  CodeHeap_free(&heap, blocks[1]);
+  CodeHeap_free(&heap, blocks[2]);
+  ASSERT_EQ(CodeHeap_compact(&heap), 2 * size);
+  ASSERT_EQ(heap.num_slabs, 0);
+  ASSERT_EQ(heap.live_bytes, 0);
+  CodeHeap_deinit(&heap);
+  PASS();
+}
+
+SUITE(code_heap_tests) {
+  RUN_TEST(code_heap_sizes_classes);
+  RUN_TEST(code_heap_packs_blocks_back_to_back);
+  RUN_TEST(code_heap_reuses_freed_blocks_of_the_same_class);
+  RUN_TEST(code_heap_gives_big_blocks_their_own_slab);
+  RUN_TEST(code_heap_compact_slides_live_code_down);
+}
+
+SUITE(fold_tests) {
+  RUN_TEST(fold_arithmetic);
+  RUN_TEST(fold_predicates);
+  RUN_TEST(fold_leaves_comparisons_of_non_integers);
+  RUN_TEST(fold_does_not_overflow_integers);
+  RUN_TEST(fold_prunes_dead_if_arms);
+  RUN_TEST(fold_propagates_let_constants);
+  RUN_TEST(fold_let_is_not_let_star);
+  RUN_TEST(fold_inside_labels);
+}
+
+SUITE(ir_tests) {
+  RUN_TEST(ir_lower_if_joins_with_block_parameter);
+  RUN_TEST(ir_lower_labels_is_unsupported);
 }
 
 SUITE(compiler_tests) {
+  RUN_BUFFER_TEST(emit_with_extended_registers);
+  RUN_BUFFER_TEST(emit_byte_register_checks);
   RUN_BUFFER_TEST(compile_positive_integer);
   RUN_BUFFER_TEST(compile_negative_integer);
   RUN_BUFFER_TEST(compile_char);
@@ -2746,6 +8293,7 @@ SUITE(compiler_tests) {
   RUN_BUFFER_TEST(compile_unary_booleanp_with_non_boolean_returns_false);
   RUN_BUFFER_TEST(compile_binary_plus);
   RUN_BUFFER_TEST(compile_binary_plus_nested);
+  RUN_BUFFER_TEST(compile_binary_plus_spills_when_out_of_registers);
   RUN_BUFFER_TEST(compile_binary_minus);
   RUN_BUFFER_TEST(compile_binary_minus_nested);
   RUN_BUFFER_TEST(compile_binary_mul);
@@ -2757,15 +8305,29 @@ SUITE(compiler_tests) {
   RUN_BUFFER_TEST(compile_binary_lt_with_left_greater_than_right_returns_false);
   RUN_BUFFER_TEST(compile_symbol_in_env_returns_value);
   RUN_BUFFER_TEST(compile_symbol_in_env_returns_first_value);
+  RUN_TEST(env_bindings_are_hidden_until_shown);
+  RUN_TEST(env_finds_every_binding_after_growing);
   RUN_BUFFER_TEST(compile_symbol_not_in_env_raises_compile_error);
   RUN_BUFFER_TEST(compile_let_with_no_bindings);
   RUN_BUFFER_TEST(compile_let_with_one_binding);
   RUN_BUFFER_TEST(compile_let_with_multiple_bindings);
   RUN_BUFFER_TEST(compile_nested_let);
+  RUN_BUFFER_TEST(compile_let_keeps_binding_in_register);
+  RUN_BUFFER_TEST(compile_let_with_more_bindings_than_registers);
   RUN_BUFFER_TEST(compile_let_is_not_let_star);
+  RUN_BUFFER_TEST(compile_let_bindings_see_shadowed_outer_name);
+  RUN_BUFFER_TEST(compile_let_restores_outer_binding_after_body);
+  RUN_BUFFER_TEST(stats_count_bytes_by_expression_kind);
   RUN_BUFFER_TEST(compile_if_with_true_cond);
   RUN_BUFFER_TEST(compile_if_with_false_cond);
   RUN_BUFFER_TEST(compile_nested_if);
+  RUN_BUFFER_TEST(compile_if_with_compare_branches_on_flags);
+  RUN_BUFFER_TEST(compile_if_with_not_inverts_the_branch);
+  RUN_BUFFER_TEST(compile_if_with_zero_p_compares_to_zero);
+  RUN_TEST(compile_if_branches_on_predicates);
+  RUN_BUFFER_TEST(compile_if_does_not_fuse_compare_that_is_jumped_past);
+  RUN_BUFFER_TEST(peephole_replaces_load_of_just_stored_slot);
+  RUN_BUFFER_TEST(peephole_keeps_load_after_jump_target);
   RUN_HEAP_TEST(compile_cons);
   RUN_HEAP_TEST(compile_two_cons);
   RUN_HEAP_TEST(compile_car);
@@ -2779,10 +8341,140 @@ SUITE(compiler_tests) {
   RUN_BUFFER_TEST(compile_labelcall_with_no_params_and_locals);
   RUN_BUFFER_TEST(compile_labelcall_with_one_param);
   RUN_BUFFER_TEST(compile_labelcall_with_one_param_and_locals);
+  RUN_BUFFER_TEST(compile_labelcall_preserves_live_registers);
+  RUN_BUFFER_TEST(compile_labelcall_recursive);
+  RUN_BUFFER_TEST(compile_labelcall_forward_and_mutually_recursive);
+  RUN_BUFFER_TEST(compile_labelcall_in_tail_position_jumps);
+  RUN_BUFFER_TEST(compile_tail_recursive_loop_runs_in_constant_stack);
+  RUN_TEST(compile_type_proves_fixnums);
+  RUN_BUFFER_TEST(compile_arithmetic_on_known_fixnums_has_no_guards);
+  RUN_BUFFER_TEST(compile_code_checks_each_variable_once);
+  RUN_TEST(compile_arithmetic_checks_unknown_operands);
+}
+
+TEST bench_summarize_reports_min_median_and_p99(void) {
+  double samples[100];
+  for (word i = 0; i < 100; i++) {
+    // 1 through 100, out of order
+    samples[i] = (i * 37) % 100 + 1;
+  }
+  BenchResult result = Bench_summarize(samples, 100, /*iterations=*/8);
+  ASSERT_EQ(result.iterations, 8);
+  ASSERT_EQ(result.min_ns, 1);
+  ASSERT_EQ(result.median_ns, 51);
+  ASSERT_EQ(result.p99_ns, 99);
+  PASS();
+}
+
+BENCH count_call(void *arg) { (*(word *)arg)++; }
+
+TEST bench_run_times_many_calls_per_sample(void) {
+  word calls = 0;
+  BenchResult result = Bench_run(count_call, &calls);
+  ASSERT(result.iterations > 1);
+  ASSERT(calls >= (kBenchSamples + kBenchWarmupSamples) * result.iterations);
+  ASSERT(result.min_ns <= result.median_ns);
+  ASSERT(result.median_ns <= result.p99_ns);
+  PASS();
+}
+
+SUITE(bench_tests) {
+  RUN_TEST(bench_summarize_reports_min_median_and_p99);
+  RUN_TEST(bench_run_times_many_calls_per_sample);
 }
 
 // End Tests
 
+// Benchmarks
+
+// What each primitive is timed on. car and cdr need a pair, so their rows
+// include the cons that makes it.
+char *kPrimitiveBenchSources[kNumPrimitives] = {
+    [kPrimitiveAdd1] = "(add1 5)",
+    [kPrimitiveSub1] = "(sub1 5)",
+    [kPrimitiveIntegerToChar] = "(integer->char 65)",
+    [kPrimitiveCharToInteger] = "(char->integer 'A')",
+    [kPrimitiveIsNil] = "(nil? ())",
+    [kPrimitiveIsZero] = "(zero? 5)",
+    [kPrimitiveNot] = "(not #t)",
+    [kPrimitiveIsInteger] = "(integer? 5)",
+    [kPrimitiveIsBoolean] = "(boolean? 5)",
+    [kPrimitiveAdd] = "(+ 3 4)",
+    [kPrimitiveSub] = "(- 3 4)",
+    [kPrimitiveMul] = "(* 3 4)",
+    [kPrimitiveEqual] = "(= 3 4)",
+    [kPrimitiveLess] = "(< 3 4)",
+    [kPrimitiveCons] = "(cons 3 4)",
+    [kPrimitiveCar] = "(car (cons 3 4))",
+    [kPrimitiveCdr] = "(cdr (cons 3 4))",
+};
+
+typedef struct {
+  ASTNode *node;
+  // Compile_expr writes here, from the start, on every call
+  Buffer scratch;
+  JitFunction function;
+  Heap *heap;
+} PrimitiveBench;
+
+BENCH compile_primitive(void *arg) {
+  PrimitiveBench *bench = arg;
+  bench->scratch.len = 0;
+  num_slow_paths = 0;
+  num_error_jumps = 0;
+  num_refinements = 0;
+  int result =
+      Compile_expr(&bench->scratch, bench->node, /*stack_index=*/-kWordSize,
+                   /*reg_index=*/0, /*varenv=*/NULL, /*labels=*/NULL);
+  assert(result == 0);
+  (void)result;
+}
+
+BENCH execute_primitive(void *arg) {
+  PrimitiveBench *bench = arg;
+  (void)Testing_call_function(bench->function, bench->heap);
+}
+
+// Time compiling, then running, source. The code is not folded first, so
+// it is what Compile_expr makes of the primitive itself.
+void bench_source(const char *label, char *source, Heap *heap) {
+  PrimitiveBench bench = {.node = Reader_read(source), .heap = heap};
+  assert(!AST_is_error(bench.node));
+  Buffer_init(&bench.scratch, 64);
+  Buffer code;
+  Buffer_init(&code, 64);
+  int result = Compile_entry(&code, bench.node);
+  assert(result == 0);
+  (void)result;
+  Buffer_make_executable(&code);
+  bench.function = *(JitFunction *)(&code.exec_address);
+  char name[64];
+  snprintf(name, sizeof name, "compile %s", label);
+  Bench_report(name, compile_primitive, &bench);
+  snprintf(name, sizeof name, "execute %s", label);
+  Bench_report(name, execute_primitive, &bench);
+  Buffer_deinit(&code);
+  Buffer_deinit(&bench.scratch);
+  AST_heap_free(bench.node);
+}
+
+int run_benchmarks(void) {
+  Heap heap;
+  Heap_init(&heap, kNurserySize, kOldSize);
+  Bench_print_header(stdout);
+  // Calling into generated code and returning costs this much on its own
+  bench_source("literal", "5", &heap);
+  for (word i = 0; i < kNumPrimitives; i++) {
+    if (kPrimitiveBenchSources[i] != NULL) {
+      bench_source(kPrimitiveNames[i], kPrimitiveBenchSources[i], &heap);
+    }
+  }
+  Heap_deinit(&heap);
+  return 0;
+}
+
+// End Benchmarks
+
 typedef void (*REPL_Callback)(char *);
 
 void print_value(uword object) {
@@ -2808,12 +8500,15 @@ void print_assembly(char *line) {
     fprintf(stderr, "Parse error.\n");
     return;
   }
+  ASTNode *folded = Fold(node);
+  AST_heap_free(node);
+  node = folded;
 
-  // Compile the line
+  // Compile the line the same way compile_line does, so that the out-of-line
+  // paths are emitted and every placeholder is patched
   Buffer buf;
   Buffer_init(&buf, 1);
-  int result = Compile_expr(&buf, node, /*stack_index=*/-kWordSize,
-                            /*varenv=*/NULL, /*labels=*/NULL);
+  int result = Compile_entry(&buf, node);
   AST_heap_free(node);
   if (result < 0) {
     fprintf(stderr, "Compile error.\n");
@@ -2831,12 +8526,7 @@ void print_assembly(char *line) {
   Buffer_deinit(&buf);
 }
 
-uword *heap = NULL;
-
-void evaluate_expr(char *line) {
-  if (!heap) {
-    heap = malloc(1000 * kWordSize);
-  }
+void print_ir(char *line) {
   // Parse the line
   ASTNode *node = Reader_read(line);
   if (AST_is_error(node)) {
@@ -2844,27 +8534,102 @@ void evaluate_expr(char *line) {
     return;
   }
 
-  // Compile the line
-  Buffer buf;
-  Buffer_init(&buf, 1);
-  int compile_result = Compile_entry(&buf, node);
+  // Lower the line
+  IRFunction fn;
+  IRFunction_init(&fn);
+  int result = IR_lower(&fn, node);
   AST_heap_free(node);
-  if (compile_result < 0) {
+  if (result < 0) {
     fprintf(stderr, "Compile error.\n");
-    Buffer_deinit(&buf);
+    IRFunction_deinit(&fn);
     return;
   }
 
+  // Print the IR
+  IR_dump(&fn, stderr);
+
+  // Clean up
+  IRFunction_deinit(&fn);
+}
+
+Heap *heap = NULL;
+CodeCache *code_cache = NULL;
+// Bytes of compiled code the REPL keeps, from $LISP_CODE_CACHE_BUDGET
+word code_cache_budget = kCodeCacheBudget;
+// Where to keep compiled code across runs, from $LISP_CODE_CACHE_DIR, or NULL
+const char *disk_cache_dir = NULL;
+
+// Parse, fold, and compile line into buf. Returns 0 on success.
+int compile_line(char *line, Buffer *buf) {
+  Arena *saved_arena = ast_arena;
+  // Every AST node for this line comes from one arena
+  Arena arena;
+  Arena_init(&arena);
+  ast_arena = &arena;
+
+  // Parse and compile the line
+  ASTNode *node = Reader_read(line);
+  int result = 0;
+  if (AST_is_error(node)) {
+    fprintf(stderr, "Parse error.\n");
+    result = -1;
+  } else if (Compile_entry(buf, Fold(node)) < 0) {
+    fprintf(stderr, "Compile error.\n");
+    result = -1;
+  }
+  ast_arena = saved_arena;
+  Arena_release(&arena);
+  return result;
+}
+
+void evaluate_expr(char *line) {
+  if (!heap) {
+    heap = malloc(sizeof *heap);
+    Heap_init(heap, kNurserySize, kOldSize);
+  }
+  if (!code_cache) {
+    code_cache = malloc(sizeof *code_cache);
+    CodeCache_init(code_cache, code_cache_budget);
+  }
+  Buffer buf;
+  CodeBlock *code = CodeCache_lookup(code_cache, line);
+  bool owned = false;
+  if (code == NULL) {
+    if (disk_cache_dir == NULL ||
+        DiskCache_load(disk_cache_dir, line, &buf) < 0) {
+      Buffer_init(&buf, 1);
+      if (compile_line(line, &buf) < 0) {
+        Buffer_deinit(&buf);
+        return;
+      }
+      if (disk_cache_dir != NULL) {
+        // Best effort; a read-only cache directory just means recompiling
+        (void)DiskCache_store(disk_cache_dir, line, &buf);
+      }
+    }
+    code = CodeCache_insert(code_cache, line, &buf);
+    if (code == NULL) {
+      // Too big to cache
+      Buffer_make_executable(&buf);
+      owned = true;
+    } else {
+      Buffer_deinit(&buf);
+    }
+  }
+
   // Execute the code
-  Buffer_make_executable(&buf);
-  uword result = Testing_execute_entry(&buf, heap);
+  uword result = owned ? Testing_execute_entry(&buf, heap)
+                       : Testing_execute_function(CodeBlock_function(code),
+                                                  heap);
 
   // Print the result
   print_value(result);
   fprintf(stderr, "\n");
 
   // Clean up
-  Buffer_deinit(&buf);
+  if (owned) {
+    Buffer_deinit(&buf);
+  }
 }
 
 int repl(REPL_Callback callback) {
@@ -2877,16 +8642,176 @@ int repl(REPL_Callback callback) {
     if (nchars < 0) {
       fprintf(stderr, "Goodbye.\n");
       free(line);
-      free(heap);
+      if (heap) {
+        Heap_deinit(heap);
+        free(heap);
+      }
+      if (code_cache) {
+        CodeCache_deinit(code_cache);
+        free(code_cache);
+      }
       break;
     }
 
-    callback(line);
+    if (strcmp(line, ":stats\n") == 0) {
+      Stats_dump(stderr);
+    } else {
+      callback(line);
+    }
     free(line);
   } while (true);
   return 0;
 }
 
+// Evaluate every top-level form in the file at path, in order, printing each
+// result. The file is mapped rather than read, so it can be arbitrarily large,
+// and all of its forms are compiled into one batch before any of them runs.
+int evaluate_file(const char *path) {
+  Reader reader;
+  if (Reader_init_file(&reader, path) < 0) {
+    fprintf(stderr, "Could not open %s.\n", path);
+    return 1;
+  }
+  Batch batch;
+  Batch_init(&batch, kBatchReservation);
+  int parse_result = Batch_add_all(&batch, &reader);
+  Reader_deinit(&reader);
+  Batch_finish(&batch);
+  Heap file_heap;
+  Heap_init(&file_heap, kNurserySize, kOldSize);
+  int status = 0;
+  for (word i = 0; i < batch.num_entries; i++) {
+    JitFunction function = Batch_function(&batch, i);
+    if (function == NULL) {
+      fprintf(stderr, "Compile error.\n");
+      status = 1;
+      continue;
+    }
+    print_value(Testing_execute_function(function, &file_heap));
+    fprintf(stderr, "\n");
+  }
+  if (parse_result < 0) {
+    // There is no telling where the next form starts, so nothing after this
+    // was compiled
+    fprintf(stderr, "Parse error.\n");
+    status = 1;
+  }
+  Heap_deinit(&file_heap);
+  Batch_deinit(&batch);
+  return status;
+}
+
+// Compile the one form in the file at source_path into an object file at
+// object_path, exporting its entry point as entry_name.
+int compile_object(const char *source_path, const char *object_path,
+                   const char *entry_name) {
+  Reader reader;
+  if (Reader_init_file(&reader, source_path) < 0) {
+    fprintf(stderr, "Could not open %s.\n", source_path);
+    return 1;
+  }
+  Arena arena;
+  Arena_init(&arena);
+  ast_arena = &arena;
+  ASTNode *node = Reader_read_next(&reader);
+  int status = 0;
+  if (AST_is_error(node) || !Reader_at_end(&reader)) {
+    fprintf(stderr, "Expected exactly one form.\n");
+    status = 1;
+  } else {
+    FILE *fp = fopen(object_path, "wb");
+    if (fp == NULL) {
+      fprintf(stderr, "Could not open %s.\n", object_path);
+      status = 1;
+    } else {
+      if (Elf_compile_object(fp, Fold(node), entry_name) < 0) {
+        fprintf(stderr, "Compile error.\n");
+        status = 1;
+      }
+      if (fclose(fp) != 0) {
+        status = 1;
+      }
+      if (status != 0) {
+        remove(object_path);
+      }
+    }
+  }
+  ast_arena = NULL;
+  Arena_release(&arena);
+  Reader_deinit(&reader);
+  return status;
+}
+
+// Each phase of a benchmark is repeated this many times and the fastest run
+// is reported, which filters out most scheduling noise.
+const word kBenchRepetitions = 10;
+
+// Parse, compile, and run every form in the file at path, printing one
+// tab-separated line of per-form costs.
+int bench_file(const char *path) {
+  Reader reader;
+  if (Reader_init_file(&reader, path) < 0) {
+    fprintf(stderr, "Could not open %s.\n", path);
+    return 1;
+  }
+  Reader_deinit(&reader);
+  word best_parse_ns = INT64_MAX;
+  word best_compile_ns = INT64_MAX;
+  word best_execute_ns = INT64_MAX;
+  word num_forms = 0;
+  word code_bytes = 0;
+  Heap bench_heap;
+  Heap_init(&bench_heap, kNurserySize, kOldSize);
+  for (word rep = 0; rep < kBenchRepetitions; rep++) {
+    // The reader and the compiler account for their own time in stats
+    Stats_reset();
+    Batch batch;
+    Batch_init(&batch, kBatchReservation);
+    int result = Reader_init_file(&reader, path);
+    assert(result == 0);
+    result = Batch_add_all(&batch, &reader);
+    Reader_deinit(&reader);
+    Batch_finish(&batch);
+    for (word i = 0; result == 0 && i < batch.num_entries; i++) {
+      if (Batch_function(&batch, i) == NULL) {
+        result = -1;
+      }
+    }
+    if (result < 0 || batch.num_entries == 0) {
+      fprintf(stderr, "%s: could not compile every form.\n", path);
+      Batch_deinit(&batch);
+      Heap_deinit(&bench_heap);
+      return 1;
+    }
+    for (word i = 0; i < batch.num_entries; i++) {
+      (void)Testing_execute_function(Batch_function(&batch, i), &bench_heap);
+    }
+    num_forms = batch.num_entries;
+    code_bytes = Buffer_len(&batch.buf);
+    best_parse_ns = min(best_parse_ns, stats.phase_ns[kPhaseRead]);
+    best_compile_ns =
+        min(best_compile_ns,
+            stats.phase_ns[kPhaseFold] + stats.phase_ns[kPhaseCompile]);
+    best_execute_ns = min(best_execute_ns, stats.phase_ns[kPhaseExecute]);
+    Batch_deinit(&batch);
+  }
+  Heap_deinit(&bench_heap);
+  fprintf(stdout, "%s\t%ld\t%ld\t%ld\t%ld\t%ld\n", path, num_forms,
+          best_parse_ns / num_forms, best_compile_ns / num_forms,
+          best_execute_ns / num_forms, code_bytes);
+  return 0;
+}
+
+int bench_files(int num_paths, char **paths) {
+  fprintf(stdout, "benchmark\tforms\tparse_ns_per_form\tcompile_ns_per_form"
+                  "\texecute_ns_per_form\tcode_bytes\n");
+  int status = 0;
+  for (int i = 0; i < num_paths; i++) {
+    status |= bench_file(paths[i]);
+  }
+  return status;
+}
+
 GREATEST_MAIN_DEFS();
 
 int run_tests(int argc, char **argv) {
@@ -2896,10 +8821,18 @@ int run_tests(int argc, char **argv) {
   RUN_SUITE(reader_tests);
   RUN_SUITE(buffer_tests);
   RUN_SUITE(compiler_tests);
+  RUN_SUITE(heap_tests);
+  RUN_SUITE(fold_tests);
+  RUN_SUITE(ir_tests);
+  RUN_SUITE(code_cache_tests);
+  RUN_SUITE(code_heap_tests);
+  RUN_SUITE(batch_tests);
+  RUN_SUITE(elf_tests);
+  RUN_SUITE(bench_tests);
   GREATEST_MAIN_END();
 }
 
-int main(int argc, char **argv) {
+int run_command(int argc, char **argv) {
   if (argc == 2) {
     if (strcmp(argv[1], "--repl-assembly") == 0) {
       return repl(print_assembly);
@@ -2907,6 +8840,48 @@ int main(int argc, char **argv) {
     if (strcmp(argv[1], "--repl-eval") == 0) {
       return repl(evaluate_expr);
     }
+    if (strcmp(argv[1], "--repl-ir") == 0) {
+      return repl(print_ir);
+    }
+  }
+  if (argc == 3 && strcmp(argv[1], "--eval-file") == 0) {
+    return evaluate_file(argv[2]);
+  }
+  if (argc == 2 && strcmp(argv[1], "--bench-primitives") == 0) {
+    return run_benchmarks();
+  }
+  if (argc >= 3 && strcmp(argv[1], "--bench") == 0) {
+    return bench_files(argc - 2, argv + 2);
+  }
+  if ((argc == 4 || argc == 5) && strcmp(argv[1], "--compile-object") == 0) {
+    return compile_object(argv[2], argv[3],
+                          argc == 5 ? argv[4] : "lisp_entry");
   }
   return run_tests(argc, argv);
 }
+
+int main(int argc, char **argv) {
+  const char *budget = getenv("LISP_CODE_CACHE_BUDGET");
+  if (budget != NULL) {
+    char *end;
+    long long value = strtoll(budget, &end, 10);
+    if (*budget == '\0' || *end != '\0' || value < 0) {
+      fprintf(stderr, "Bad LISP_CODE_CACHE_BUDGET: %s\n", budget);
+      return 1;
+    }
+    code_cache_budget = value;
+  }
+  disk_cache_dir = getenv("LISP_CODE_CACHE_DIR");
+  // --stats goes first and dumps the counters once the command finishes
+  bool print_stats = argc > 1 && strcmp(argv[1], "--stats") == 0;
+  if (print_stats) {
+    argv[1] = argv[0];
+    argc--;
+    argv++;
+  }
+  int result = run_command(argc, argv);
+  if (print_stats) {
+    Stats_dump(stderr);
+  }
+  return result;
+}